@@ -0,0 +1,1380 @@
+#include "config.h"
+#ifdef USE_NATIVE_CPU
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "CPUNetwork.h"
+#include "Network.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+CPUNetwork cpu_policy_net;
+CPUNetwork cpu_value_net;
+
+namespace {
+
+/*
+    One vector of floats and the handful of operations the kernels
+    need. Without FMA a multiply and an add do the job.
+*/
+#if defined(__AVX512F__)
+using vec = __m512;
+constexpr unsigned int VECTOR_WIDTH = 16;
+const char ISA_NAME[] = "AVX-512";
+inline vec vzero() { return _mm512_setzero_ps(); }
+inline vec vload(const float * p) { return _mm512_loadu_ps(p); }
+inline void vstore(float * p, vec v) { _mm512_storeu_ps(p, v); }
+inline vec vbroadcast(float x) { return _mm512_set1_ps(x); }
+inline vec vadd(vec a, vec b) { return _mm512_add_ps(a, b); }
+inline vec vsub(vec a, vec b) { return _mm512_sub_ps(a, b); }
+inline vec vfma(vec a, vec b, vec c) { return _mm512_fmadd_ps(a, b, c); }
+inline float vsum(vec v) {
+    // _mm512_reduce_add_ps trips -Wmaybe-uninitialized in GCC's headers
+    alignas(64) float lanes[VECTOR_WIDTH];
+    _mm512_store_ps(lanes, v);
+    float sum = 0.0f;
+    for (unsigned int i = 0; i < VECTOR_WIDTH; i++) {
+        sum += lanes[i];
+    }
+    return sum;
+}
+#elif defined(__AVX__)
+using vec = __m256;
+constexpr unsigned int VECTOR_WIDTH = 8;
+inline vec vzero() { return _mm256_setzero_ps(); }
+inline vec vload(const float * p) { return _mm256_loadu_ps(p); }
+inline void vstore(float * p, vec v) { _mm256_storeu_ps(p, v); }
+inline vec vbroadcast(float x) { return _mm256_set1_ps(x); }
+inline vec vadd(vec a, vec b) { return _mm256_add_ps(a, b); }
+inline vec vsub(vec a, vec b) { return _mm256_sub_ps(a, b); }
+// MSVC has no __FMA__, but every AVX2 CPU has FMA
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+const char ISA_NAME[] = "AVX2";
+inline vec vfma(vec a, vec b, vec c) { return _mm256_fmadd_ps(a, b, c); }
+#else
+const char ISA_NAME[] = "AVX";
+inline vec vfma(vec a, vec b, vec c) {
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+}
+#endif
+inline float vsum(vec v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#elif defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+using vec = __m128;
+constexpr unsigned int VECTOR_WIDTH = 4;
+const char ISA_NAME[] = "SSE2";
+inline vec vzero() { return _mm_setzero_ps(); }
+inline vec vload(const float * p) { return _mm_loadu_ps(p); }
+inline void vstore(float * p, vec v) { _mm_storeu_ps(p, v); }
+inline vec vbroadcast(float x) { return _mm_set1_ps(x); }
+inline vec vadd(vec a, vec b) { return _mm_add_ps(a, b); }
+inline vec vsub(vec a, vec b) { return _mm_sub_ps(a, b); }
+inline vec vfma(vec a, vec b, vec c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+inline float vsum(vec s) {
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+using vec = float32x4_t;
+constexpr unsigned int VECTOR_WIDTH = 4;
+const char ISA_NAME[] = "NEON";
+inline vec vzero() { return vdupq_n_f32(0.0f); }
+inline vec vload(const float * p) { return vld1q_f32(p); }
+inline void vstore(float * p, vec v) { vst1q_f32(p, v); }
+inline vec vbroadcast(float x) { return vdupq_n_f32(x); }
+inline vec vadd(vec a, vec b) { return vaddq_f32(a, b); }
+inline vec vsub(vec a, vec b) { return vsubq_f32(a, b); }
+inline vec vfma(vec a, vec b, vec c) { return vfmaq_f32(c, a, b); }
+inline float vsum(vec v) { return vaddvq_f32(v); }
+#else
+using vec = float;
+constexpr unsigned int VECTOR_WIDTH = 1;
+const char ISA_NAME[] = "generic";
+inline vec vzero() { return 0.0f; }
+inline vec vload(const float * p) { return *p; }
+inline void vstore(float * p, vec v) { *p = v; }
+inline vec vbroadcast(float x) { return x; }
+inline vec vadd(vec a, vec b) { return a + b; }
+inline vec vsub(vec a, vec b) { return a - b; }
+inline vec vfma(vec a, vec b, vec c) { return a * b + c; }
+inline float vsum(vec v) { return v; }
+#endif
+
+/*
+    Integer kernels, summing in 32 bits. Direct convolutions multiply
+    unsigned 8 bit inputs by signed 8 bit weights, VNNI does four of
+    those and their sum in one go. Without it they are widened to 16
+    bits for a multiply-add of two, which gives the same sums.
+
+    Winograd's F(4x4, 3x3) magnifies rounding on the way back from
+    its tiles: with 8 bits a layer is some 5% off, with 12 it is
+    0.4%. So its tiles and weights get 12 bits, kept in 16 bit
+    integers and multiplied two at a time.
+
+    A 32 bit lane holds PACK inputs of one point, or the weights of
+    one output for them. store() rounds and clamps a vector of values
+    already scaled to inputs.
+
+    Below AVX2 there are no integer vectors here and the kernels are
+    plain loops, right but slower than the float ones.
+*/
+struct Int8Range {
+    static constexpr int MAX_INPUT = 255;
+    static constexpr int MAX_WEIGHT = 127;
+};
+struct Int16Range {
+    static constexpr int MAX_INPUT = 4095;
+    static constexpr int MAX_WEIGHT = 2047;
+};
+
+#if defined(__AVX512BW__)
+#define HAVE_INT_VECTORS
+using ivec = __m512i;
+inline ivec izero() { return _mm512_setzero_si512(); }
+inline ivec iload(const void * p) { return _mm512_loadu_si512(p); }
+inline ivec ibroadcast(std::int32_t lane) { return _mm512_set1_epi32(lane); }
+inline ivec madd(ivec acc, ivec x, ivec w) {
+    return _mm512_add_epi32(acc, _mm512_madd_epi16(x, w));
+}
+// Masked with every lane on, the plain conversions trip
+// -Wuninitialized in GCC's headers like _mm512_reduce_add_ps
+inline vec itof(ivec v) { return _mm512_maskz_cvtepi32_ps(0xFFFF, v); }
+inline ivec to_ints(vec v, int max) {
+    ivec i = _mm512_maskz_cvtps_epi32(0xFFFF, v);
+    i = _mm512_maskz_max_epi32(0xFFFF, i, izero());
+    return _mm512_maskz_min_epi32(0xFFFF, i, _mm512_set1_epi32(max));
+}
+inline void store_int8(std::uint8_t * p, vec v, int max) {
+    _mm_storeu_si128((__m128i *)p,
+                     _mm512_maskz_cvtepi32_epi8(0xFFFF, to_ints(v, max)));
+}
+inline void store_int16(std::int16_t * p, vec v, int max) {
+    _mm256_storeu_si256((__m256i *)p,
+                        _mm512_maskz_cvtepi32_epi16(0xFFFF, to_ints(v, max)));
+}
+#if defined(__AVX512VNNI__)
+#define HAVE_VNNI
+const char INT_ISA_NAME[] = "AVX-512 VNNI";
+inline ivec dot_int8(ivec acc, ivec x, ivec w) {
+    return _mm512_dpbusd_epi32(acc, x, w);
+}
+inline ivec dot_int16(ivec acc, ivec x, ivec w) {
+    return _mm512_dpwssd_epi32(acc, x, w);
+}
+#else
+const char INT_ISA_NAME[] = "AVX-512BW";
+#endif
+#elif defined(__AVX2__) && !defined(__AVX512F__)
+#define HAVE_INT_VECTORS
+using ivec = __m256i;
+inline ivec izero() { return _mm256_setzero_si256(); }
+inline ivec iload(const void * p) {
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+inline ivec ibroadcast(std::int32_t lane) { return _mm256_set1_epi32(lane); }
+inline ivec madd(ivec acc, ivec x, ivec w) {
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(x, w));
+}
+inline vec itof(ivec v) { return _mm256_cvtepi32_ps(v); }
+// to 16 bit integers, in order
+inline __m128i to_int16s(vec v, int max) {
+    ivec i = _mm256_max_epi32(_mm256_cvtps_epi32(v), izero());
+    i = _mm256_min_epi32(i, _mm256_set1_epi32(max));
+    return _mm_packs_epi32(_mm256_castsi256_si128(i),
+                           _mm256_extracti128_si256(i, 1));
+}
+inline void store_int8(std::uint8_t * p, vec v, int max) {
+    const __m128i i = to_int16s(v, max);
+    _mm_storel_epi64((__m128i *)p, _mm_packus_epi16(i, i));
+}
+inline void store_int16(std::int16_t * p, vec v, int max) {
+    _mm_storeu_si128((__m128i *)p, to_int16s(v, max));
+}
+#if defined(__AVXVNNI__)
+#define HAVE_VNNI
+const char INT_ISA_NAME[] = "AVX-VNNI";
+inline ivec dot_int8(ivec acc, ivec x, ivec w) {
+    return _mm256_dpbusd_avx_epi32(acc, x, w);
+}
+inline ivec dot_int16(ivec acc, ivec x, ivec w) {
+    return _mm256_dpwssd_avx_epi32(acc, x, w);
+}
+#else
+const char INT_ISA_NAME[] = "AVX2";
+#endif
+#else
+const char INT_ISA_NAME[] = "generic";
+template<typename T>
+inline void store_ints(T * p, vec v, int max) {
+    float values[VECTOR_WIDTH];
+    vstore(values, v);
+    for (unsigned int i = 0; i < VECTOR_WIDTH; i++) {
+        const long q = std::lrint(values[i]);
+        p[i] = (T)(q < 0 ? 0 : q > max ? max : q);
+    }
+}
+inline void store_int8(std::uint8_t * p, vec v, int max) {
+    store_ints(p, v, max);
+}
+inline void store_int16(std::int16_t * p, vec v, int max) {
+    store_ints(p, v, max);
+}
+#endif
+
+#if defined(HAVE_VNNI) || !defined(HAVE_INT_VECTORS)
+struct Int8 : Int8Range {
+    using input = std::uint8_t;
+    using weight = std::int8_t;
+    static constexpr unsigned int PACK = 4;
+#ifdef HAVE_VNNI
+    static ivec dot(ivec acc, ivec x, ivec w) { return dot_int8(acc, x, w); }
+#endif
+    static void store(input * p, vec v) { store_int8(p, v, MAX_INPUT); }
+};
+#else
+struct Int8 : Int8Range {
+    using input = std::int16_t;
+    using weight = std::int16_t;
+    static constexpr unsigned int PACK = 2;
+    static ivec dot(ivec acc, ivec x, ivec w) { return madd(acc, x, w); }
+    static void store(input * p, vec v) { store_int16(p, v, MAX_INPUT); }
+};
+#endif
+
+struct Int16 : Int16Range {
+    using input = std::int16_t;
+    using weight = std::int16_t;
+    static constexpr unsigned int PACK = 2;
+#if defined(HAVE_VNNI)
+    static ivec dot(ivec acc, ivec x, ivec w) { return dot_int16(acc, x, w); }
+#elif defined(HAVE_INT_VECTORS)
+    static ivec dot(ivec acc, ivec x, ivec w) { return madd(acc, x, w); }
+#endif
+    static void store(input * p, vec v) { store_int16(p, v, MAX_INPUT); }
+};
+
+// Output channels a kernel call computes, two vectors' worth
+constexpr unsigned int BLOCK = 2 * VECTOR_WIDTH;
+// Board points a kernel call computes, 19 = 5 + 5 + 5 + 4
+constexpr unsigned int TILE = 5;
+
+constexpr unsigned int WIDTH = 19;
+constexpr unsigned int BOARD_SIZE = WIDTH * WIDTH;
+// border wide enough for a 5x5 filter
+constexpr unsigned int PAD = 2;
+constexpr unsigned int GRID = WIDTH + 2 * PAD;
+constexpr unsigned int GRID_SIZE = GRID * GRID;
+
+// floats per grid point for this many channels
+constexpr size_t grid_stride(unsigned int channels) {
+    return (channels + BLOCK - 1) / BLOCK * BLOCK;
+}
+
+inline float elu(float val) {
+    return (val > 0.0f) ? val : std::exp(val) - 1.0f;
+}
+
+// A loop of its own, so the compiler can vectorize the exp
+void apply_elu(float * values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        values[i] = elu(values[i]);
+    }
+}
+
+void zero_border(float * grid, size_t stride) {
+    constexpr unsigned int edge = GRID - PAD;
+    std::fill(grid, grid + PAD * GRID * stride, 0.0f);
+    for (unsigned int y = PAD; y < edge; y++) {
+        float * row = grid + y * GRID * stride;
+        std::fill(row, row + PAD * stride, 0.0f);
+        std::fill(row + edge * stride, row + GRID * stride, 0.0f);
+    }
+    std::fill(grid + edge * GRID * stride, grid + GRID_SIZE * stride, 0.0f);
+}
+
+/*
+    BLOCK outputs for points points of a row. input is the top left
+    of the filter window of the first point, weights the block's
+    weights as [y][x][channel][BLOCK]. The accumulators stay in
+    registers: for each input value one broadcast, two FMAs.
+*/
+template<unsigned int filter_size, unsigned int channels,
+         unsigned int points>
+inline void convolve_tile(const float * input, const float * weights,
+                          const float * biases, float * output,
+                          size_t out_stride) {
+    constexpr size_t in_stride = grid_stride(channels);
+
+    vec acc0[points];
+    vec acc1[points];
+    const vec bias0 = vload(biases);
+    const vec bias1 = vload(biases + VECTOR_WIDTH);
+    for (unsigned int p = 0; p < points; p++) {
+        acc0[p] = bias0;
+        acc1[p] = bias1;
+    }
+
+    for (unsigned int fy = 0; fy < filter_size; fy++) {
+        for (unsigned int fx = 0; fx < filter_size; fx++) {
+            const float * in = input + (fy * GRID + fx) * in_stride;
+            const float * w = weights
+                + (fy * filter_size + fx) * channels * BLOCK;
+            for (unsigned int c = 0; c < channels; c++, w += BLOCK) {
+                const vec w0 = vload(w);
+                const vec w1 = vload(w + VECTOR_WIDTH);
+                for (unsigned int p = 0; p < points; p++) {
+                    const vec x = vbroadcast(in[p * in_stride + c]);
+                    acc0[p] = vfma(x, w0, acc0[p]);
+                    acc1[p] = vfma(x, w1, acc1[p]);
+                }
+            }
+        }
+    }
+
+    for (unsigned int p = 0; p < points; p++) {
+        vstore(output + p * out_stride, acc0[p]);
+        vstore(output + p * out_stride + VECTOR_WIDTH, acc1[p]);
+    }
+}
+
+/*
+    A single output is a dot product along the channels
+    for every point.
+*/
+template<unsigned int filter_size, unsigned int channels>
+inline float convolve_point(const float * input, const float * weights) {
+    static_assert(channels % VECTOR_WIDTH == 0,
+                  "channels must fill whole vectors");
+    constexpr size_t in_stride = grid_stride(channels);
+
+    vec acc = vzero();
+    for (unsigned int fy = 0; fy < filter_size; fy++) {
+        for (unsigned int fx = 0; fx < filter_size; fx++) {
+            const float * in = input + (fy * GRID + fx) * in_stride;
+            const float * w = weights + (fy * filter_size + fx) * channels;
+            for (unsigned int c = 0; c < channels; c += VECTOR_WIDTH) {
+                acc = vfma(vload(in + c), vload(w + c), acc);
+            }
+        }
+    }
+    return vsum(acc);
+}
+
+/*
+    convolve_tile in integers, Q being Int8 or Int16. The weights
+    are [y][x][channel / PACK][BLOCK][PACK], the sums go out as
+    floats, sum * scales + offsets.
+*/
+template<typename Q, unsigned int filter_size, unsigned int channels,
+         unsigned int points>
+inline void convolve_tile_int(const typename Q::input * input,
+                              const typename Q::weight * weights,
+                              const float * scales, const float * offsets,
+                              float * output, size_t out_stride) {
+    static_assert(channels % Q::PACK == 0,
+                  "channels must fill whole lanes");
+    static_assert(sizeof(typename Q::input) * Q::PACK == 4,
+                  "a lane is 32 bits");
+    constexpr size_t in_stride = grid_stride(channels);
+    constexpr unsigned int PACK = Q::PACK;
+
+#ifdef HAVE_INT_VECTORS
+    ivec acc0[points];
+    ivec acc1[points];
+    for (unsigned int p = 0; p < points; p++) {
+        acc0[p] = izero();
+        acc1[p] = izero();
+    }
+
+    for (unsigned int fy = 0; fy < filter_size; fy++) {
+        for (unsigned int fx = 0; fx < filter_size; fx++) {
+            const auto * in = input + (fy * GRID + fx) * in_stride;
+            const auto * w = weights
+                + (fy * filter_size + fx) * channels * BLOCK;
+            for (unsigned int c = 0; c < channels;
+                 c += PACK, w += BLOCK * PACK) {
+                const ivec w0 = iload(w);
+                const ivec w1 = iload(w + VECTOR_WIDTH * PACK);
+                for (unsigned int p = 0; p < points; p++) {
+                    std::int32_t lane;
+                    std::memcpy(&lane, in + p * in_stride + c, sizeof(lane));
+                    const ivec x = ibroadcast(lane);
+                    acc0[p] = Q::dot(acc0[p], x, w0);
+                    acc1[p] = Q::dot(acc1[p], x, w1);
+                }
+            }
+        }
+    }
+
+    const vec scale0 = vload(scales);
+    const vec scale1 = vload(scales + VECTOR_WIDTH);
+    const vec offset0 = vload(offsets);
+    const vec offset1 = vload(offsets + VECTOR_WIDTH);
+    for (unsigned int p = 0; p < points; p++) {
+        vstore(output + p * out_stride, vfma(itof(acc0[p]), scale0, offset0));
+        vstore(output + p * out_stride + VECTOR_WIDTH,
+               vfma(itof(acc1[p]), scale1, offset1));
+    }
+#else
+    std::int32_t acc[points][BLOCK] = {};
+    for (unsigned int fy = 0; fy < filter_size; fy++) {
+        for (unsigned int fx = 0; fx < filter_size; fx++) {
+            const auto * in = input + (fy * GRID + fx) * in_stride;
+            const auto * w = weights
+                + (fy * filter_size + fx) * channels * BLOCK;
+            for (unsigned int c = 0; c < channels; c++) {
+                const auto * wc = w + c / PACK * BLOCK * PACK + c % PACK;
+                for (unsigned int p = 0; p < points; p++) {
+                    const std::int32_t x = in[p * in_stride + c];
+                    for (unsigned int o = 0; o < BLOCK; o++) {
+                        acc[p][o] += x * wc[o * PACK];
+                    }
+                }
+            }
+        }
+    }
+
+    for (unsigned int p = 0; p < points; p++) {
+        for (unsigned int o = 0; o < BLOCK; o++) {
+            output[p * out_stride + o] = acc[p][o] * scales[o] + offsets[o];
+        }
+    }
+#endif
+}
+
+// count values to inputs, x / scale + zero given as 1 / scale and zero
+template<typename Q>
+void quantize_values(const float * values, size_t count,
+                     float inv_scale, float zero,
+                     typename Q::input * output) {
+    assert(count % VECTOR_WIDTH == 0);
+    const vec inv = vbroadcast(inv_scale);
+    const vec offset = vbroadcast(zero);
+    for (size_t i = 0; i < count; i += VECTOR_WIDTH) {
+        Q::store(output + i, vfma(vload(values + i), inv, offset));
+    }
+}
+
+/*
+    Blocked float weights, [group][block][inner][BLOCK] with groups
+    of stride outputs, to [group][block][inner / PACK][BLOCK][PACK].
+    Every output of a group gets its own scale, the largest weight
+    going to MAX_WEIGHT. The scales and the sums of the integer
+    weights come back per group and output.
+*/
+template<typename Q>
+void quantize_weights(const std::vector<float> & weights, size_t groups,
+                      size_t inner, size_t stride,
+                      typename Q::weight * output,
+                      float * scales, std::int32_t * sums) {
+    constexpr unsigned int PACK = Q::PACK;
+    assert(inner % PACK == 0);
+    for (size_t g = 0; g < groups; g++) {
+        const float * group = &weights[g * stride * inner];
+        auto * out = output + g * stride * inner;
+        for (size_t o = 0; o < stride; o++) {
+            const float * w = group + o / BLOCK * inner * BLOCK + o % BLOCK;
+            auto * q = out + o / BLOCK * inner * BLOCK + o % BLOCK * PACK;
+            float largest = 0.0f;
+            for (size_t i = 0; i < inner; i++) {
+                largest = std::max(largest, std::fabs(w[i * BLOCK]));
+            }
+            const float scale = largest / Q::MAX_WEIGHT;
+            std::int32_t sum = 0;
+            for (size_t i = 0; i < inner; i++) {
+                const long value = scale > 0.0f ?
+                    std::lrint(w[i * BLOCK] / scale) : 0;
+                q[i / PACK * BLOCK * PACK + i % PACK] =
+                    (typename Q::weight)value;
+                sum += value;
+            }
+            scales[g * stride + o] = scale;
+            sums[g * stride + o] = sum;
+        }
+    }
+}
+
+/*
+    Winograd F(4x4, 3x3), from Lavin & Gray. A 6x6 input tile d,
+    3x3 filter g and 4x4 output tile are related by
+    Y = A^T [(G g G^T) * (B^T d B)] A with * elementwise.
+*/
+constexpr unsigned int WINOGRAD_M = 4;
+constexpr unsigned int WINOGRAD_ALPHA = WINOGRAD_M + 2;
+constexpr unsigned int WINOGRAD_POINTS = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
+// 5x5 tiles cover the board, the last ones stick out into the border
+constexpr unsigned int TILES_PER_SIDE = (WIDTH + WINOGRAD_M - 1) / WINOGRAD_M;
+constexpr unsigned int WINOGRAD_TILES = TILES_PER_SIDE * TILES_PER_SIDE;
+static_assert((TILES_PER_SIDE - 1) * WINOGRAD_M + WINOGRAD_ALPHA
+              <= GRID - PAD + 1, "input tiles must fit in the grid");
+static_assert(WINOGRAD_TILES % TILE == 0,
+              "tiles go through the kernel TILE at a time");
+
+const double WINOGRAD_G[WINOGRAD_ALPHA][3] = {
+    {  1.0 / 4,        0.0,       0.0 },
+    { -1.0 / 6,  -1.0 / 6,  -1.0 / 6 },
+    { -1.0 / 6,   1.0 / 6,  -1.0 / 6 },
+    {  1.0 / 24,  1.0 / 12,  1.0 / 6 },
+    {  1.0 / 24, -1.0 / 12,  1.0 / 6 },
+    {       0.0,       0.0,       1.0 }
+};
+
+// B^T, for calibrating. The kernels use winograd_input.
+const float WINOGRAD_BT[WINOGRAD_ALPHA][WINOGRAD_ALPHA] = {
+    { 4.0f,  0.0f, -5.0f,  0.0f, 1.0f, 0.0f },
+    { 0.0f, -4.0f, -4.0f,  1.0f, 1.0f, 0.0f },
+    { 0.0f,  4.0f, -4.0f, -1.0f, 1.0f, 0.0f },
+    { 0.0f, -2.0f, -1.0f,  2.0f, 1.0f, 0.0f },
+    { 0.0f,  2.0f, -1.0f, -2.0f, 1.0f, 0.0f },
+    { 0.0f,  4.0f,  0.0f, -5.0f, 0.0f, 1.0f }
+};
+
+// B^T x, for the columns and then the rows of the input tile
+inline void winograd_input(const vec * x, int xs, vec * t, int ts) {
+    const vec two = vbroadcast(2.0f);
+    const vec four = vbroadcast(4.0f);
+    const vec minus_four = vbroadcast(-4.0f);
+    const vec minus_five = vbroadcast(-5.0f);
+    const vec x0 = x[0], x1 = x[xs], x2 = x[2 * xs];
+    const vec x3 = x[3 * xs], x4 = x[4 * xs], x5 = x[5 * xs];
+    t[0]      = vfma(four, x0, vfma(minus_five, x2, x4));
+    t[ts]     = vfma(minus_four, vadd(x1, x2), vadd(x3, x4));
+    t[2 * ts] = vfma(four, vsub(x1, x2), vsub(x4, x3));
+    t[3 * ts] = vfma(two, vsub(x3, x1), vsub(x4, x2));
+    t[4 * ts] = vfma(two, vsub(x1, x3), vsub(x4, x2));
+    t[5 * ts] = vfma(four, x1, vfma(minus_five, x3, x5));
+}
+
+// A^T m, six values to four
+inline void winograd_output(const vec * m, int ms, vec * y, int ys) {
+    const vec two = vbroadcast(2.0f);
+    const vec four = vbroadcast(4.0f);
+    const vec eight = vbroadcast(8.0f);
+    const vec sum12 = vadd(m[ms], m[2 * ms]);
+    const vec diff12 = vsub(m[ms], m[2 * ms]);
+    const vec sum34 = vadd(m[3 * ms], m[4 * ms]);
+    const vec diff34 = vsub(m[3 * ms], m[4 * ms]);
+    y[0]      = vadd(vadd(m[0], sum12), sum34);
+    y[ys]     = vfma(two, diff34, diff12);
+    y[2 * ys] = vfma(four, sum34, sum12);
+    y[3 * ys] = vadd(vfma(eight, diff34, diff12), m[5 * ms]);
+}
+
+/*
+    B^T d B for the input tiles d of batch grids. Every vector of
+    channels of a transformed tile goes to store(point, tile,
+    channel, values).
+*/
+template<unsigned int channels, typename Store>
+void winograd_transform(const float * input, size_t batch, Store store) {
+    static_assert(channels % VECTOR_WIDTH == 0,
+                  "channels must fill whole vectors");
+    constexpr size_t in_stride = grid_stride(channels);
+    // from a tile to the top left of its input tile
+    constexpr unsigned int offset = PAD - 1;
+
+    for (size_t b = 0; b < batch; b++) {
+        const float * in = input + b * GRID_SIZE * in_stride;
+        for (unsigned int ty = 0; ty < TILES_PER_SIDE; ty++) {
+            for (unsigned int tx = 0; tx < TILES_PER_SIDE; tx++) {
+                const size_t tile = (b * TILES_PER_SIDE + ty) * TILES_PER_SIDE
+                                    + tx;
+                const float * corner = in
+                    + ((ty * WINOGRAD_M + offset) * GRID
+                       + tx * WINOGRAD_M + offset) * in_stride;
+                for (unsigned int c = 0; c < channels; c += VECTOR_WIDTH) {
+                    vec d[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+                    vec t[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+                    for (unsigned int i = 0; i < WINOGRAD_ALPHA; i++) {
+                        for (unsigned int j = 0; j < WINOGRAD_ALPHA; j++) {
+                            d[i][j] = vload(corner
+                                + (i * GRID + j) * in_stride + c);
+                        }
+                    }
+                    for (unsigned int j = 0; j < WINOGRAD_ALPHA; j++) {
+                        winograd_input(&d[0][j], WINOGRAD_ALPHA,
+                                       &t[0][j], WINOGRAD_ALPHA);
+                    }
+                    for (unsigned int i = 0; i < WINOGRAD_ALPHA; i++) {
+                        winograd_input(&t[i][0], 1, &d[i][0], 1);
+                    }
+                    for (unsigned int k = 0; k < WINOGRAD_POINTS; k++) {
+                        store(k, tile, c,
+                              d[k / WINOGRAD_ALPHA][k % WINOGRAD_ALPHA]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+    A^T m A for the tiles m in M, [point][tile][output], plus the
+    biases and ELU, to batch output grids
+*/
+template<unsigned int outputs>
+void winograd_untransform(const float * M, size_t batch,
+                          const float * biases, float * output) {
+    constexpr size_t out_stride = grid_stride(outputs);
+    const size_t tiles = batch * WINOGRAD_TILES;
+
+    for (size_t b = 0; b < batch; b++) {
+        float * out = output + b * GRID_SIZE * out_stride;
+        zero_border(out, out_stride);
+        for (unsigned int ty = 0; ty < TILES_PER_SIDE; ty++) {
+            for (unsigned int tx = 0; tx < TILES_PER_SIDE; tx++) {
+                const size_t tile = (b * TILES_PER_SIDE + ty) * TILES_PER_SIDE
+                                    + tx;
+                for (unsigned int o = 0; o < out_stride; o += VECTOR_WIDTH) {
+                    vec m[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+                    vec t[WINOGRAD_M][WINOGRAD_ALPHA];
+                    vec y[WINOGRAD_M][WINOGRAD_M];
+                    for (unsigned int k = 0; k < WINOGRAD_POINTS; k++) {
+                        m[k / WINOGRAD_ALPHA][k % WINOGRAD_ALPHA] =
+                            vload(&M[(k * tiles + tile) * out_stride + o]);
+                    }
+                    for (unsigned int j = 0; j < WINOGRAD_ALPHA; j++) {
+                        winograd_output(&m[0][j], WINOGRAD_ALPHA,
+                                        &t[0][j], WINOGRAD_ALPHA);
+                    }
+                    for (unsigned int i = 0; i < WINOGRAD_M; i++) {
+                        winograd_output(&t[i][0], 1, &y[i][0], 1);
+                    }
+                    const vec bias = vload(&biases[o]);
+                    for (unsigned int i = 0; i < WINOGRAD_M; i++) {
+                        const unsigned int row = ty * WINOGRAD_M + i;
+                        for (unsigned int j = 0; j < WINOGRAD_M; j++) {
+                            const unsigned int col = tx * WINOGRAD_M + j;
+                            if (row < WIDTH && col < WIDTH) {
+                                vstore(out + ((row + PAD) * GRID + col + PAD)
+                                             * out_stride + o,
+                                       vadd(y[i][j], bias));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        for (unsigned int y = 0; y < WIDTH; y++) {
+            apply_elu(out + ((y + PAD) * GRID + PAD) * out_stride,
+                      WIDTH * out_stride);
+        }
+    }
+}
+
+// B^T d B for one channel of a tile, one value at a time
+void winograd_transform_tile(const float * corner, size_t stride,
+                             float * output) {
+    float t[WINOGRAD_ALPHA][WINOGRAD_ALPHA] = {};
+    for (unsigned int i = 0; i < WINOGRAD_ALPHA; i++) {
+        for (unsigned int k = 0; k < WINOGRAD_ALPHA; k++) {
+            for (unsigned int j = 0; j < WINOGRAD_ALPHA; j++) {
+                t[i][j] += WINOGRAD_BT[i][k] * corner[(k * GRID + j) * stride];
+            }
+        }
+    }
+    for (unsigned int i = 0; i < WINOGRAD_ALPHA; i++) {
+        for (unsigned int j = 0; j < WINOGRAD_ALPHA; j++) {
+            float value = 0.0f;
+            for (unsigned int k = 0; k < WINOGRAD_ALPHA; k++) {
+                value += t[i][k] * WINOGRAD_BT[j][k];
+            }
+            output[i * WINOGRAD_ALPHA + j] = value;
+        }
+    }
+}
+
+// Scratch for the transformed tiles, shared by all layers of a thread
+thread_local std::vector<float> winograd_in;
+thread_local std::vector<float> winograd_out;
+// and for what the integer kernels quantize
+thread_local std::vector<Int8::input> int8_in;
+thread_local std::vector<Int16::input> int16_in;
+
+}
+
+template<unsigned int filter_size,
+         unsigned int channels, unsigned int outputs>
+void CPUNetwork::convolve(const Layer & layer, size_t batch,
+                          const float * input, float * output) {
+    constexpr size_t in_stride = grid_stride(channels);
+    constexpr size_t out_stride = grid_stride(outputs);
+    // from the point to the top left of its filter window
+    constexpr unsigned int offset = PAD - filter_size / 2;
+    constexpr unsigned int filter_dim = filter_size * filter_size * channels;
+
+    for (size_t b = 0; b < batch; b++) {
+        const float * in = input + b * GRID_SIZE * in_stride;
+
+        if (outputs == 1) {
+            float * out = output + b * BOARD_SIZE;
+            for (unsigned int y = 0; y < WIDTH; y++) {
+                for (unsigned int x = 0; x < WIDTH; x++) {
+                    const float * window = in
+                        + ((y + offset) * GRID + x + offset) * in_stride;
+                    float val = layer.m_biases[0]
+                        + convolve_point<filter_size, channels>(
+                              window, &layer.m_weights[0]);
+                    out[y * WIDTH + x] = elu(val);
+                }
+            }
+            continue;
+        }
+
+        float * out = output + b * GRID_SIZE * out_stride;
+        zero_border(out, out_stride);
+        for (unsigned int y = 0; y < WIDTH; y++) {
+            const float * in_row = in
+                + ((y + offset) * GRID + offset) * in_stride;
+            float * out_row = out + ((y + PAD) * GRID + PAD) * out_stride;
+            for (unsigned int o = 0; o < out_stride; o += BLOCK) {
+                const float * weights = &layer.m_weights[o * filter_dim];
+                const float * biases = &layer.m_biases[o];
+                unsigned int x = 0;
+                for (; x + TILE <= WIDTH; x += TILE) {
+                    convolve_tile<filter_size, channels, TILE>(
+                        in_row + x * in_stride, weights, biases,
+                        out_row + x * out_stride + o, out_stride);
+                }
+                convolve_tile<filter_size, channels, WIDTH % TILE>(
+                    in_row + x * in_stride, weights, biases,
+                    out_row + x * out_stride + o, out_stride);
+            }
+            apply_elu(out_row, WIDTH * out_stride);
+        }
+    }
+}
+
+/*
+    The input tiles of all positions are transformed first. Then
+    each of the 36 points of a transformed tile is a matrix multiply,
+    (tiles x channels) by (channels x outputs), which the direct
+    kernel can do as a 1x1 convolution. The transform back adds the
+    biases.
+*/
+template<unsigned int channels, unsigned int outputs>
+void CPUNetwork::winograd(const Layer & layer, size_t batch,
+                          const float * input, float * output) {
+    constexpr size_t in_stride = grid_stride(channels);
+    constexpr size_t out_stride = grid_stride(outputs);
+    const size_t tiles = batch * WINOGRAD_TILES;
+
+    auto & V = winograd_in;
+    auto & M = winograd_out;
+    V.resize(WINOGRAD_POINTS * tiles * in_stride);
+    M.resize(WINOGRAD_POINTS * tiles * out_stride);
+
+    winograd_transform<channels>(input, batch,
+        [&V, tiles](unsigned int k, size_t tile, unsigned int c, vec d) {
+            vstore(&V[(k * tiles + tile) * in_stride + c], d);
+        });
+
+    static const float no_biases[BLOCK] = {};
+    for (unsigned int k = 0; k < WINOGRAD_POINTS; k++) {
+        const float * weights =
+            &layer.m_winograd_weights[k * out_stride * channels];
+        for (unsigned int o = 0; o < out_stride; o += BLOCK) {
+            for (size_t tile = 0; tile < tiles; tile += TILE) {
+                convolve_tile<1, channels, TILE>(
+                    &V[(k * tiles + tile) * in_stride],
+                    weights + o * channels, no_biases,
+                    &M[(k * tiles + tile) * out_stride + o], out_stride);
+            }
+        }
+    }
+
+    winograd_untransform<outputs>(&M[0], batch, &layer.m_biases[0], output);
+}
+
+/*
+    As convolve, with the input grids quantized first. The border
+    becomes the zero point, which the offsets take out again.
+*/
+template<unsigned int filter_size,
+         unsigned int channels, unsigned int outputs>
+void CPUNetwork::convolve_int8(const Layer & layer, size_t batch,
+                               const float * input, float * output) {
+    static_assert(outputs > 1, "single outputs stay float");
+    constexpr size_t in_stride = grid_stride(channels);
+    constexpr size_t out_stride = grid_stride(outputs);
+    constexpr unsigned int offset = PAD - filter_size / 2;
+    constexpr unsigned int filter_dim = filter_size * filter_size * channels;
+
+    auto & quantized = int8_in;
+    quantized.resize(batch * GRID_SIZE * in_stride);
+    quantize_values<Int8>(input, quantized.size(), layer.m_input_scales[0],
+                          layer.m_input_zeros[0], &quantized[0]);
+    const auto * all_weights = reinterpret_cast<const Int8::weight *>(
+        &layer.m_quantized_weights[0]);
+
+    for (size_t b = 0; b < batch; b++) {
+        const auto * in = &quantized[b * GRID_SIZE * in_stride];
+        float * out = output + b * GRID_SIZE * out_stride;
+        zero_border(out, out_stride);
+        for (unsigned int y = 0; y < WIDTH; y++) {
+            const auto * in_row = in
+                + ((y + offset) * GRID + offset) * in_stride;
+            float * out_row = out + ((y + PAD) * GRID + PAD) * out_stride;
+            for (unsigned int o = 0; o < out_stride; o += BLOCK) {
+                const auto * weights = all_weights + o * filter_dim;
+                const float * scales = &layer.m_quantized_scales[o];
+                const float * offsets = &layer.m_quantized_offsets[o];
+                unsigned int x = 0;
+                for (; x + TILE <= WIDTH; x += TILE) {
+                    convolve_tile_int<Int8, filter_size, channels, TILE>(
+                        in_row + x * in_stride, weights, scales, offsets,
+                        out_row + x * out_stride + o, out_stride);
+                }
+                convolve_tile_int<Int8, filter_size, channels, WIDTH % TILE>(
+                    in_row + x * in_stride, weights, scales, offsets,
+                    out_row + x * out_stride + o, out_stride);
+            }
+            apply_elu(out_row, WIDTH * out_stride);
+        }
+    }
+}
+
+/*
+    As winograd, with every point of the transformed tiles quantized
+    on its own scale. The sums come back to floats per point before
+    the transform back.
+*/
+template<unsigned int channels, unsigned int outputs>
+void CPUNetwork::winograd_int16(const Layer & layer, size_t batch,
+                                const float * input, float * output) {
+    // so channels * MAX_INPUT * MAX_WEIGHT fits in 31 bits
+    static_assert(channels <= 256, "the sums would overflow");
+    constexpr size_t in_stride = grid_stride(channels);
+    constexpr size_t out_stride = grid_stride(outputs);
+    const size_t tiles = batch * WINOGRAD_TILES;
+
+    auto & V = int16_in;
+    auto & M = winograd_out;
+    V.resize(WINOGRAD_POINTS * tiles * in_stride);
+    M.resize(WINOGRAD_POINTS * tiles * out_stride);
+
+    const float * inv_scales = &layer.m_input_scales[0];
+    const float * zeros = &layer.m_input_zeros[0];
+    winograd_transform<channels>(input, batch,
+        [&V, tiles, inv_scales, zeros](unsigned int k, size_t tile,
+                                       unsigned int c, vec d) {
+            Int16::store(&V[(k * tiles + tile) * in_stride + c],
+                         vfma(d, vbroadcast(inv_scales[k]),
+                              vbroadcast(zeros[k])));
+        });
+
+    const auto * all_weights = reinterpret_cast<const Int16::weight *>(
+        &layer.m_quantized_weights[0]);
+    for (unsigned int k = 0; k < WINOGRAD_POINTS; k++) {
+        const auto * weights = all_weights + k * out_stride * channels;
+        for (unsigned int o = 0; o < out_stride; o += BLOCK) {
+            const size_t first = k * out_stride + o;
+            const float * scales = &layer.m_quantized_scales[first];
+            const float * offsets = &layer.m_quantized_offsets[first];
+            for (size_t tile = 0; tile < tiles; tile += TILE) {
+                convolve_tile_int<Int16, 1, channels, TILE>(
+                    &V[(k * tiles + tile) * in_stride],
+                    weights + o * channels, scales, offsets,
+                    &M[(k * tiles + tile) * out_stride + o], out_stride);
+            }
+        }
+    }
+
+    winograd_untransform<outputs>(&M[0], batch, &layer.m_biases[0], output);
+}
+
+template<unsigned int inputs, unsigned int outputs>
+void CPUNetwork::innerproduct(const Layer & layer, size_t batch,
+                              const float * input, float * output) {
+    for (size_t b = 0; b < batch; b++) {
+        const float * in = input + b * inputs;
+        float * out = output + b * outputs;
+        for (unsigned int o = 0; o < outputs; o++) {
+            const float * w = &layer.m_weights[o * inputs];
+            vec acc = vzero();
+            unsigned int i = 0;
+            for (; i + VECTOR_WIDTH <= inputs; i += VECTOR_WIDTH) {
+                acc = vfma(vload(in + i), vload(w + i), acc);
+            }
+            float val = vsum(acc);
+            for (; i < inputs; i++) {
+                val += in[i] * w[i];
+            }
+            val += layer.m_biases[o];
+            if (outputs > 1) {
+                val = elu(val);
+            }
+            out[o] = val;
+        }
+    }
+}
+
+// The shapes of the networks in Network.cpp
+template void CPUNetwork::convolve<5,  32,  96>(const Layer &, size_t,
+                                                const float *, float *);
+template void CPUNetwork::convolve<3,  96, 128>(const Layer &, size_t,
+                                                const float *, float *);
+template void CPUNetwork::convolve<3, 128, 128>(const Layer &, size_t,
+                                                const float *, float *);
+template void CPUNetwork::convolve<3, 128,   1>(const Layer &, size_t,
+                                                const float *, float *);
+template void CPUNetwork::convolve<5,  32,  64>(const Layer &, size_t,
+                                                const float *, float *);
+template void CPUNetwork::convolve<3,  64,  64>(const Layer &, size_t,
+                                                const float *, float *);
+template void CPUNetwork::convolve<3,  64,   1>(const Layer &, size_t,
+                                                const float *, float *);
+template void CPUNetwork::winograd<96, 128>(const Layer &, size_t,
+                                           const float *, float *);
+template void CPUNetwork::winograd<128, 128>(const Layer &, size_t,
+                                            const float *, float *);
+template void CPUNetwork::winograd<64, 64>(const Layer &, size_t,
+                                          const float *, float *);
+template void CPUNetwork::convolve_int8<5, 32, 96>(const Layer &, size_t,
+                                                  const float *, float *);
+template void CPUNetwork::convolve_int8<5, 32, 64>(const Layer &, size_t,
+                                                  const float *, float *);
+template void CPUNetwork::winograd_int16<96, 128>(const Layer &, size_t,
+                                                 const float *, float *);
+template void CPUNetwork::winograd_int16<128, 128>(const Layer &, size_t,
+                                                  const float *, float *);
+template void CPUNetwork::winograd_int16<64, 64>(const Layer &, size_t,
+                                                const float *, float *);
+template void CPUNetwork::innerproduct<361, 256>(const Layer &, size_t,
+                                                 const float *, float *);
+template void CPUNetwork::innerproduct<256,   1>(const Layer &, size_t,
+                                                 const float *, float *);
+
+/*
+    Convolution weights go in blocks of BLOCK outputs, each block
+    [y][x][channel][output] so the kernel reads it front to back.
+    Outputs past the real ones get zero weights and biases, and so
+    zero outputs. A single output is stored [y][x][channel].
+
+    The Winograd weights are G g G^T for every filter g, laid out
+    as 36 of those blocked matrices, one per point of the tile.
+*/
+void CPUNetwork::add_layer(const Kernels & kernels, unsigned int filter_size,
+                           unsigned int channels, unsigned int outputs,
+                           const float * weights, const float * biases) {
+    const size_t weight_count = filter_size ?
+        filter_size * filter_size * channels * outputs : channels * outputs;
+    m_pushed.m_kernels = kernels;
+    m_pushed.m_filter_size = filter_size;
+    m_pushed.m_channels = channels;
+    m_pushed.m_outputs = outputs;
+    m_pushed.m_weights.assign(weights, weights + weight_count);
+    m_pushed.m_biases.assign(biases, biases + outputs);
+
+    Layer layer;
+    layer.m_kernels = kernels;
+    layer.m_kernel = float_kernel(layer);
+    layer.m_filter_size = filter_size;
+    layer.m_channels = channels;
+    layer.m_outputs = outputs;
+
+    if (filter_size == 0) {
+        layer.m_output_size = outputs;
+        layer.m_weights.assign(weights, weights + channels * outputs);
+        layer.m_biases.assign(biases, biases + outputs);
+    } else if (outputs == 1) {
+        const unsigned int filter_len = filter_size * filter_size;
+        layer.m_output_size = BOARD_SIZE;
+        layer.m_weights.resize(filter_len * channels);
+        for (unsigned int c = 0; c < channels; c++) {
+            for (unsigned int f = 0; f < filter_len; f++) {
+                layer.m_weights[f * channels + c] =
+                    weights[c * filter_len + f];
+            }
+        }
+        layer.m_biases.assign(biases, biases + 1);
+    } else {
+        const unsigned int filter_len = filter_size * filter_size;
+        const size_t stride = grid_stride(outputs);
+        layer.m_output_size = GRID_SIZE * stride;
+        layer.m_weights.assign(stride * filter_len * channels, 0.0f);
+        layer.m_biases.assign(stride, 0.0f);
+        for (unsigned int o = 0; o < outputs; o++) {
+            const size_t block = o / BLOCK * filter_len * channels * BLOCK;
+            for (unsigned int c = 0; c < channels; c++) {
+                for (unsigned int f = 0; f < filter_len; f++) {
+                    layer.m_weights[block + (f * channels + c) * BLOCK
+                                    + o % BLOCK] =
+                        weights[(o * channels + c) * filter_len + f];
+                }
+            }
+            layer.m_biases[o] = biases[o];
+        }
+    }
+
+    if (kernels.m_winograd) {
+        assert(filter_size == 3);
+        const size_t stride = grid_stride(outputs);
+        layer.m_winograd_weights.assign(WINOGRAD_POINTS * stride * channels,
+                                        0.0f);
+        for (unsigned int o = 0; o < outputs; o++) {
+            for (unsigned int c = 0; c < channels; c++) {
+                const float * g = weights + (o * channels + c) * 9;
+                // G g, then (G g) G^T
+                double gg[WINOGRAD_ALPHA][3];
+                for (unsigned int i = 0; i < WINOGRAD_ALPHA; i++) {
+                    for (unsigned int j = 0; j < 3; j++) {
+                        gg[i][j] = 0.0;
+                        for (unsigned int k = 0; k < 3; k++) {
+                            gg[i][j] += WINOGRAD_G[i][k] * g[k * 3 + j];
+                        }
+                    }
+                }
+                for (unsigned int i = 0; i < WINOGRAD_ALPHA; i++) {
+                    for (unsigned int j = 0; j < WINOGRAD_ALPHA; j++) {
+                        double u = 0.0;
+                        for (unsigned int k = 0; k < 3; k++) {
+                            u += gg[i][k] * WINOGRAD_G[j][k];
+                        }
+                        const size_t point = i * WINOGRAD_ALPHA + j;
+                        layer.m_winograd_weights[point * stride * channels
+                            + o / BLOCK * channels * BLOCK
+                            + c * BLOCK + o % BLOCK] = (float)u;
+                    }
+                }
+            }
+        }
+    }
+
+    m_layers.emplace_back(std::move(layer));
+}
+
+void CPUNetwork::add_batchnorm(unsigned int outputs, const float * means,
+                               const float * variances, float scale) {
+    assert(!m_layers.empty());
+    assert(m_pushed.m_outputs == outputs);
+    (void)outputs;
+
+    // Pack the folded weights over the layer's
+    PushedLayer folded = m_pushed;
+    Network::fold_batchnorm(folded.m_weights, folded.m_biases,
+                            means, variances, scale);
+    m_layers.pop_back();
+    add_layer(folded.m_kernels, folded.m_filter_size,
+              folded.m_channels, folded.m_outputs,
+              &folded.m_weights[0], &folded.m_biases[0]);
+}
+
+CPUNetwork::Kernel CPUNetwork::float_kernel(const Layer & layer) {
+    return layer.m_kernels.m_winograd ? layer.m_kernels.m_winograd
+                                      : layer.m_kernels.m_direct;
+}
+
+size_t CPUNetwork::scale_count(const Layer & layer) {
+    if (!layer.m_kernels.m_quantized) {
+        return 0;
+    }
+    return layer.m_kernels.m_winograd ? WINOGRAD_POINTS : 1;
+}
+
+int CPUNetwork::max_input(const Layer & layer) {
+    return layer.m_kernels.m_winograd ? Int16::MAX_INPUT : Int8::MAX_INPUT;
+}
+
+void CPUNetwork::quantize_layer(Layer & layer,
+                                const std::vector<InputScale> & scales) {
+    assert(scales.size() == scale_count(layer));
+    const size_t stride = grid_stride(layer.m_outputs);
+    const bool winograd = layer.m_kernels.m_winograd != nullptr;
+    const std::vector<float> & weights =
+        winograd ? layer.m_winograd_weights : layer.m_weights;
+    const size_t groups = scales.size();
+    const size_t inner = weights.size() / (groups * stride);
+
+    layer.m_input_scales.clear();
+    layer.m_input_zeros.clear();
+    for (const auto & scale : scales) {
+        layer.m_input_scales.push_back(1.0f / scale.m_scale);
+        layer.m_input_zeros.push_back((float)scale.m_zero);
+    }
+
+    layer.m_quantized_scales.resize(groups * stride);
+    layer.m_quantized_offsets.resize(groups * stride);
+    std::vector<std::int32_t> sums(groups * stride);
+    auto & bytes = layer.m_quantized_weights;
+    if (winograd) {
+        bytes.assign(weights.size() * sizeof(Int16::weight), 0);
+        quantize_weights<Int16>(
+            weights, groups, inner, stride,
+            reinterpret_cast<Int16::weight *>(&bytes[0]),
+            &layer.m_quantized_scales[0], &sums[0]);
+    } else {
+        bytes.assign(weights.size() * sizeof(Int8::weight), 0);
+        quantize_weights<Int8>(
+            weights, groups, inner, stride,
+            reinterpret_cast<Int8::weight *>(&bytes[0]),
+            &layer.m_quantized_scales[0], &sums[0]);
+    }
+
+    // Each zero point adds zero * sum of the weights, take it out
+    // again. Winograd adds the biases in the transform back.
+    for (size_t g = 0; g < groups; g++) {
+        for (size_t o = 0; o < stride; o++) {
+            const size_t i = g * stride + o;
+            const float scale = scales[g].m_scale * layer.m_quantized_scales[i];
+            const float bias = winograd ? 0.0f : layer.m_biases[o];
+            layer.m_quantized_scales[i] = scale;
+            layer.m_quantized_offsets[i] =
+                bias - scales[g].m_zero * sums[i] * scale;
+        }
+    }
+}
+
+void CPUNetwork::record_ranges(const std::vector<float> & input,
+                               size_t batch, Ranges & ranges) const {
+    std::vector<float> current;
+    std::vector<float> next;
+    fill_grids(input, batch, current);
+    ranges.resize(m_layers.size());
+
+    for (size_t l = 0; l < m_layers.size(); l++) {
+        const Layer & layer = m_layers[l];
+        auto & range = ranges[l];
+        // zero is always in, the border of the grids
+        range.resize(scale_count(layer), std::make_pair(0.0f, 0.0f));
+        auto widen = [](std::pair<float, float> & range, float value) {
+            range.first = std::min(range.first, value);
+            range.second = std::max(range.second, value);
+        };
+
+        const size_t stride = grid_stride(layer.m_channels);
+        if (range.size() == 1) {
+            for (size_t i = 0; i < batch * GRID_SIZE * stride; i++) {
+                widen(range[0], current[i]);
+            }
+        } else if (range.size() == WINOGRAD_POINTS) {
+            for (size_t b = 0; b < batch; b++) {
+                const float * grid = &current[b * GRID_SIZE * stride];
+                for (unsigned int ty = 0; ty < TILES_PER_SIDE; ty++) {
+                    for (unsigned int tx = 0; tx < TILES_PER_SIDE; tx++) {
+                        const float * corner = grid
+                            + ((ty * WINOGRAD_M + PAD - 1) * GRID
+                               + tx * WINOGRAD_M + PAD - 1) * stride;
+                        for (unsigned int c = 0; c < layer.m_channels; c++) {
+                            float v[WINOGRAD_POINTS];
+                            winograd_transform_tile(corner + c, stride, v);
+                            for (unsigned int k = 0; k < WINOGRAD_POINTS; k++) {
+                                widen(range[k], v[k]);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        next.resize(batch * layer.m_output_size);
+        float_kernel(layer)(layer, batch, &current[0], &next[0]);
+        std::swap(current, next);
+    }
+}
+
+CPUNetwork::Scales CPUNetwork::get_scales(const Ranges & ranges) const {
+    assert(ranges.size() <= m_layers.size());
+    Scales scales(ranges.size());
+    for (size_t l = 0; l < ranges.size(); l++) {
+        const float levels = (float)max_input(m_layers[l]);
+        for (const auto & range : ranges[l]) {
+            const float low = std::min(range.first, 0.0f);
+            const float high = std::max(range.second, 0.0f);
+            InputScale scale;
+            scale.m_scale = high > low ? (high - low) / levels : 1.0f;
+            scale.m_zero = (int)std::lrint(-low / scale.m_scale);
+            scales[l].push_back(scale);
+        }
+    }
+    return scales;
+}
+
+bool CPUNetwork::quantize(const Scales & scales) {
+    if (scales.empty()) {
+        for (auto & layer : m_layers) {
+            layer.m_kernel = float_kernel(layer);
+        }
+        return true;
+    }
+
+    for (size_t l = 0; l < m_layers.size(); l++) {
+        const size_t count = l < scales.size() ? scales[l].size() : 0;
+        if (count != scale_count(m_layers[l])) {
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            const InputScale & scale = scales[l][i];
+            if (!(scale.m_scale > 0.0f) || scale.m_zero < 0
+                || scale.m_zero > max_input(m_layers[l])) {
+                return false;
+            }
+        }
+    }
+    if (scales.size() > m_layers.size()) {
+        return false;
+    }
+
+    for (size_t l = 0; l < m_layers.size(); l++) {
+        Layer & layer = m_layers[l];
+        if (layer.m_kernels.m_quantized) {
+            quantize_layer(layer, scales[l]);
+            layer.m_kernel = layer.m_kernels.m_quantized;
+        }
+    }
+    return true;
+}
+
+bool CPUNetwork::is_quantized() const {
+    for (const auto & layer : m_layers) {
+        if (layer.m_kernel == layer.m_kernels.m_quantized) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void CPUNetwork::fill_grids(const std::vector<float> & input, size_t batch,
+                            std::vector<float> & grids) const {
+    const unsigned int channels = m_layers.front().m_channels;
+    const size_t stride = grid_stride(channels);
+    grids.assign(batch * GRID_SIZE * stride, 0.0f);
+    for (size_t b = 0; b < batch; b++) {
+        float * grid = &grids[b * GRID_SIZE * stride];
+        for (unsigned int c = 0; c < channels; c++) {
+            const float * plane = &input[(c * batch + b) * BOARD_SIZE];
+            for (unsigned int y = 0; y < WIDTH; y++) {
+                for (unsigned int x = 0; x < WIDTH; x++) {
+                    grid[((y + PAD) * GRID + x + PAD) * stride + c] =
+                        plane[y * WIDTH + x];
+                }
+            }
+        }
+    }
+}
+
+void CPUNetwork::forward(const std::vector<float> & input, size_t batch,
+                         std::vector<float> & output) const {
+    assert(!m_layers.empty());
+    // Search threads evaluate single positions next to the queue
+    static thread_local std::vector<float> buffers[2];
+
+    fill_grids(input, batch, buffers[0]);
+
+    int current = 0;
+    for (const auto & layer : m_layers) {
+        auto & next = buffers[1 - current];
+        if (next.size() < batch * layer.m_output_size) {
+            next.resize(batch * layer.m_output_size);
+        }
+        layer.m_kernel(layer, batch, &buffers[current][0], &next[0]);
+        current = 1 - current;
+    }
+
+    const size_t size = batch * m_layers.back().m_output_size;
+    output.assign(buffers[current].begin(), buffers[current].begin() + size);
+}
+
+void CPUNetwork::check_layers(const std::vector<float> & input, size_t batch,
+                              int repeats) const {
+    using Clock = std::chrono::steady_clock;
+    std::vector<float> current;
+    std::vector<float> next;
+    std::vector<float> other;
+    fill_grids(input, batch, current);
+
+    // ms per run of kernel
+    auto time = [&](const Layer & layer, Kernel kernel,
+                    std::vector<float> & output) {
+        auto start = Clock::now();
+        for (int i = 0; i < repeats; i++) {
+            kernel(layer, batch, &current[0], &output[0]);
+        }
+        std::chrono::duration<double, std::milli> elapsed =
+            Clock::now() - start;
+        return elapsed.count() / repeats;
+    };
+
+    auto kernel_name = [](const Layer & layer, Kernel kernel) -> const char * {
+        if (kernel == layer.m_kernels.m_quantized) {
+            return layer.m_kernels.m_winograd ? "int16" : "int8";
+        }
+        return kernel == layer.m_kernels.m_winograd ? "winograd" : "direct";
+    };
+
+    myprintf("%-22s %9s %9s %9s %9s %10s\n",
+             "layer", "kernel", "ms", "reference", "ms", "max diff");
+    double total = 0.0;
+    double total_reference = 0.0;
+    for (const auto & layer : m_layers) {
+        std::string name;
+        if (layer.m_filter_size) {
+            name = "conv " + std::to_string(layer.m_filter_size) + "x"
+                   + std::to_string(layer.m_filter_size) + " ";
+        } else {
+            name = "innerproduct ";
+        }
+        name += std::to_string(layer.m_channels) + "->"
+                + std::to_string(layer.m_outputs);
+
+        // integers against float, Winograd against direct
+        Kernel reference = nullptr;
+        if (layer.m_kernel == layer.m_kernels.m_quantized) {
+            reference = float_kernel(layer);
+        } else if (layer.m_kernel == layer.m_kernels.m_winograd) {
+            reference = layer.m_kernels.m_direct;
+        }
+
+        next.resize(batch * layer.m_output_size);
+        double ms = time(layer, layer.m_kernel, next);
+        total += ms;
+        if (!reference) {
+            total_reference += ms;
+            myprintf("%-22s %9s %9.3f\n", name.c_str(),
+                     kernel_name(layer, layer.m_kernel), ms);
+        } else {
+            other.resize(next.size());
+            double reference_ms = time(layer, reference, other);
+            total_reference += reference_ms;
+            float diff = 0.0f;
+            for (size_t i = 0; i < next.size(); i++) {
+                diff = std::max(diff, std::fabs(next[i] - other[i]));
+            }
+            myprintf("%-22s %9s %9.3f %9s %9.3f %10.2g\n", name.c_str(),
+                     kernel_name(layer, layer.m_kernel), ms,
+                     kernel_name(layer, reference), reference_ms, diff);
+        }
+        std::swap(current, next);
+    }
+    myprintf("%-22s %9s %9.3f %9s %9.3f\n", "total", "", total, "",
+             total_reference);
+}
+
+std::string CPUNetwork::get_isa() {
+    return std::string(ISA_NAME);
+}
+
+std::string CPUNetwork::get_int8_isa() {
+    return std::string(INT_ISA_NAME);
+}
+
+#endif
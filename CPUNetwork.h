@@ -0,0 +1,286 @@
+#ifndef CPUNETWORK_H_INCLUDED
+#define CPUNETWORK_H_INCLUDED
+
+#include "config.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+    The networks on the CPU without a BLAS library. Each layer runs
+    a kernel instantiated for its filter size and channel counts, so
+    every loop bound is a constant. The instruction set (AVX-512,
+    AVX2, AVX, SSE2, NEON or plain C++) is whatever the compiler
+    targets, -march=native picks the best one for the machine.
+
+    Between layers every position is a 23x23 grid, the board plus a
+    zero border for the 5x5 filters, with the channels of a point
+    next to each other.
+
+    3x3 convolutions use Winograd's F(4x4, 3x3): the board is cut
+    into 4x4 tiles, and each tile costs 36 multiplies per input and
+    output channel instead of 144. The transformed weights are made
+    once, when the layer is pushed.
+
+    In int8 mode the convolutions with more than one output run on
+    integers, summing in 32 bits. The grids between layers stay
+    float, each layer quantizes what it reads: its input grids, or
+    for Winograd the transformed tiles, which is where the work is.
+    Direct convolutions take 8 bit inputs and weights, Winograd 12
+    bits in 16 bit integers, as its transform back magnifies the
+    rounding. The transforms themselves stay float.
+*/
+class CPUNetwork {
+public:
+    /*
+        Weights in the Caffe layout, (output, input, y, x).
+        Only the shapes instantiated in CPUNetwork.cpp exist.
+    */
+    template<unsigned int filter_size,
+             unsigned int channels, unsigned int outputs,
+             size_t W, size_t B>
+    void push_convolve(const std::array<float, W> & weights,
+                       const std::array<float, B> & biases) {
+        static_assert(W == filter_size * filter_size * channels * outputs,
+                      "convolution weights don't match the shape");
+        static_assert(B == outputs, "convolution biases don't match");
+        add_layer({&convolve<filter_size, channels, outputs>,
+                   WinogradKernel<filter_size == 3 && outputs != 1,
+                                  channels, outputs>::get(),
+                   QuantizedKernel<outputs == 1 ? 0
+                                   : filter_size == 3 ? 2 : 1,
+                                   filter_size, channels, outputs>::get()},
+                  filter_size, channels, outputs, &weights[0], &biases[0]);
+    }
+
+    /*
+        Weights as (output, input)
+    */
+    template<unsigned int inputs, unsigned int outputs,
+             size_t W, size_t B>
+    void push_innerproduct(const std::array<float, W> & weights,
+                           const std::array<float, B> & biases) {
+        static_assert(W == inputs * outputs,
+                      "innerproduct weights don't match the shape");
+        static_assert(B == outputs, "innerproduct biases don't match");
+        add_layer({&innerproduct<inputs, outputs>, nullptr, nullptr},
+                  0, inputs, outputs, &weights[0], &biases[0]);
+    }
+
+    /*
+        Normalize the outputs of the layer pushed last, ahead of
+        its ELU, as a Caffe Convolution, BatchNorm, ELU. It is folded
+        into that layer's weights and biases, nothing runs for it.
+    */
+    template<size_t M, size_t V>
+    void push_batchnorm(const std::array<float, M> & means,
+                        const std::array<float, V> & variances,
+                        const std::array<float, 1> & scale) {
+        static_assert(M == V, "batchnorm means and variances don't match");
+        add_batchnorm(M, &means[0], &variances[0], scale[0]);
+    }
+
+    /*
+        Run batch positions through the layers. The input planes
+        are channel major, plane c of position b starts at
+        (c * batch + b) * 361. The output holds the outputs of
+        the last layer, one row per position.
+    */
+    void forward(const std::vector<float> & input, size_t batch,
+                 std::vector<float> & output) const;
+
+    /*
+        Run batch positions through the layers one at a time,
+        printing how long each takes. Winograd layers also run the
+        direct kernel on the same input, integer layers the float
+        one, and the largest difference between the two is shown.
+    */
+    void check_layers(const std::vector<float> & input, size_t batch,
+                      int repeats) const;
+
+    /*
+        An integer layer quantizes a value x to
+        q = round(x / m_scale) + m_zero, clamped to 0..255, or to
+        0..4095 for Winograd. A direct convolution has one for its
+        input, a Winograd one one per point of the 6x6 transformed
+        tiles. The weights get a scale per output from their largest
+        value.
+    */
+    struct InputScale {
+        float m_scale;
+        int m_zero;
+    };
+    // per layer, empty for the layers that stay float
+    using Scales = std::vector<std::vector<InputScale>>;
+    // (min, max) of the values each InputScale is for
+    using Ranges = std::vector<std::vector<std::pair<float, float>>>;
+
+    /*
+        Run batch positions through the float layers, widening
+        ranges to cover every value the integer layers would quantize.
+    */
+    void record_ranges(const std::vector<float> & input, size_t batch,
+                       Ranges & ranges) const;
+    // scales that fit those ranges in each layer's integers
+    Scales get_scales(const Ranges & ranges) const;
+
+    /*
+        Switch to int8 with these scales, or back to float if there
+        are none. False, and nothing changes, if they don't fit the
+        layers.
+    */
+    bool quantize(const Scales & scales);
+    bool is_quantized() const;
+
+    /*
+        instruction set the kernels were compiled for, and what
+        the int8 ones use of it
+    */
+    static std::string get_isa();
+    static std::string get_int8_isa();
+
+private:
+    struct Layer;
+    using Kernel = void (*)(const Layer & layer, size_t batch,
+                            const float * input, float * output);
+
+    struct Kernels {
+        Kernel m_direct;
+        // Winograd's for 3x3 convolutions, else nullptr
+        Kernel m_winograd;
+        // integer version of the faster of the two, nullptr if none
+        Kernel m_quantized;
+    };
+
+    struct Layer {
+        // the one of m_kernels forward() runs
+        Kernel m_kernel;
+        Kernels m_kernels;
+        unsigned int m_filter_size;
+        unsigned int m_channels;
+        unsigned int m_outputs;
+        // floats per position in the output
+        size_t m_output_size;
+        // rearranged for the kernel, see add_layer
+        std::vector<float> m_weights;
+        std::vector<float> m_winograd_weights;
+        std::vector<float> m_biases;
+        // int8 mode, see quantize(). 1 / m_scale and m_zero of
+        // each InputScale
+        std::vector<float> m_input_scales;
+        std::vector<float> m_input_zeros;
+        // the bytes of the integer weights, 8 or 16 bits each
+        std::vector<std::int8_t> m_quantized_weights;
+        // from the integer sums back to floats, sum * scale + offset,
+        // per output, for Winograd per point and output
+        std::vector<float> m_quantized_scales;
+        std::vector<float> m_quantized_offsets;
+    };
+
+    void add_layer(const Kernels & kernels, unsigned int filter_size,
+                   unsigned int channels, unsigned int outputs,
+                   const float * weights, const float * biases);
+    void add_batchnorm(unsigned int outputs, const float * means,
+                       const float * variances, float scale);
+
+    /*
+        Outputs go to the grid with ELU applied. A convolution to
+        a single output writes a plain 19x19 plane instead.
+    */
+    template<unsigned int filter_size,
+             unsigned int channels, unsigned int outputs>
+    static void convolve(const Layer & layer, size_t batch,
+                         const float * input, float * output);
+
+    /*
+        Same result as convolve for a 3x3 filter
+    */
+    template<unsigned int channels, unsigned int outputs>
+    static void winograd(const Layer & layer, size_t batch,
+                         const float * input, float * output);
+
+    /*
+        convolve in 8 bit and winograd in 12 bit integers,
+        for outputs > 1
+    */
+    template<unsigned int filter_size,
+             unsigned int channels, unsigned int outputs>
+    static void convolve_int8(const Layer & layer, size_t batch,
+                              const float * input, float * output);
+    template<unsigned int channels, unsigned int outputs>
+    static void winograd_int16(const Layer & layer, size_t batch,
+                               const float * input, float * output);
+
+    // winograd<> for the layers that have one, else nullptr
+    template<bool use, unsigned int channels, unsigned int outputs>
+    struct WinogradKernel {
+        static Kernel get() { return nullptr; }
+    };
+    template<unsigned int channels, unsigned int outputs>
+    struct WinogradKernel<true, channels, outputs> {
+        static Kernel get() { return &winograd<channels, outputs>; }
+    };
+
+    // kind 2 is winograd_int16<>, 1 convolve_int8<>, 0 nullptr
+    template<unsigned int kind, unsigned int filter_size,
+             unsigned int channels, unsigned int outputs>
+    struct QuantizedKernel {
+        static Kernel get() { return nullptr; }
+    };
+    template<unsigned int filter_size,
+             unsigned int channels, unsigned int outputs>
+    struct QuantizedKernel<1, filter_size, channels, outputs> {
+        static Kernel get() {
+            return &convolve_int8<filter_size, channels, outputs>;
+        }
+    };
+    template<unsigned int filter_size,
+             unsigned int channels, unsigned int outputs>
+    struct QuantizedKernel<2, filter_size, channels, outputs> {
+        static Kernel get() { return &winograd_int16<channels, outputs>; }
+    };
+
+    /*
+        ELU unless there is only one output
+    */
+    template<unsigned int inputs, unsigned int outputs>
+    static void innerproduct(const Layer & layer, size_t batch,
+                             const float * input, float * output);
+
+    // planes of the first layer's input to grids
+    void fill_grids(const std::vector<float> & input, size_t batch,
+                    std::vector<float> & grids) const;
+
+    // the float kernel of a layer
+    static Kernel float_kernel(const Layer & layer);
+    // how many InputScales the layer takes
+    static size_t scale_count(const Layer & layer);
+    // the largest quantized input of the layer, and so zero point
+    static int max_input(const Layer & layer);
+    // m_input_scales... for the layer, from its m_weights or
+    // m_winograd_weights
+    static void quantize_layer(Layer & layer,
+                               const std::vector<InputScale> & scales);
+
+    std::vector<Layer> m_layers;
+
+    // the last add_layer() as it came in, for a batchnorm to fold into
+    struct PushedLayer {
+        Kernels m_kernels;
+        unsigned int m_filter_size;
+        unsigned int m_channels;
+        unsigned int m_outputs;
+        std::vector<float> m_weights;
+        std::vector<float> m_biases;
+    };
+    PushedLayer m_pushed;
+};
+
+extern CPUNetwork cpu_policy_net;
+extern CPUNetwork cpu_value_net;
+
+#endif
@@ -1,5 +1,6 @@
 #include "AttribScores.cpp"
 #include "Attributes.cpp"
+#include "CPUNetwork.cpp"
 #include "FastBoard.cpp"
 #include "FastState.cpp"
 #include "FullBoard.cpp"
@@ -9,10 +10,13 @@
 #include "MCOTable.cpp"
 #include "MCPolicy.cpp"
 #include "Network.cpp"
+#include "NNQueue.cpp"
+#include "NodeArena.cpp"
 #include "OpenCL.cpp"
 #include "Playout.cpp"
 #include "Random.cpp"
 #include "SMP.cpp"
+#include "TreeReclaimer.cpp"
 #include "TTable.cpp"
 #include "UCTNode.cpp"
 #include "UCTSearch.cpp"
@@ -455,31 +455,53 @@ std::vector<bool> FastState::mark_dead(float *winrate) {
     fill(survive_count.begin(), survive_count.end(), 0);
     fill(dead_group.begin(), dead_group.end(), false);
 
-    float wins = 0.0;
-    for (int i = 0; i < MARKING_RUNS; i++) {
-        FastState workstate(*this);
-        Playout p;
-
-        p.run(workstate, true, false);
-
-        float score = p.get_score();
-        if (score > 0.0f) {
-            wins += 1.0f;
-        } else if (score == 0.0f) {
-            wins += 0.5f;
-        }
+    // A fixed range of runs for every thread that can help, each
+    // counted on its own and added up in order afterwards.
+    const int chunks = std::min(MARKING_RUNS, (int)thread_pool.size() + 1);
+    std::vector<std::vector<int>> chunk_survive(chunks);
+    std::vector<float> chunk_wins(chunks);
+
+    parallel_for(thread_pool, 0, chunks,
+                 [this, chunks, &chunk_survive, &chunk_wins](int chunk) {
+        std::vector<int> & survive = chunk_survive[chunk];
+        survive.resize(FastBoard::MAXSQ);
+        float wins = 0.0f;
+        FastState workstate;
+        for (int run = MARKING_RUNS * chunk / chunks;
+             run < MARKING_RUNS * (chunk + 1) / chunks; run++) {
+            workstate = *this;
+            Playout p;
+
+            p.run(workstate, true, false);
+
+            float score = p.get_score();
+            if (score > 0.0f) {
+                wins += 1.0f;
+            } else if (score == 0.0f) {
+                wins += 0.5f;
+            }
 
-        for (int i = 0; i < board.get_boardsize(); i++) {
-            for (int j = 0; j < board.get_boardsize(); j++) {
-                int vertex = board.get_vertex(i, j);
-                int sq    =           board.get_square(vertex);
-                int mc_sq = workstate.board.get_square(vertex);
+            for (int i = 0; i < board.get_boardsize(); i++) {
+                for (int j = 0; j < board.get_boardsize(); j++) {
+                    int vertex = board.get_vertex(i, j);
+                    int sq    =           board.get_square(vertex);
+                    int mc_sq = workstate.board.get_square(vertex);
 
-                if (sq == mc_sq) {
-                    survive_count[vertex]++;
+                    if (sq == mc_sq) {
+                        survive[vertex]++;
+                    }
                 }
             }
         }
+        chunk_wins[chunk] = wins;
+    });
+
+    float wins = 0.0f;
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        wins += chunk_wins[chunk];
+        for (int vertex = 0; vertex < FastBoard::MAXSQ; vertex++) {
+            survive_count[vertex] += chunk_survive[chunk][vertex];
+        }
     }
 
     const int LIVE_TRESHOLD = MARKING_RUNS / 2;
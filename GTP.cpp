@@ -5,9 +5,11 @@
 #include <cctype>
 #include <string>
 #include <sstream>
+#include <iomanip>
 #include <cmath>
 #include <climits>
 #include <algorithm>
+#include <memory>
 
 #include "config.h"
 #include "Utils.h"
@@ -16,6 +18,9 @@
 #include "Playout.h"
 #include "UCTSearch.h"
 #include "UCTNode.h"
+#include "NodeArena.h"
+#include "SMP.h"
+#include "TreeReclaimer.h"
 #include "SGFTree.h"
 #include "AttribScores.h"
 #include "PNSearch.h"
@@ -23,6 +28,9 @@
 #include "Book.h"
 #include "TTable.h"
 #include "MCPolicy.h"
+#ifdef USE_NNQUEUE
+#include "NNQueue.h"
+#endif
 
 using namespace Utils;
 
@@ -33,13 +41,28 @@ int cfg_num_threads;
 int cfg_max_playouts;
 bool cfg_enable_nets;
 bool cfg_komi_adjust;
+bool cfg_virtual_loss;
+bool cfg_numa_bind;
+int cfg_root_trees;
+int cfg_root_merge_cs;
 int cfg_mature_threshold;
 int cfg_expand_threshold;
 int cfg_lagbuffer_cs;
+size_t cfg_max_tree_memory;
+int cfg_tt_size_mb;
+bool cfg_tt_rave;
+std::string cfg_tt_shared_file;
 #ifdef USE_OPENCL
 std::vector<int> cfg_gpus;
 int cfg_rowtiles;
 #endif
+#ifdef USE_NNQUEUE
+int cfg_nn_batch_size;
+int cfg_nn_batch_wait_us;
+#endif
+#ifdef USE_NATIVE_CPU
+std::string cfg_nn_int8_scales;
+#endif
 float cfg_bound;
 float cfg_fpu;
 float cfg_cutoff_offset;
@@ -61,12 +84,29 @@ std::string cfg_logfile;
 FILE* cfg_logfile_handle;
 bool cfg_quiet;
 
+// The search is kept alive between moves so that its tree,
+// including what was found while pondering, can be reused.
+static std::unique_ptr<UCTSearch> s_search;
+static GameState * s_search_game = nullptr;
+
+UCTSearch & GTP::get_search(GameState & game) {
+    if (!s_search || s_search_game != &game) {
+        s_search.reset(new UCTSearch(game));
+        s_search_game = &game;
+    }
+    return *s_search;
+}
+
 void GTP::setup_default_parameters() {
     cfg_allow_pondering = true;
     cfg_allow_book = true;
     cfg_num_threads = std::max(1, std::min(SMP::get_num_cpus(), MAX_CPUS));
     cfg_enable_nets = true;
     cfg_komi_adjust = false;
+    cfg_virtual_loss = true;
+    cfg_numa_bind = false;
+    cfg_root_trees = 1;
+    cfg_root_merge_cs = 100;
 #ifdef USE_OPENCL
     cfg_mature_threshold = 25;
     cfg_extra_symmetry =  350;
@@ -78,9 +118,20 @@ void GTP::setup_default_parameters() {
 #endif
     cfg_max_playouts = INT_MAX;
     cfg_lagbuffer_cs = 100;
+    cfg_max_tree_memory = UCTSearch::DEFAULT_TREE_MEMORY;
+    cfg_tt_size_mb = 8;
+    cfg_tt_rave = false;
+    cfg_tt_shared_file = "";
 #ifdef USE_OPENCL
     cfg_gpus = { };
     cfg_rowtiles = 5;
+#endif
+#ifdef USE_NNQUEUE
+    cfg_nn_batch_size = 8;
+    cfg_nn_batch_wait_us = 1000;
+#endif
+#ifdef USE_NATIVE_CPU
+    cfg_nn_int8_scales = "";
 #endif
     cfg_bound = 32.0f;
     cfg_fpu = 1.1f;
@@ -157,6 +208,11 @@ const std::string GTP::s_commands[] = {
     "vn_winrate",
     "winrate",
     "heatmap",
+    "tree_stats",
+    "threadbench",
+    "numabench",
+    "ttbench",
+    "lockstats",
     ""
 };
 
@@ -382,9 +438,7 @@ bool GTP::execute(GameState & game, std::string xinput) {
 
             // start thinking
             {
-                std::unique_ptr<UCTSearch> search(new UCTSearch(game));
-
-                int move = search->think(who);
+                int move = get_search(game).think(who);
                 game.play_move(who, move);
 
                 std::string vertex = game.move_to_text(move);
@@ -393,8 +447,7 @@ bool GTP::execute(GameState & game, std::string xinput) {
             if (cfg_allow_pondering) {
                 // now start pondering
                 if (game.get_last_move() != FastBoard::RESIGN) {
-                    std::unique_ptr<UCTSearch> search(new UCTSearch(game));
-                    search->ponder();
+                    get_search(game).ponder();
                 }
             }
             game.set_komi(old_komi);
@@ -432,9 +485,7 @@ bool GTP::execute(GameState & game, std::string xinput) {
             game.set_passes(0);
 
             {
-                std::unique_ptr<UCTSearch> search(new UCTSearch(game));
-
-                int move = search->think(who, UCTSearch::NOPASS);
+                int move = get_search(game).think(who, UCTSearch::NOPASS);
                 game.play_move(who, move);
 
                 std::string vertex = game.move_to_text(move);
@@ -443,8 +494,7 @@ bool GTP::execute(GameState & game, std::string xinput) {
             if (cfg_allow_pondering) {
                 // now start pondering
                 if (game.get_last_move() != FastBoard::RESIGN) {
-                    std::unique_ptr<UCTSearch> search(new UCTSearch(game));
-                    search->ponder();
+                    get_search(game).ponder();
                 }
             }
             game.set_komi(old_komi);
@@ -576,8 +626,7 @@ bool GTP::execute(GameState & game, std::string xinput) {
                         }
                     }
                     game.set_komi(new_komi);
-                    std::unique_ptr<UCTSearch> search(new UCTSearch(game));
-                    search->ponder();
+                    get_search(game).ponder();
                     game.set_komi(old_komi);
                 }
             }
@@ -587,23 +636,109 @@ bool GTP::execute(GameState & game, std::string xinput) {
         return true;
     } else if (command.find("auto") == 0) {
         do {
-            std::unique_ptr<UCTSearch> search(new UCTSearch(game));
-
-            int move = search->think(game.get_to_move(), UCTSearch::NORMAL);
+            int move = get_search(game).think(game.get_to_move(),
+                                              UCTSearch::NORMAL);
             game.play_move(move);
             game.display_state();
 
         } while (game.get_passes() < 2
                  && game.get_last_move() != FastBoard::RESIGN);
 
+        return true;
+    } else if (command.find("tree_stats") == 0) {
+        std::ostringstream queue;
+#ifdef USE_NNQUEUE
+        NNQueue::Stats stats = NNQueue::get_queue()->get_stats();
+        queue << "\nNN queue: " << stats.m_batches << " batches, "
+              << std::fixed << std::setprecision(1)
+              << stats.m_positions / (float)std::max(1, stats.m_batches)
+              << " positions per batch";
+#endif
+        gtp_printf(id, "arena: %d kB reserved, %d kB peak\n"
+                   "reclaimer: %d subtrees waiting\n"
+                   "races: expand %d (%d waited), netscore %d, eval %d%s",
+                   (int)(NodeArena::get_total_bytes() / 1024),
+                   (int)(NodeArena::get_peak_bytes() / 1024),
+                   (int)TreeReclaimer::get_reclaimer()->get_backlog(),
+                   UCTNode::get_race_count(UCTNode::EXPAND_RACE),
+                   UCTNode::get_race_count(UCTNode::EXPAND_WAIT),
+                   UCTNode::get_race_count(UCTNode::NETSCORE_RACE),
+                   UCTNode::get_race_count(UCTNode::EVAL_RACE),
+                   queue.str().c_str());
+        return true;
+    } else if (command.find("threadbench") == 0) {
+        std::istringstream cmdstream(command);
+        std::string tmp;
+        int seconds = 5;
+
+        cmdstream >> tmp;  // eat threadbench
+        cmdstream >> seconds;
+
+        // every run starts from an empty TTable
+        if (TTable::get_TT()->is_shared()) {
+            gtp_fail_printf(id, "not with a shared TTable");
+            return true;
+        }
+        UCTSearch::scaling_benchmark(game, std::max(1, seconds) * 100);
+        gtp_printf(id, "");
+        return true;
+    } else if (command.find("numabench") == 0) {
+        std::istringstream cmdstream(command);
+        std::string tmp;
+        int seconds = 5;
+
+        cmdstream >> tmp;  // eat numabench
+        cmdstream >> seconds;
+
+        if (TTable::get_TT()->is_shared()) {
+            gtp_fail_printf(id, "not with a shared TTable");
+            return true;
+        }
+        UCTSearch::numa_benchmark(game, std::max(1, seconds) * 100);
+        gtp_printf(id, "");
+        return true;
+    } else if (command.find("ttbench") == 0) {
+        std::istringstream cmdstream(command);
+        std::string tmp;
+        int seconds = 2;
+
+        cmdstream >> tmp;  // eat ttbench
+        cmdstream >> seconds;
+
+        TTable::benchmark(std::max(1, seconds) * 100);
+        gtp_printf(id, "");
+        return true;
+    } else if (command.find("lockstats") == 0) {
+#ifdef USE_LOCK_STATS
+        auto sites = SMP::get_lock_sites();
+        std::sort(sites.begin(), sites.end(),
+                  [](const SMP::LockSite * a, const SMP::LockSite * b) {
+                      return a->m_wait_ns > b->m_wait_ns;
+                  });
+        myprintf("%-24s %12s %10s %10s %10s\n",
+                 "site", "acquired", "contended", "spins/wait", "wait ms");
+        for (const auto site : sites) {
+            std::string file(site->m_file);
+            file = file.substr(file.find_last_of("/\\") + 1);
+            int64 acquired = site->m_acquisitions;
+            int64 contended = site->m_contended;
+            myprintf("%-24s %12lld %9.2f%% %10.1f %10.1f\n",
+                     (file + ":" + std::to_string(site->m_line)).c_str(),
+                     (long long)acquired,
+                     100.0 * contended / std::max<int64>(1, acquired),
+                     (double)site->m_spins / std::max<int64>(1, contended),
+                     site->m_wait_ns / 1e6);
+        }
+        gtp_printf(id, "");
+#else
+        gtp_fail_printf(id, "built without USE_LOCK_STATS");
+#endif
         return true;
     } else if (command.find("bench") == 0) {
         Playout::do_playout_benchmark(game);
         return true;
     } else if (command.find("go") == 0) {
-        std::unique_ptr<UCTSearch> search(new UCTSearch(game));
-
-        int move = search->think(game.get_to_move());
+        int move = get_search(game).think(game.get_to_move());
         game.play_move(move);
 
         std::string vertex = game.move_to_text(move);
@@ -789,6 +924,47 @@ bool GTP::execute(GameState & game, std::string xinput) {
         Network::get_Network()->benchmark(&game);
         gtp_printf(id, "");
         return true;
+    } else if (command.find("netcheck") == 0) {
+#ifdef USE_NATIVE_CPU
+        std::istringstream cmdstream(command);
+        std::string tmp;
+        int batch = 1;
+
+        cmdstream >> tmp;   // eat netcheck
+        cmdstream >> batch;
+
+        Network::get_Network();
+        Network::check_layers(&game, std::max(1, batch));
+        gtp_printf(id, "");
+#else
+        gtp_fail_printf(id, "built without USE_NATIVE_CPU");
+#endif
+        return true;
+    } else if (command.find("netcalibrate") == 0) {
+#ifdef USE_NATIVE_CPU
+        std::istringstream cmdstream(command);
+        std::string tmp, sgfname, scalesname;
+        int positions;
+
+        cmdstream >> tmp;   // eat netcalibrate
+        cmdstream >> sgfname >> scalesname;
+
+        if (cmdstream.fail()) {
+            gtp_fail_printf(id, "syntax not understood");
+            return true;
+        }
+        if (!(cmdstream >> positions)) {
+            positions = 2000;
+        }
+
+        Network::get_Network();
+        Network::calibrate_from_file(sgfname, scalesname,
+                                     std::max(1, positions));
+        gtp_printf(id, "");
+#else
+        gtp_fail_printf(id, "built without USE_NATIVE_CPU");
+#endif
+        return true;
 
     } else if (command.find("bookgen") == 0) {
         std::istringstream cmdstream(command);
@@ -5,19 +5,36 @@
 #include <vector>
 #include "GameState.h"
 
+class UCTSearch;
+
 extern bool cfg_allow_pondering;
 extern bool cfg_allow_book;
 extern int cfg_num_threads;
 extern int cfg_max_playouts;
 extern bool cfg_enable_nets;
 extern bool cfg_komi_adjust;
+extern bool cfg_virtual_loss;
+extern bool cfg_numa_bind;
+extern int cfg_root_trees;
+extern int cfg_root_merge_cs;
 extern int cfg_mature_threshold;
 extern int cfg_expand_threshold;
 extern int cfg_lagbuffer_cs;
+extern size_t cfg_max_tree_memory;
+extern int cfg_tt_size_mb;
+extern bool cfg_tt_rave;
+extern std::string cfg_tt_shared_file;
 #ifdef USE_OPENCL
 extern std::vector<int> cfg_gpus;
 extern int cfg_rowtiles;
 #endif
+#ifdef USE_NNQUEUE
+extern int cfg_nn_batch_size;
+extern int cfg_nn_batch_wait_us;
+#endif
+#ifdef USE_NATIVE_CPU
+extern std::string cfg_nn_int8_scales;
+#endif
 extern float cfg_bound;
 extern float cfg_fpu;
 extern float cfg_cutoff_offset;
@@ -48,6 +65,7 @@ private:
     static const int GTP_VERSION = 2;
 
     static std::string get_life_list(GameState & game, bool live);
+    static UCTSearch & get_search(GameState & game);
     static const std::string s_commands[];
 };
 
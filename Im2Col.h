@@ -6,22 +6,24 @@
 #include <algorithm>
 #include "Utils.h"
 
+/*
+    Input planes are channel_stride apart and every output row is
+    row_stride long, so the columns of several positions can sit
+    side by side in one matrix.
+*/
 template <unsigned long channels,
           unsigned long filter_size>
-void im2col(std::vector<float>& input,
-            std::vector<float>& output) {
+void im2col(const float* data_im, size_t channel_stride,
+            float* data_col, size_t row_stride) {
     constexpr unsigned int height = 19;
     constexpr unsigned int width = 19;
-    constexpr unsigned int channel_size = height * width;
 
     constexpr int pad = (filter_size / 2);
     constexpr unsigned int output_h = height + 2 * pad - filter_size  + 1;
     constexpr unsigned int output_w = width + 2 * pad - filter_size + 1;
+    const size_t row_skip = row_stride - output_h * output_w;
 
-    const float* data_im = &input[0];
-    float* data_col = &output[0];
-
-    for (int channel = channels; channel--; data_im += channel_size) {
+    for (int channel = channels; channel--; data_im += channel_stride) {
         for (unsigned int kernel_row = 0; kernel_row < filter_size; kernel_row++) {
             for (unsigned int kernel_col = 0; kernel_col < filter_size; kernel_col++) {
                 int input_row = -pad + kernel_row;
@@ -44,11 +46,21 @@ void im2col(std::vector<float>& input,
                     }
                     input_row++;
                 }
+                data_col += row_skip;
             }
         }
     }
 }
 
+template <unsigned long channels,
+          unsigned long filter_size>
+void im2col(std::vector<float>& input,
+            std::vector<float>& output) {
+    constexpr unsigned int channel_size = 19 * 19;
+    im2col<channels, filter_size>(&input[0], channel_size,
+                                  &output[0], channel_size);
+}
+
 template <unsigned long channels,
           unsigned long filter_size>
 void col2im(std::vector<float>& input,
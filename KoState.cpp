@@ -14,12 +14,8 @@ void KoState::init_game(int size, float komi) {
     assert(size <= FastBoard::MAXBOARDSIZE);
                        
     FastState::init_game(size, komi);
-        
-    ko_hash_history.clear();
-    hash_history.clear();
 
-    ko_hash_history.push_back(board.calc_ko_hash());    
-    hash_history.push_back(board.calc_hash());                
+    clear_history();
 }
 
 bool KoState::legal_move(int vertex) {
@@ -41,41 +37,101 @@ bool KoState::legal_move(int vertex) {
     return true;
 }
 
-bool KoState::superko(void) {        
-    std::vector<uint64>::const_reverse_iterator first = ko_hash_history.rbegin();
-    std::vector<uint64>::const_reverse_iterator last = ko_hash_history.rend();  
-    std::vector<uint64>::const_reverse_iterator res;
-  
-    res = std::find(++first, last, board.ko_hash);
+void KoState::reset_to(const KoState & root) {
+    // vectors in the board keep their capacity when assigned
+    *static_cast<FastState*>(this) = root;
 
-    return (res != last);        
+    if (root.m_base_history == nullptr) {
+        m_base_history = &root;
+        ko_hash_history.clear();
+        hash_history.clear();
+        m_ko_filter.fill(0);
+    } else {
+        m_base_history = root.m_base_history;
+        ko_hash_history = root.ko_hash_history;
+        hash_history = root.hash_history;
+        m_ko_filter = root.m_ko_filter;
+    }
+    m_maybe_repeated = root.m_maybe_repeated;
 }
 
-bool KoState::superko(uint64 newhash) {
+bool KoState::in_history(uint64 hash, bool skip_current) const {
+    // the current position is the last entry, wherever it is
     std::vector<uint64>::const_reverse_iterator first = ko_hash_history.rbegin();
-    std::vector<uint64>::const_reverse_iterator last = ko_hash_history.rend();  
-    std::vector<uint64>::const_reverse_iterator res;
-  
-    res = std::find(first, last, newhash);
+    std::vector<uint64>::const_reverse_iterator last = ko_hash_history.rend();
+    if (skip_current && first != last) {
+        ++first;
+        skip_current = false;
+    }
+    if (std::find(first, last, hash) != last) {
+        return true;
+    }
+    if (m_base_history != nullptr) {
+        return m_base_history->in_history(hash, skip_current);
+    }
+    return false;
+}
 
-    return (res != last);        
+bool KoState::superko(void) {
+    if (!m_maybe_repeated) {
+        return false;
+    }
+    return in_history(board.ko_hash, true);
+}
+
+bool KoState::superko(uint64 newhash) {
+    if (!maybe_in_history(newhash)) {
+        return false;
+    }
+    return in_history(newhash, false);
 }
 
 void KoState::reset_game() {
     FastState::reset_game();
-        
+
+    clear_history();
+}
+
+void KoState::clear_history() {
+    m_base_history = nullptr;
     ko_hash_history.clear();
     hash_history.clear();
-    
-    ko_hash_history.push_back(board.calc_ko_hash());    
-    hash_history.push_back(board.calc_hash());                
+    m_ko_filter.fill(0);
+
+    ko_hash_history.push_back(board.calc_ko_hash());
+    hash_history.push_back(board.calc_hash());
+    m_maybe_repeated = false;
+    add_to_history();
+}
+
+void KoState::add_to_history() {
+    const uint64 hash = board.ko_hash;
+    const int bit1 = hash % FILTER_BITS;
+    const int bit2 = (hash >> 32) % FILTER_BITS;
+    m_ko_filter[bit1 / 64] |= 1ULL << (bit1 % 64);
+    m_ko_filter[bit2 / 64] |= 1ULL << (bit2 % 64);
+}
+
+bool KoState::maybe_in_history(uint64 hash) const {
+    const int bit1 = hash % FILTER_BITS;
+    const int bit2 = (hash >> 32) % FILTER_BITS;
+    if ((m_ko_filter[bit1 / 64] & (1ULL << (bit1 % 64)))
+        && (m_ko_filter[bit2 / 64] & (1ULL << (bit2 % 64)))) {
+        return true;
+    }
+    if (m_base_history != nullptr) {
+        return m_base_history->maybe_in_history(hash);
+    }
+    return false;
 }
 
 void KoState::play_pass(void) {
     FastState::play_pass();
-        
-    ko_hash_history.push_back(board.ko_hash);          
-    hash_history.push_back(board.hash);          
+
+    m_maybe_repeated = maybe_in_history(board.ko_hash);
+    ko_hash_history.push_back(board.ko_hash);
+    hash_history.push_back(board.hash);
+    add_to_history();
 }
 
 void KoState::play_move(int vertex) {
@@ -84,10 +140,12 @@ void KoState::play_move(int vertex) {
 
 void KoState::play_move(int color, int vertex) {
     if (vertex != FastBoard::PASS && vertex != FastBoard::RESIGN) {                   
-        FastState::play_move(color, vertex);        
-            
-        ko_hash_history.push_back(board.ko_hash);                 
-        hash_history.push_back(board.hash); 
+        FastState::play_move(color, vertex);
+
+        m_maybe_repeated = maybe_in_history(board.ko_hash);
+        ko_hash_history.push_back(board.ko_hash);
+        hash_history.push_back(board.hash);
+        add_to_history();
     } else {
         play_pass();
     }    
@@ -1,6 +1,7 @@
 #ifndef KOSTATE_H_INCLUDED
 #define KOSTATE_H_INCLUDED
 
+#include <array>
 #include <vector>
 
 #include "FastState.h"
@@ -9,6 +10,14 @@
 class KoState : public FastState {
 public:
     void init_game(int size, float komi);
+    /*
+        Become a copy of root without copying its history: root's
+        hashes are looked up in place, and only the moves played
+        from here on are stored. Reusing one KoState this way for
+        every simulation doesn't allocate once its buffers have
+        grown. root must stay unchanged while we use it.
+    */
+    void reset_to(const KoState & root);
     bool superko(void);
     bool superko(uint64 newhash);
     void reset_game();
@@ -20,8 +29,26 @@ public:
     void play_move(int vertex);
 
 private:
+    bool in_history(uint64 hash, bool skip_current) const;
+    bool maybe_in_history(uint64 hash) const;
+    void add_to_history();
+    void clear_history();
+
+    // history before ko_hash_history, nullptr if we have all of it
+    const KoState * m_base_history{nullptr};
     std::vector<uint64> ko_hash_history;
     std::vector<uint64> hash_history;
+
+    /*
+        Bloom filter over ko_hash_history, two bits per position.
+        Most lookups stop here, only possible repeats search the
+        history itself. A state reset to a root only holds its own
+        moves and consults the root's filter as well.
+    */
+    static constexpr int FILTER_BITS = 4096;
+    std::array<uint64, FILTER_BITS / 64> m_ko_filter;
+    // the current position passed the filter when it was added
+    bool m_maybe_repeated{false};
 };
 
 #endif
@@ -22,6 +22,9 @@
 #include "AttribScores.h"
 #include "ThreadPool.h"
 #include "MCPolicy.h"
+#include "UCTNode.h"
+#include "UCTSearch.h"
+#include "TTable.h"
 
 using namespace Utils;
 
@@ -41,6 +44,26 @@ void parse_commandline(int argc, char *argv[], bool & gtp_mode) {
         ("lagbuffer,b", po::value<int>()->default_value(cfg_lagbuffer_cs),
                         "Safety margin for time usage in centiseconds.")
         ("logfile,l", po::value<std::string>(), "File to log input/output to.")
+        ("max-tree-memory", po::value<int>(),
+                            "Memory budget for the search tree in MiB. "
+                            "Rarely visited branches are pruned to stay "
+                            "within it.")
+        ("tt-size-mb", po::value<int>()->default_value(cfg_tt_size_mb),
+                       "Size of the transposition table in MiB, "
+                       "rounded down to a power of two.")
+        ("tt-rave", "Keep RAVE statistics in the transposition table "
+                    "too. Makes each entry half again as large.")
+        ("tt-shared", po::value<std::string>(),
+                      "Share the transposition table with other "
+                      "processes through this file.")
+        ("numa", "Spread the search threads over the NUMA nodes "
+                 "and keep each on its own node.")
+        ("root-trees", po::value<int>(),
+                       "Search this many independent trees, merged at "
+                       "the root, instead of one shared tree.")
+        ("root-merge", po::value<int>()->default_value(cfg_root_merge_cs),
+                       "Merge the root trees every # centiseconds, "
+                       "0 to only merge at the end of the search.")
         ("quiet,q", "Disable all diagnostic output.")
         ("komiadjust,k", "Adjust komi one point in my disadvantage "
                          "(for territory scoring).")
@@ -53,6 +76,17 @@ void parse_commandline(int argc, char *argv[], bool & gtp_mode) {
         ("rowtiles", po::value<int>()->default_value(cfg_rowtiles),
                      "Split up the board in # tiles.")
 #endif
+#ifdef USE_NNQUEUE
+        ("nn-batch", po::value<int>()->default_value(cfg_nn_batch_size),
+                     "Evaluate up to # positions per network run.")
+        ("nn-wait", po::value<int>()->default_value(cfg_nn_batch_wait_us),
+                    "Microseconds to wait for a network batch to fill up.")
+#endif
+#ifdef USE_NATIVE_CPU
+        ("int8", po::value<std::string>(),
+                 "Run the networks in int8 with the scales in this "
+                 "file, made by the netcalibrate command.")
+#endif
 #ifdef USE_TUNER
         ("mature_threshold", po::value<int>())
         ("expand_threshold", po::value<int>())
@@ -195,6 +229,21 @@ void parse_commandline(int argc, char *argv[], bool & gtp_mode) {
         }
     }
 
+    if (vm.count("numa")) {
+        cfg_numa_bind = true;
+    }
+
+    if (vm.count("root-trees")) {
+        cfg_root_trees = std::max(1, vm["root-trees"].as<int>());
+        if (cfg_root_trees > 1) {
+            myprintf("Searching %d trees in parallel.\n", cfg_root_trees);
+        }
+    }
+
+    if (vm.count("root-merge")) {
+        cfg_root_merge_cs = std::max(0, vm["root-merge"].as<int>());
+    }
+
     if (vm.count("noponder")) {
         cfg_allow_pondering = false;
     }
@@ -222,6 +271,23 @@ void parse_commandline(int argc, char *argv[], bool & gtp_mode) {
         cfg_komi_adjust = true;
     }
 
+    if (vm.count("max-tree-memory")) {
+        int megabytes = std::max(16, vm["max-tree-memory"].as<int>());
+        cfg_max_tree_memory = (size_t)megabytes << 20;
+    }
+
+    if (vm.count("tt-size-mb")) {
+        cfg_tt_size_mb = std::max(1, vm["tt-size-mb"].as<int>());
+    }
+
+    if (vm.count("tt-rave")) {
+        cfg_tt_rave = true;
+    }
+
+    if (vm.count("tt-shared")) {
+        cfg_tt_shared_file = vm["tt-shared"].as<std::string>();
+    }
+
     if (vm.count("lagbuffer")) {
         int lagbuffer = vm["lagbuffer"].as<int>();
         if (lagbuffer != cfg_lagbuffer_cs) {
@@ -245,6 +311,22 @@ void parse_commandline(int argc, char *argv[], bool & gtp_mode) {
         }
     }
 #endif
+
+#ifdef USE_NNQUEUE
+    if (vm.count("nn-batch")) {
+        cfg_nn_batch_size = std::max(1, vm["nn-batch"].as<int>());
+    }
+
+    if (vm.count("nn-wait")) {
+        cfg_nn_batch_wait_us = std::max(0, vm["nn-wait"].as<int>());
+    }
+#endif
+
+#ifdef USE_NATIVE_CPU
+    if (vm.count("int8")) {
+        cfg_nn_int8_scales = vm["int8"].as<std::string>();
+    }
+#endif
 }
 #endif
 
@@ -273,7 +355,11 @@ int main (int argc, char *argv[]) {
     setbuf(stdin, NULL);
 #endif
 
-    thread_pool.initialize(cfg_num_threads);
+    thread_pool.initialize(cfg_num_threads, cfg_numa_bind);
+    if (cfg_numa_bind) {
+        myprintf("Binding threads to %d NUMA node(s).\n",
+                 SMP::get_num_numa_nodes());
+    }
 
     // Use deterministic random numbers for hashing
     std::unique_ptr<Random> rng(new Random(5489));
@@ -284,6 +370,19 @@ int main (int argc, char *argv[]) {
     Matcher::get_Matcher();
     Network::get_Network();
 
+    myprintf("UCTNode: %d bytes, tree memory limited to %d MiB "
+             "(about %d nodes).\n",
+             (int)sizeof(UCTNode),
+             (int)(cfg_max_tree_memory >> 20),
+             (int)(cfg_max_tree_memory / UCTChildren::SLOT_SIZE));
+    TTable * ttable = TTable::get_TT();
+    myprintf("Transposition table: %d kB, %d entries%s%s%s.\n",
+             (int)(ttable->get_bytes() / 1024),
+             (int)ttable->get_num_entries(),
+             ttable->has_rave_payload() ? " with RAVE statistics" : "",
+             ttable->is_shared() ? ", shared in " : "",
+             ttable->is_shared() ? cfg_tt_shared_file.c_str() : "");
+
     std::unique_ptr<GameState> maingame(new GameState);
 
     /* set board limits */
@@ -0,0 +1,211 @@
+#include "config.h"
+#ifdef USE_NNQUEUE
+
+#include <cassert>
+#include <algorithm>
+#include <thread>
+
+#include "NNQueue.h"
+#include "GTP.h"
+#include "Random.h"
+
+NNQueue* NNQueue::get_queue(void) {
+    // Never destroyed, like the reclaimer: searches held in
+    // statics may still flush it while the program exits.
+    static NNQueue * s_queue = new NNQueue;
+    return s_queue;
+}
+
+NNQueue::NNQueue() {
+    std::thread(&NNQueue::worker, this).detach();
+}
+
+bool NNQueue::can_queue() {
+    // Enough to have the next batch ready when this one is done
+    return m_pending.load(std::memory_order_relaxed)
+           < 2 * std::max(1, cfg_nn_batch_size);
+}
+
+void NNQueue::push(std::deque<Request> & queue, Request && request) {
+    request.m_queued = Clock::now();
+    m_pending++;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        queue.push_back(std::move(request));
+    }
+    m_condvar.notify_one();
+}
+
+void NNQueue::queue_value(FastState * state, ValueCallback done,
+                          CancelCallback cancel) {
+    Network::NNPlanes planes;
+    Network::gather_features_value(state, planes);
+    int rotation = Random::get_Rng()->randfix<8>();
+
+    Request request;
+    request.m_input.resize(Network::VALUE_CHANNELS * 19 * 19);
+    Network::fill_input(planes, Network::VALUE_CHANNELS, rotation,
+                        &request.m_input[0]);
+    request.m_value_done = std::move(done);
+    request.m_cancel = std::move(cancel);
+    push(m_values, std::move(request));
+}
+
+void NNQueue::queue_policy(FastState * state, int rotation,
+                           PolicyCallback done, CancelCallback cancel) {
+    assert(rotation >= 0 && rotation <= 7);
+    Network::NNPlanes planes;
+    Network::BoardPlane * ladder;
+    Network::gather_features_policy(state, planes, &ladder);
+
+    Request request;
+    request.m_input.resize(Network::POLICY_CHANNELS * 19 * 19);
+    Network::fill_input(planes, Network::POLICY_CHANNELS, rotation,
+                        &request.m_input[0]);
+    request.m_state.reset(new FastState(*state));
+    request.m_rotation = rotation;
+    request.m_ladder = *ladder;
+    request.m_policy_done = std::move(done);
+    request.m_cancel = std::move(cancel);
+    push(m_policies, std::move(request));
+}
+
+void NNQueue::flush() {
+    std::deque<Request> values;
+    std::deque<Request> policies;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        std::swap(values, m_values);
+        std::swap(policies, m_policies);
+        m_pending -= values.size() + policies.size();
+        m_idle.wait(lock, [this] { return !m_busy; });
+    }
+    for (auto & request : values) {
+        request.m_cancel();
+    }
+    for (auto & request : policies) {
+        request.m_cancel();
+    }
+}
+
+NNQueue::Stats NNQueue::get_stats() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+/*
+    Copy the planes of every request into one input, plane c of
+    position b going to (c * batch + b) * 361.
+*/
+std::vector<float> NNQueue::batch_input(std::vector<Request> & batch,
+                                        int channels) {
+    constexpr int boardsq = 19 * 19;
+    const size_t size = batch.size();
+    std::vector<float> input(channels * size * boardsq);
+    for (size_t b = 0; b < size; b++) {
+        auto src = batch[b].m_input.cbegin();
+        for (int c = 0; c < channels; c++, src += boardsq) {
+            std::copy(src, src + boardsq,
+                      input.begin() + (c * size + b) * boardsq);
+        }
+    }
+    return input;
+}
+
+void NNQueue::run_values(std::vector<Request> & batch) {
+    auto input = batch_input(batch, Network::VALUE_CHANNELS);
+    std::vector<float> winrates(batch.size());
+    Network::get_values_batch(input, batch.size(), winrates);
+
+    for (size_t b = 0; b < batch.size(); b++) {
+        batch[b].m_value_done(winrates[b]);
+    }
+}
+
+void NNQueue::run_policies(std::vector<Request> & batch) {
+    constexpr int boardsq = 19 * 19;
+    auto input = batch_input(batch, Network::POLICY_CHANNELS);
+    std::vector<float> outputs(batch.size() * boardsq);
+    Network::get_policies_batch(input, batch.size(), outputs);
+
+    for (size_t b = 0; b < batch.size(); b++) {
+        Request & request = batch[b];
+        auto result = Network::map_moves(request.m_state.get(),
+                                         &outputs[b * boardsq],
+                                         request.m_rotation);
+        Network::prune_ladders(request.m_state.get(), result,
+                               request.m_ladder);
+        request.m_policy_done(*request.m_state, result);
+    }
+}
+
+void NNQueue::worker() {
+    std::vector<Request> batch;
+    for (;;) {
+        bool values;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_busy = false;
+            m_idle.notify_all();
+
+            size_t batch_size;
+            for (;;) {
+                m_condvar.wait(lock, [this] {
+                    return !m_values.empty() || !m_policies.empty();
+                });
+                batch_size = std::max(1, cfg_nn_batch_size);
+                if (m_values.size() >= batch_size
+                    || m_policies.size() >= batch_size) {
+                    break;
+                }
+                // Give the searches a moment to fill up the batch
+                auto oldest = Clock::time_point::max();
+                if (!m_values.empty()) {
+                    oldest = m_values.front().m_queued;
+                }
+                if (!m_policies.empty()) {
+                    oldest = std::min(oldest, m_policies.front().m_queued);
+                }
+                auto deadline = oldest
+                    + std::chrono::microseconds(cfg_nn_batch_wait_us);
+                if (Clock::now() >= deadline) {
+                    break;
+                }
+                m_condvar.wait_until(lock, deadline);
+            }
+
+            // Full batches first, otherwise whoever waited longest
+            if (m_values.size() >= batch_size) {
+                values = true;
+            } else if (m_policies.size() >= batch_size) {
+                values = false;
+            } else if (m_values.empty()) {
+                values = false;
+            } else if (m_policies.empty()) {
+                values = true;
+            } else {
+                values = m_values.front().m_queued
+                         <= m_policies.front().m_queued;
+            }
+            auto & queue = values ? m_values : m_policies;
+            size_t count = std::min(queue.size(), batch_size);
+            for (size_t i = 0; i < count; i++) {
+                batch.emplace_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            m_busy = true;
+            m_stats.m_batches++;
+            m_stats.m_positions += count;
+        }
+
+        if (values) {
+            run_values(batch);
+        } else {
+            run_policies(batch);
+        }
+        m_pending -= batch.size();
+        batch.clear();
+    }
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef NNQUEUE_H_INCLUDED
+#define NNQUEUE_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include "FastState.h"
+#include "Network.h"
+
+/*
+    Collects value and policy net requests from all search threads
+    and runs them through the CPU network in batches, so a single
+    matrix multiply covers many positions. A batch starts when it is
+    full or when its oldest request waited long enough. Callers go
+    on searching, the result comes back through a callback on the
+    queue's thread.
+*/
+class NNQueue {
+public:
+    // winrate for the side to move
+    using ValueCallback = std::function<void(float)>;
+    using PolicyCallback = std::function<void(FastState &,
+                                              Network::Netresult &)>;
+    // the request was dropped by flush()
+    using CancelCallback = std::function<void()>;
+
+    /*
+        return the global queue
+    */
+    static NNQueue* get_queue(void);
+
+    /*
+        Whether there is room for another request. Searches that
+        get false should try again on a later visit.
+    */
+    bool can_queue();
+
+    /*
+        Evaluate state in a random rotation. The features are
+        gathered right away, state isn't needed afterwards.
+    */
+    void queue_value(FastState * state, ValueCallback done,
+                     CancelCallback cancel);
+    void queue_policy(FastState * state, int rotation,
+                      PolicyCallback done, CancelCallback cancel);
+
+    /*
+        Cancel everything still waiting and wait for the batch
+        in flight. Call before the nodes the callbacks point to
+        can go away.
+    */
+    void flush();
+
+    struct Stats {
+        int m_batches;
+        int m_positions;
+    };
+    Stats get_stats();
+
+private:
+    NNQueue();
+    void worker();
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Request {
+        Clock::time_point m_queued;
+        std::vector<float> m_input;
+        // policy requests only
+        std::unique_ptr<FastState> m_state;
+        int m_rotation;
+        Network::BoardPlane m_ladder;
+        ValueCallback m_value_done;
+        PolicyCallback m_policy_done;
+        CancelCallback m_cancel;
+    };
+
+    void push(std::deque<Request> & queue, Request && request);
+    static std::vector<float> batch_input(std::vector<Request> & batch,
+                                          int channels);
+    void run_values(std::vector<Request> & batch);
+    void run_policies(std::vector<Request> & batch);
+
+    std::mutex m_mutex;
+    std::condition_variable m_condvar;
+    std::condition_variable m_idle;
+    std::deque<Request> m_values;
+    std::deque<Request> m_policies;
+    bool m_busy{false};
+    // requests queued or running
+    std::atomic<int> m_pending{0};
+
+    Stats m_stats{0, 0};
+};
+
+#endif
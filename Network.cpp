@@ -9,6 +9,8 @@
 #include <cmath>
 #include <array>
 #include <thread>
+#include <sstream>
+#include <chrono>
 #include <boost/utility.hpp>
 #include <boost/format.hpp>
 
@@ -34,6 +36,9 @@ using namespace caffe;
 #include "OpenCL.h"
 #include "UCTNode.h"
 #endif
+#ifdef USE_NATIVE_CPU
+#include "CPUNetwork.h"
+#endif
 
 #include "SGFTree.h"
 #include "SGFParser.h"
@@ -198,6 +203,250 @@ void Network::benchmark(FastState * state) {
     }
 }
 
+#ifdef USE_NATIVE_CPU
+void Network::check_layers(FastState * state, int batch) {
+    constexpr int boardsq = 19 * 19;
+    constexpr int repeats = 20;
+
+    // Rotated copies of the planes, channel major
+    auto batch_input = [batch](NNPlanes & planes, int channels) {
+        std::vector<float> input(channels * batch * boardsq);
+        std::vector<float> single(channels * boardsq);
+        for (int b = 0; b < batch; b++) {
+            fill_input(planes, channels, b % 8, &single[0]);
+            for (int c = 0; c < channels; c++) {
+                std::copy(single.begin() + c * boardsq,
+                          single.begin() + (c + 1) * boardsq,
+                          input.begin() + (c * batch + b) * boardsq);
+            }
+        }
+        return input;
+    };
+
+    NNPlanes planes;
+    gather_features_policy(state, planes);
+    myprintf("Policy network, %d positions, %s kernels\n",
+             batch, CPUNetwork::get_isa().c_str());
+    cpu_policy_net.check_layers(batch_input(planes, POLICY_CHANNELS),
+                                batch, repeats);
+
+    gather_features_value(state, planes);
+    myprintf("Value network, %d positions\n", batch);
+    cpu_value_net.check_layers(batch_input(planes, VALUE_CHANNELS),
+                               batch, repeats);
+}
+
+void Network::calibrate_from_file(std::string sgf_name,
+                                  std::string scales_name,
+                                  int max_positions) {
+    using Clock = std::chrono::steady_clock;
+    constexpr int boardsq = 19 * 19;
+    constexpr size_t batch_size = 8;
+
+    std::vector<NNPlanes> policy_planes;
+    std::vector<NNPlanes> value_planes;
+    std::vector<std::string> games = SGFParser::chop_all(sgf_name);
+    for (size_t i = 0; i < games.size()
+         && policy_planes.size() < (size_t)max_positions; i++) {
+        std::unique_ptr<SGFTree> sgftree(new SGFTree);
+        try {
+            sgftree->load_from_string(games[i]);
+        } catch (...) {
+            continue;
+        }
+
+        SGFTree * treewalk = sgftree.get();
+        while (treewalk != nullptr
+               && policy_planes.size() < (size_t)max_positions) {
+            KoState * state = treewalk->get_state();
+            if (state->board.get_boardsize() != 19) {
+                break;
+            }
+            NNPlanes planes;
+            gather_features_policy(state, planes);
+            policy_planes.push_back(planes);
+            gather_features_value(state, planes);
+            value_planes.push_back(planes);
+            treewalk = treewalk->get_child(0);
+        }
+    }
+    const size_t positions = policy_planes.size();
+    myprintf("%d positions from %d games in %s\n",
+             (int)positions, (int)games.size(), sgf_name.c_str());
+    if (!positions) {
+        return;
+    }
+
+    // count positions from start, channel major, each in a rotation
+    auto batch_input = [](std::vector<NNPlanes> & planes, size_t start,
+                          size_t count, int channels) {
+        std::vector<float> input(channels * count * boardsq);
+        std::vector<float> single(channels * boardsq);
+        for (size_t b = 0; b < count; b++) {
+            fill_input(planes[start + b], channels, (start + b) % 8,
+                       &single[0]);
+            for (int c = 0; c < channels; c++) {
+                std::copy(single.begin() + c * boardsq,
+                          single.begin() + (c + 1) * boardsq,
+                          input.begin() + (c * count + b) * boardsq);
+            }
+        }
+        return input;
+    };
+
+    CPUNetwork float_policy = cpu_policy_net;
+    CPUNetwork float_value = cpu_value_net;
+    float_policy.quantize(CPUNetwork::Scales());
+    float_value.quantize(CPUNetwork::Scales());
+
+    CPUNetwork::Ranges policy_ranges;
+    CPUNetwork::Ranges value_ranges;
+    for (size_t start = 0; start < positions; start += batch_size) {
+        const size_t count = std::min(batch_size, positions - start);
+        float_policy.record_ranges(
+            batch_input(policy_planes, start, count, POLICY_CHANNELS),
+            count, policy_ranges);
+        float_value.record_ranges(
+            batch_input(value_planes, start, count, VALUE_CHANNELS),
+            count, value_ranges);
+    }
+    auto policy_scales = float_policy.get_scales(policy_ranges);
+    auto value_scales = float_value.get_scales(value_ranges);
+
+    std::ofstream out(scales_name);
+    out << "# int8 scales: network, layer, then scale and zero point "
+           "of each value it quantizes\n";
+    auto write = [&out](const char * name, const CPUNetwork::Scales & scales) {
+        for (size_t layer = 0; layer < scales.size(); layer++) {
+            if (scales[layer].empty()) {
+                continue;
+            }
+            out << name << " " << layer;
+            for (const auto & scale : scales[layer]) {
+                out << boost::format(" %.9g %d") % scale.m_scale
+                                                 % scale.m_zero;
+            }
+            out << "\n";
+        }
+    };
+    write("policy", policy_scales);
+    write("value", value_scales);
+    out.close();
+    if (!out) {
+        myprintf("Could not write %s\n", scales_name.c_str());
+        return;
+    }
+    myprintf("Scales written to %s\n", scales_name.c_str());
+
+    // How close int8 comes to float, and how much faster it is
+    CPUNetwork int8_policy = float_policy;
+    CPUNetwork int8_value = float_value;
+    int8_policy.quantize(policy_scales);
+    int8_value.quantize(value_scales);
+
+    size_t agree = 0;
+    double value_diff = 0.0;
+    double max_value_diff = 0.0;
+    Clock::duration policy_time[2] = {};
+    Clock::duration value_time[2] = {};
+    std::vector<float> float_out;
+    std::vector<float> int8_out;
+    for (size_t start = 0; start < positions; start += batch_size) {
+        const size_t count = std::min(batch_size, positions - start);
+
+        auto input = batch_input(policy_planes, start, count, POLICY_CHANNELS);
+        auto begin = Clock::now();
+        float_policy.forward(input, count, float_out);
+        auto middle = Clock::now();
+        int8_policy.forward(input, count, int8_out);
+        auto end = Clock::now();
+        policy_time[0] += middle - begin;
+        policy_time[1] += end - middle;
+        for (size_t b = 0; b < count; b++) {
+            auto float_begin = float_out.begin() + b * boardsq;
+            auto int8_begin = int8_out.begin() + b * boardsq;
+            if (std::max_element(float_begin, float_begin + boardsq)
+                - float_begin
+                == std::max_element(int8_begin, int8_begin + boardsq)
+                   - int8_begin) {
+                agree++;
+            }
+        }
+
+        input = batch_input(value_planes, start, count, VALUE_CHANNELS);
+        begin = Clock::now();
+        float_value.forward(input, count, float_out);
+        middle = Clock::now();
+        int8_value.forward(input, count, int8_out);
+        end = Clock::now();
+        value_time[0] += middle - begin;
+        value_time[1] += end - middle;
+        for (size_t b = 0; b < count; b++) {
+            // as get_values_batch
+            double diff = std::fabs(std::tanh(float_out[b])
+                                    - std::tanh(int8_out[b])) / 2.0;
+            value_diff += diff;
+            max_value_diff = std::max(max_value_diff, diff);
+        }
+    }
+
+    auto per_second = [positions](Clock::duration time) {
+        return positions / std::chrono::duration<double>(time).count();
+    };
+    myprintf("Policy: same top move in %d of %d positions (%.1f%%)\n",
+             (int)agree, (int)positions, 100.0 * agree / positions);
+    myprintf("Value: winrates %.4f apart on average, %.4f at most\n",
+             value_diff / positions, max_value_diff);
+    myprintf("Batches of %d, %s kernels, int8 on %s:\n", (int)batch_size,
+             CPUNetwork::get_isa().c_str(),
+             CPUNetwork::get_int8_isa().c_str());
+    myprintf("Policy: %7.1f p/s float, %7.1f p/s int8\n",
+             per_second(policy_time[0]), per_second(policy_time[1]));
+    myprintf("Value:  %7.1f p/s float, %7.1f p/s int8\n",
+             per_second(value_time[0]), per_second(value_time[1]));
+}
+
+bool Network::load_int8_scales(std::string filename) {
+    std::ifstream in(filename);
+    if (!in) {
+        return false;
+    }
+
+    CPUNetwork::Scales policy_scales;
+    CPUNetwork::Scales value_scales;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        size_t layer;
+        if (!(fields >> name) || name[0] == '#') {
+            continue;
+        }
+        if (!(fields >> layer) || (name != "policy" && name != "value")) {
+            return false;
+        }
+        auto & scales = name == "policy" ? policy_scales : value_scales;
+        if (scales.size() <= layer) {
+            scales.resize(layer + 1);
+        }
+        CPUNetwork::InputScale scale;
+        while (fields >> scale.m_scale >> scale.m_zero) {
+            scales[layer].push_back(scale);
+        }
+    }
+
+    if (policy_scales.empty() || value_scales.empty()
+        || !cpu_policy_net.quantize(policy_scales)) {
+        return false;
+    }
+    if (!cpu_value_net.quantize(value_scales)) {
+        cpu_policy_net.quantize(CPUNetwork::Scales());
+        return false;
+    }
+    return true;
+}
+#endif
+
 void Network::initialize(void) {
 #ifdef USE_OPENCL
     myprintf("Initializing OpenCL\n");
@@ -233,6 +482,47 @@ void Network::initialize(void) {
     opencl_value_net.push_innerproduct(val_ip14_w, val_ip14_b);
     myprintf("done\n");
 #endif
+#ifdef USE_NATIVE_CPU
+    cpu_policy_net.push_convolve<5,  32,  96>(conv1_w, conv1_b);
+    cpu_policy_net.push_convolve<3,  96, 128>(conv2_w, conv2_b);
+    cpu_policy_net.push_convolve<3, 128, 128>(conv3_w, conv3_b);
+    cpu_policy_net.push_convolve<3, 128, 128>(conv4_w, conv4_b);
+    cpu_policy_net.push_convolve<3, 128, 128>(conv5_w, conv5_b);
+    cpu_policy_net.push_convolve<3, 128, 128>(conv6_w, conv6_b);
+    cpu_policy_net.push_convolve<3, 128, 128>(conv7_w, conv7_b);
+    cpu_policy_net.push_convolve<3, 128, 128>(conv8_w, conv8_b);
+    cpu_policy_net.push_convolve<3, 128, 128>(conv9_w, conv9_b);
+    cpu_policy_net.push_convolve<3, 128, 128>(conv10_w, conv10_b);
+    cpu_policy_net.push_convolve<3, 128, 128>(conv11_w, conv11_b);
+    cpu_policy_net.push_convolve<3, 128, 128>(conv12_w, conv12_b);
+    cpu_policy_net.push_convolve<3, 128,   1>(conv13_w, conv13_b);
+
+    cpu_value_net.push_convolve<5, 32, 64>(val_conv1_w, val_conv1_b);
+    cpu_value_net.push_convolve<3, 64, 64>(val_conv2_w, val_conv2_b);
+    cpu_value_net.push_convolve<3, 64, 64>(val_conv3_w, val_conv3_b);
+    cpu_value_net.push_convolve<3, 64, 64>(val_conv4_w, val_conv4_b);
+    cpu_value_net.push_convolve<3, 64, 64>(val_conv5_w, val_conv5_b);
+    cpu_value_net.push_convolve<3, 64, 64>(val_conv6_w, val_conv6_b);
+    cpu_value_net.push_convolve<3, 64, 64>(val_conv7_w, val_conv7_b);
+    cpu_value_net.push_convolve<3, 64, 64>(val_conv8_w, val_conv8_b);
+    cpu_value_net.push_convolve<3, 64, 64>(val_conv9_w, val_conv9_b);
+    cpu_value_net.push_convolve<3, 64, 64>(val_conv10_w, val_conv10_b);
+    cpu_value_net.push_convolve<3, 64, 64>(val_conv11_w, val_conv11_b);
+    cpu_value_net.push_convolve<3, 64,  1>(val_conv12_w, val_conv12_b);
+    cpu_value_net.push_innerproduct<361, 256>(val_ip13_w, val_ip13_b);
+    cpu_value_net.push_innerproduct<256,   1>(val_ip14_w, val_ip14_b);
+    myprintf("CPU network: %s kernels\n", CPUNetwork::get_isa().c_str());
+    if (!cfg_nn_int8_scales.empty()) {
+        if (load_int8_scales(cfg_nn_int8_scales)) {
+            myprintf("CPU network: int8 on %s, scales from %s\n",
+                     CPUNetwork::get_int8_isa().c_str(),
+                     cfg_nn_int8_scales.c_str());
+        } else {
+            myprintf("CPU network: can't use the int8 scales in %s, "
+                     "staying float\n", cfg_nn_int8_scales.c_str());
+        }
+    }
+#endif
 #ifdef USE_BLAS
 #ifndef __APPLE__
 #ifdef USE_OPENBLAS
@@ -342,13 +632,17 @@ void Network::initialize(void) {
 }
 
 #ifdef USE_BLAS
+// Batches are stored channel major: plane c of position b
+// starts at (c * batch + b) * 361.
 template<unsigned int filter_size,
          unsigned int channels, unsigned int outputs,
          size_t W, size_t B>
-void convolve(std::vector<float>& input,
+void convolve(size_t batch,
+              std::vector<float>& input,
               const std::array<float, W>& weights,
               const std::array<float, B>& biases,
-              std::vector<float>& output) {
+              std::vector<float>& output,
+              std::vector<float>& col) {
     // fixed for 19x19
     constexpr unsigned int width = 19;
     constexpr unsigned int height = 19;
@@ -357,8 +651,15 @@ void convolve(std::vector<float>& input,
     constexpr unsigned int filter_len = filter_size * filter_size;
     constexpr unsigned int filter_dim = filter_len * channels;
 
-    std::vector<float> col(filter_dim * width * height);
-    im2col<channels, filter_size>(input, col);
+    // One matrix multiply covers the whole batch
+    const size_t columns = batch * spatial_out;
+    if (col.size() < filter_dim * columns) {
+        col.resize(filter_dim * columns);
+    }
+    for (size_t b = 0; b < batch; b++) {
+        im2col<channels, filter_size>(&input[b * spatial_out], columns,
+                                      &col[b * spatial_out], columns);
+    }
 
     // Weight shape (output, input, filter_size, filter_size)
     // 96 22 5 5
@@ -374,10 +675,10 @@ void convolve(std::vector<float>& input,
 
     cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
                 // M        N            K
-                outputs, spatial_out, filter_dim,
+                outputs, columns, filter_dim,
                 1.0f, &weights[0], filter_dim,
-                &col[0], spatial_out,
-                0.0f, &output[0], spatial_out);
+                &col[0], columns,
+                0.0f, &output[0], columns);
 
     auto lambda_ELU = [](float val) { return (val > 0.0f) ?
                                       val : 1.0f * (std::exp(val) - 1.0f); };
@@ -385,67 +686,169 @@ void convolve(std::vector<float>& input,
     //                                   val : 0.0f; };
 
     for (unsigned int o = 0; o < outputs; o++) {
-        for (unsigned int b = 0; b < spatial_out; b++) {
-            output[(o * spatial_out) + b] =
-                lambda_ELU(biases[o] + output[(o * spatial_out) + b]);
+        for (size_t b = 0; b < columns; b++) {
+            output[(o * columns) + b] =
+                lambda_ELU(biases[o] + output[(o * columns) + b]);
         }
     }
 }
 
+// Input and output are position major, one row per position
 template<unsigned int inputs,
          unsigned int outputs,
          size_t W, size_t B>
-void innerproduct(std::vector<float>& input,
+void innerproduct(size_t batch,
+                  std::vector<float>& input,
                   const std::array<float, W>& weights,
                   const std::array<float, B>& biases,
                   std::vector<float>& output) {
     assert(B == outputs);
 
-    cblas_sgemv(CblasRowMajor, CblasNoTrans,
-                // M     K
-                outputs, inputs,
-                1.0f, &weights[0], inputs,
-                &input[0], 1,
-                0.0f, &output[0], 1);
+    // output[batch][outputs] = input[batch][inputs] x weights^T
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                // M     N        K
+                batch, outputs, inputs,
+                1.0f, &input[0], inputs,
+                &weights[0], inputs,
+                0.0f, &output[0], outputs);
 
     auto lambda_ELU = [](float val) { return (val > 0.0f) ?
                                       val : 1.0f * (std::exp(val) - 1.0f); };
     //auto lambda_ReLU = [](float val) { return (val > 0.0f) ?
     //                                   val : 0.0f; };
 
-    for (unsigned int o = 0; o < outputs; o++) {
-        float val = biases[o] + output[o];
-        if (outputs > 1) {
-            val = lambda_ELU(val);
+    for (size_t b = 0; b < batch; b++) {
+        for (unsigned int o = 0; o < outputs; o++) {
+            float val = biases[o] + output[b * outputs + o];
+            if (outputs > 1) {
+                val = lambda_ELU(val);
+            }
+            output[b * outputs + o] = val;
         }
-        output[o] = val;
+    }
+}
+#endif
+
+#ifdef USE_CPU_NETWORK
+void Network::get_values_batch(std::vector<float>& input, size_t batch,
+                               std::vector<float>& winrates) {
+#ifdef USE_NATIVE_CPU
+    std::vector<float> winrate_out;
+    cpu_value_net.forward(input, batch, winrate_out);
+#else
+    constexpr int boardsq = 19 * 19;
+    input.resize(MAX_VALUE_CHANNELS * batch * boardsq);
+    std::vector<float> output(MAX_VALUE_CHANNELS * batch * boardsq);
+    // Big enough to be worth keeping around
+    static thread_local std::vector<float> col;
+    std::vector<float> winrate_data(256 * batch);
+    std::vector<float> winrate_out(batch);
+
+    convolve<5, 32, 64>(batch, input, val_conv1_w, val_conv1_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64, 64>(batch, input, val_conv2_w, val_conv2_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64, 64>(batch, input, val_conv3_w, val_conv3_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64, 64>(batch, input, val_conv4_w, val_conv4_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64, 64>(batch, input, val_conv5_w, val_conv5_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64, 64>(batch, input, val_conv6_w, val_conv6_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64, 64>(batch, input, val_conv7_w, val_conv7_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64, 64>(batch, input, val_conv8_w, val_conv8_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64, 64>(batch, input, val_conv9_w, val_conv9_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64, 64>(batch, input, val_conv10_w, val_conv10_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64, 64>(batch, input, val_conv11_w, val_conv11_b, output, col);
+    std::swap(input, output);
+    convolve<3, 64,  1>(batch, input, val_conv12_w, val_conv12_b, output, col);
+    // Now get the score, a single plane is position major already
+    innerproduct<361, 256>(batch, output, val_ip13_w, val_ip13_b, winrate_data);
+    innerproduct<256, 1>(batch, winrate_data, val_ip14_w, val_ip14_b, winrate_out);
+#endif
+
+    for (size_t b = 0; b < batch; b++) {
+        // Sigmoid
+        winrates[b] = (1.0f + std::tanh(winrate_out[b])) / 2.0f;
     }
 }
 
-template<unsigned int channels,
-         unsigned int spatial_size>
-void batchnorm(std::vector<float>& input,
-               std::array<float, channels>& means,
-               std::array<float, channels>& variances,
-               std::array<float, 1> scale,
-               std::vector<float>& output)
-{
+void Network::get_policies_batch(std::vector<float>& input, size_t batch,
+                                 std::vector<float>& outputs) {
+    constexpr int boardsq = 19 * 19;
+#ifdef USE_NATIVE_CPU
+    std::vector<float> output;
+    cpu_policy_net.forward(input, batch, output);
+#else
+    input.resize(MAX_CHANNELS * batch * boardsq);
+    std::vector<float> output(MAX_CHANNELS * batch * boardsq);
+    static thread_local std::vector<float> col;
+
+    // XXX really only need the first 24
+    convolve<5,  32,  96>(batch, input, conv1_w, conv1_b, output, col);
+    std::swap(input, output);
+    convolve<3,  96, 128>(batch, input, conv2_w, conv2_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128, 128>(batch, input, conv3_w, conv3_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128, 128>(batch, input, conv4_w, conv4_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128, 128>(batch, input, conv5_w, conv5_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128, 128>(batch, input, conv6_w, conv6_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128, 128>(batch, input, conv7_w, conv7_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128, 128>(batch, input, conv8_w, conv8_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128, 128>(batch, input, conv9_w, conv9_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128, 128>(batch, input, conv10_w, conv10_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128, 128>(batch, input, conv11_w, conv11_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128, 128>(batch, input, conv12_w, conv12_b, output, col);
+    std::swap(input, output);
+    convolve<3, 128,   1>(batch, input, conv13_w, conv13_b, output, col);
+#endif
+
+    std::vector<float> softmax_data(boardsq);
+    for (size_t b = 0; b < batch; b++) {
+        std::copy(output.begin() + b * boardsq,
+                  output.begin() + (b + 1) * boardsq, input.begin());
+        softmax(input, softmax_data, cfg_softmax_temp);
+        std::copy(softmax_data.begin(), softmax_data.end(),
+                  outputs.begin() + b * boardsq);
+    }
+}
+#endif
+
+void Network::fold_batchnorm(std::vector<float>& weights,
+                             std::vector<float>& biases,
+                             const float * means,
+                             const float * variances,
+                             float scale) {
     constexpr float epsilon = 1e-5;
+    const size_t outputs = biases.size();
+    const size_t fan_in = weights.size() / outputs;
 
-    for (unsigned int c = 0; c < channels; ++c) {
-        float mean = means[c] / scale[0];
-        float variance = variances[c] / scale[0];
-        variance += epsilon;
+    // (w * x + b - mean) / stddev
+    for (size_t o = 0; o < outputs; o++) {
+        float mean = means[o] / scale;
+        float variance = variances[o] / scale + epsilon;
         float scale_stddiv = 1.0f / std::sqrt(variance);
 
-        float * out = &output[c * spatial_size];
-        float const * in  = &input[c * spatial_size];
-        for (unsigned int b = 0; b < spatial_size; b++) {
-            out[b] = scale_stddiv * (in[b] - mean);
+        for (size_t i = 0; i < fan_in; i++) {
+            weights[o * fan_in + i] *= scale_stddiv;
         }
+        biases[o] = (biases[o] - mean) * scale_stddiv;
     }
 }
-#endif
 
 void Network::softmax(std::vector<float>& input,
                       std::vector<float>& output,
@@ -472,6 +875,7 @@ void Network::softmax(std::vector<float>& input,
 class CallbackData {
 public:
     std::atomic<int> * m_nodecount;
+    NodeArena * m_arena;
     FastState m_state;
     UCTNode * m_node;
     int m_rotation;
@@ -522,8 +926,8 @@ extern "C" void CL_CALLBACK forward_cb(cl_event event, cl_int status,
 
     // Network::show_heatmap(&cb_data->m_state, result, false);
 
-    cb_data->m_node->scoring_cb(cb_data->m_nodecount, cb_data->m_state,
-                                result, false);
+    cb_data->m_node->scoring_cb(cb_data->m_nodecount, cb_data->m_arena,
+                                cb_data->m_state, result, false);
 
     delete cb_data;
 
@@ -534,6 +938,7 @@ extern "C" void CL_CALLBACK forward_cb(cl_event event, cl_int status,
 }
 
 void Network::async_scored_moves(std::atomic<int> * nodecount,
+                                 NodeArena * arena,
                                  FastState * state,
                                  UCTNode * node,
                                  Ensemble ensemble,
@@ -560,6 +965,7 @@ void Network::async_scored_moves(std::atomic<int> * nodecount,
     constexpr int height = 19;
 
     cb_data->m_nodecount = nodecount;
+    cb_data->m_arena = arena;
     cb_data->m_state = *state;
     cb_data->m_node = node;
     cb_data->m_input_data.resize(Network::MAX_CHANNELS * 19 * 19);
@@ -653,11 +1059,22 @@ Network::Netresult Network::get_scored_moves(
                       [](scored_node & sn){ sn.first /= 8.0f; });
     }
 
+    prune_ladders(state, result, *ladder);
+
+    // if (ensemble == AVERAGE_ALL || ensemble == DIRECT) {
+    //     show_heatmap(state, result, true);
+    // }
+
+    return result;
+}
+
+void Network::prune_ladders(FastState * state, Netresult & result,
+                            BoardPlane & ladder) {
     /* prune losing ladders completely */
     for (auto & sm : result) {
         std::pair<int, int> xy = state->board.get_xy(sm.second);
         int bitmappos = (xy.second * 19) + xy.first;
-        if ((*ladder)[bitmappos]) {
+        if (ladder[bitmappos]) {
             //myprintf("Ladder at %s (%d) score %f\n",
             //         state->board.move_to_text(sm.second).c_str(),
             //         sm.second,
@@ -665,12 +1082,21 @@ Network::Netresult Network::get_scored_moves(
             sm.first = 0.0f;
         }
     }
+}
 
-    // if (ensemble == AVERAGE_ALL || ensemble == DIRECT) {
-    //     show_heatmap(state, result, true);
-    // }
+void Network::fill_input(NNPlanes & planes, int channels, int rotation,
+                         float * input) {
+    constexpr int width = 19;
+    constexpr int height = 19;
 
-    return result;
+    for (int c = 0; c < channels; ++c) {
+        for (int h = 0; h < height; ++h) {
+            for (int w = 0; w < width; ++w) {
+                int vtx = rotate_nn_idx(h * 19 + w, rotation);
+                input[(c * height + h) * width + w] = (float)planes[c][vtx];
+            }
+        }
+    }
 }
 
 float Network::get_value_internal(
@@ -681,67 +1107,28 @@ float Network::get_value_internal(
     constexpr int channels = VALUE_CHANNELS;
     constexpr int width = 19;
     constexpr int height = 19;
-    constexpr int max_channels = MAX_VALUE_CHANNELS;
     std::vector<float> orig_input_data(planes.size() * width * height);
-    std::vector<float> input_data(max_channels * width * height);
-    std::vector<float> output_data(max_channels * width * height);
-    std::vector<float> winrate_data(256);
-    std::vector<float> winrate_out(1);
 
-    for (int c = 0; c < channels; ++c) {
-        for (int h = 0; h < height; ++h) {
-            for (int w = 0; w < width; ++w) {
-                int vtx = rotate_nn_idx(h * 19 + w, rotation);
-                orig_input_data[(c * height + h) * width + w] =
-                    (float)planes[c][vtx];
-            }
-        }
-    }
+    fill_input(planes, channels, rotation, &orig_input_data[0]);
 #ifdef USE_OPENCL
+    constexpr int max_channels = MAX_VALUE_CHANNELS;
+    std::vector<float> input_data(max_channels * width * height);
+    std::vector<float> output_data(max_channels * width * height);
     std::copy(orig_input_data.begin(), orig_input_data.end(), input_data.begin());
     opencl_value_net.forward(input_data, output_data, nullptr, nullptr);
     // Sigmoid
     float winrate_sig = (1.0f + std::tanh(output_data[0])) / 2.0f;
     result = winrate_sig;
-#elif defined(USE_BLAS)
-    std::copy(orig_input_data.begin(), orig_input_data.end(), input_data.begin());
-
-    convolve<5, 32, 64>(input_data, val_conv1_w, val_conv1_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64, 64>(input_data, val_conv2_w, val_conv2_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64, 64>(input_data, val_conv3_w, val_conv3_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64, 64>(input_data, val_conv4_w, val_conv4_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64, 64>(input_data, val_conv5_w, val_conv5_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64, 64>(input_data, val_conv6_w, val_conv6_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64, 64>(input_data, val_conv7_w, val_conv7_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64, 64>(input_data, val_conv8_w, val_conv8_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64, 64>(input_data, val_conv9_w, val_conv9_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64, 64>(input_data, val_conv10_w, val_conv10_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64, 64>(input_data, val_conv11_w, val_conv11_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 64,  1>(input_data, val_conv12_w, val_conv12_b, output_data);
-    // Now get the score
-    innerproduct<361, 256>(output_data, val_ip13_w, val_ip13_b, winrate_data);
-    innerproduct<256, 1>(winrate_data, val_ip14_w, val_ip14_b, winrate_out);
-    // Sigmoid
-    float winrate_sig = (1.0f + std::tanh(winrate_out[0])) / 2.0f;
-    result = winrate_sig;
+#elif defined(USE_CPU_NETWORK)
+    std::vector<float> winrates(1);
+    get_values_batch(orig_input_data, 1, winrates);
+    result = winrates[0];
  #endif
     return result;
 }
 
 Network::Netresult Network::get_scored_moves_internal(
     FastState * state, NNPlanes & planes, int rotation) {
-    Netresult result;
     assert(rotation >= 0 && rotation <= 7);
 #ifdef USE_CAFFE
     Blob* input_layer = s_net->input_blobs()[0];
@@ -756,56 +1143,20 @@ Network::Netresult Network::get_scored_moves_internal(
     constexpr int channels = POLICY_CHANNELS;
     constexpr int width = 19;
     constexpr int height = 19;
-    constexpr int max_channels = MAX_CHANNELS;
     std::vector<float> orig_input_data(planes.size() * width * height);
-    std::vector<float> input_data(max_channels * width * height);
-    std::vector<float> output_data(max_channels * width * height);
     std::vector<float> softmax_data(width * height);
 #endif
-    for (int c = 0; c < channels; ++c) {
-        for (int h = 0; h < height; ++h) {
-            for (int w = 0; w < width; ++w) {
-                int vtx = rotate_nn_idx(h * 19 + w, rotation);
-                orig_input_data[(c * height + h) * width + w] =
-                    (float)planes[c][vtx];
-            }
-        }
-    }
+    fill_input(planes, channels, rotation, &orig_input_data[0]);
 #ifdef USE_OPENCL
+    constexpr int max_channels = MAX_CHANNELS;
+    std::vector<float> input_data(max_channels * width * height);
+    std::vector<float> output_data(max_channels * width * height);
     std::copy(orig_input_data.begin(), orig_input_data.end(), input_data.begin());
     opencl_policy_net.forward(input_data, output_data, nullptr, nullptr);
     softmax(output_data, softmax_data, cfg_softmax_temp);
     std::vector<float>& outputs = softmax_data;
-#elif defined(USE_BLAS)
-    // XXX really only need the first 24
-    std::copy(orig_input_data.begin(), orig_input_data.end(), input_data.begin());
-
-    convolve<5,  32,  96>(input_data, conv1_w, conv1_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3,  96, 128>(input_data, conv2_w, conv2_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128, 128>(input_data, conv3_w, conv3_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128, 128>(input_data, conv4_w, conv4_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128, 128>(input_data, conv5_w, conv5_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128, 128>(input_data, conv6_w, conv6_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128, 128>(input_data, conv7_w, conv7_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128, 128>(input_data, conv8_w, conv8_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128, 128>(input_data, conv9_w, conv9_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128, 128>(input_data, conv10_w, conv10_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128, 128>(input_data, conv11_w, conv11_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128, 128>(input_data, conv12_w, conv12_b, output_data);
-    std::swap(input_data, output_data);
-    convolve<3, 128,   1>(input_data, conv13_w, conv13_b, output_data);
-    softmax(output_data, softmax_data, cfg_softmax_temp);
+#elif defined(USE_CPU_NETWORK)
+    get_policies_batch(orig_input_data, 1, softmax_data);
 
     // Move scores
     std::vector<float>& outputs = softmax_data;
@@ -817,7 +1168,14 @@ Network::Netresult Network::get_scored_moves_internal(
     const float* end = begin + output_layer->channels();
     auto outputs = std::vector<float>(begin, end);
 #endif
-    for (size_t idx = 0; idx < outputs.size(); idx++) {
+    return map_moves(state, &outputs[0], rotation);
+}
+
+Network::Netresult Network::map_moves(FastState * state,
+                                      const float * outputs, int rotation) {
+    Netresult result;
+
+    for (int idx = 0; idx < 19 * 19; idx++) {
         int rot_idx = rev_rotate_nn_idx(idx, rotation);
         float val = outputs[rot_idx];
         int x = idx % 19;
@@ -1551,6 +1909,13 @@ std::string Network::get_backend() {
     return std::string("BLAS core: Apple Accelerate");
 #endif
 #endif
+#ifdef USE_NATIVE_CPU
+    if (cpu_policy_net.is_quantized()) {
+        return std::string("CPU kernels: " + CPUNetwork::get_isa()
+                           + ", int8 on " + CPUNetwork::get_int8_isa());
+    }
+    return std::string("CPU kernels: " + CPUNetwork::get_isa());
+#endif
 #endif
     return std::string("No BLAS backend active");
 }
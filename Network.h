@@ -12,6 +12,7 @@
 #ifdef USE_OPENCL
 #include <atomic>
 class UCTNode;
+class NodeArena;
 #endif
 #ifdef USE_CAFFE
 #include <caffe/caffe.hpp>
@@ -56,11 +57,29 @@ public:
 
 #ifdef USE_OPENCL
     void async_scored_moves(std::atomic<int> * nodecount,
+                            NodeArena * arena,
                             FastState * state, UCTNode * node,
                             Ensemble ensemble, int rotation = -1);
 #endif
     void initialize();
     void benchmark(FastState * state);
+#ifdef USE_NATIVE_CPU
+    /*
+        Per layer timings of both CPU networks on batch copies of
+        state, and how far Winograd is from the direct convolution
+        and int8 from float
+    */
+    static void check_layers(FastState * state, int batch);
+    /*
+        Run up to max_positions positions of the games in sgf_name
+        through the float CPU networks, write the int8 scales that
+        cover what their layers see to scales_name, and report how
+        int8 with them compares to float on the same positions.
+    */
+    static void calibrate_from_file(std::string sgf_name,
+                                    std::string scales_name,
+                                    int max_positions);
+#endif
     static void show_heatmap(FastState * state, Netresult & netres, bool topmoves);
     void autotune_from_file(std::string filename);
     static Network* get_Network(void);
@@ -69,16 +88,51 @@ public:
     static int rev_rotate_nn_idx(const int vertex, int symmetry);
     static void softmax(std::vector<float>& input, std::vector<float>& output,
                         float temperature = 1.0f);
+    /*
+        Fold a batchnorm of a layer's outputs into the layer's
+        weights (outputs, ...) and biases. means and variances
+        are running sums, divided by scale as in Caffe.
+    */
+    static void fold_batchnorm(std::vector<float>& weights,
+                               std::vector<float>& biases,
+                               const float * means,
+                               const float * variances,
+                               float scale);
 
 private:
 #ifdef USE_CAFFE
     static std::unique_ptr<caffe::Net> s_net;
 #endif
 
+    friend class NNQueue;
+
     static Netresult get_scored_moves_internal(
       FastState * state, NNPlanes & planes, int rotation);
     static float get_value_internal(
       FastState * state, NNPlanes & planes, int rotation);
+#ifdef USE_NATIVE_CPU
+    // switch both CPU networks to int8, false if the file won't do
+    static bool load_int8_scales(std::string filename);
+#endif
+#ifdef USE_CPU_NETWORK
+    /*
+        Run batch positions through the CPU networks at once. The
+        planes of all positions are stored channel major, plane c of
+        position b starts at (c * batch + b) * 361. input is used as
+        scratch space. Policy outputs are the softmaxed move
+        probabilities, 361 per position, still rotated.
+    */
+    static void get_values_batch(std::vector<float>& input, size_t batch,
+                                 std::vector<float>& winrates);
+    static void get_policies_batch(std::vector<float>& input, size_t batch,
+                                   std::vector<float>& outputs);
+#endif
+    static void fill_input(NNPlanes & planes, int channels, int rotation,
+                           float * input);
+    static Netresult map_moves(FastState * state, const float * outputs,
+                               int rotation);
+    static void prune_ladders(FastState * state, Netresult & result,
+                              BoardPlane & ladder);
     void gather_traindata(std::string filename, TrainVector& tv);
     void train_network(TrainVector& tv, size_t&, size_t&);
     static void gather_features_policy(FastState * state, NNPlanes & planes,
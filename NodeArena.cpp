@@ -0,0 +1,164 @@
+#include "config.h"
+
+#include <assert.h>
+#include <cstdint>
+#include <algorithm>
+
+#include "NodeArena.h"
+
+namespace {
+    struct ThreadSlab {
+        uint64 m_arena_id{0};
+        char * m_cur{nullptr};
+        char * m_end{nullptr};
+    };
+
+    thread_local ThreadSlab t_slab;
+
+    std::atomic<uint64> s_next_arena_id{1};
+    std::atomic<size_t> s_total_bytes{0};
+    std::atomic<size_t> s_peak_bytes{0};
+}
+
+NodeArena::NodeArena()
+    : m_id(s_next_arena_id++) {
+    for (auto & list : m_freecount) {
+        for (auto & count : list) {
+            count = 0;
+        }
+    }
+}
+
+NodeArena::~NodeArena() {
+    for (auto slab : m_slabs) {
+        delete[] slab;
+    }
+    s_total_bytes -= m_bytes_reserved;
+}
+
+size_t NodeArena::size_class(size_t bytes) {
+    return (bytes + ALIGNMENT - 1) / ALIGNMENT;
+}
+
+char * NodeArena::new_slab(size_t bytes) {
+    char * slab = new char[bytes + ALIGNMENT];
+    {
+        LOCK(m_slabmutex, lock);
+        m_slabs.push_back(slab);
+    }
+    m_bytes_reserved += bytes;
+
+    size_t total = (s_total_bytes += bytes);
+    size_t peak = s_peak_bytes;
+    while (total > peak && !s_peak_bytes.compare_exchange_weak(peak, total));
+
+    // align to a cache line
+    uintptr_t base = reinterpret_cast<uintptr_t>(slab);
+    base = (base + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1);
+    char * start = reinterpret_cast<char*>(base);
+
+    int node = SMP::get_thread_node();
+    if (node >= 0) {
+        LOCK(m_slabmutex, lock);
+        m_slab_lists[start] = node + 1;
+    }
+    return start;
+}
+
+int NodeArena::home_list(void * ptr) {
+    LOCK(m_slabmutex, lock);
+    if (m_slab_lists.empty()) {
+        return 0;
+    }
+    char * block = static_cast<char*>(ptr);
+    auto it = m_slab_lists.upper_bound(block);
+    if (it == m_slab_lists.begin()) {
+        return 0;
+    }
+    --it;
+    if (block >= it->first + SLAB_SIZE) {
+        return 0;
+    }
+    return it->second;
+}
+
+void * NodeArena::pop_free(int list, size_t sclass) {
+    // The unlocked check keeps us off the mutex in the
+    // common (empty) case.
+    if (m_freecount[list][sclass].load(std::memory_order_relaxed) == 0) {
+        return nullptr;
+    }
+    LOCK(m_freemutex, lock);
+    auto & freelist = m_freelist[list][sclass];
+    if (freelist.empty()) {
+        return nullptr;
+    }
+    void * block = freelist.back();
+    freelist.pop_back();
+    m_freecount[list][sclass]--;
+    return block;
+}
+
+void * NodeArena::allocate(size_t bytes) {
+    assert(bytes > 0 && bytes <= MAX_BLOCK);
+    size_t sclass = size_class(bytes);
+    size_t rounded = sclass * ALIGNMENT;
+
+    m_bytes_in_use += rounded;
+
+    // Recycle a released block from our own node if there are any
+    const int own_list = SMP::get_thread_node() + 1;
+    void * block = pop_free(own_list, sclass);
+    if (block != nullptr) {
+        return block;
+    }
+
+    ThreadSlab & slab = t_slab;
+    if (slab.m_arena_id != m_id
+        || (size_t)(slab.m_end - slab.m_cur) < rounded) {
+        // Remote memory still beats growing the arena
+        for (int list = 0; list < NUM_LISTS; list++) {
+            if (list != own_list
+                && (block = pop_free(list, sclass)) != nullptr) {
+                return block;
+            }
+        }
+        // Whatever is left in the old slab stays unused until
+        // the arena goes away.
+        slab.m_cur = new_slab(SLAB_SIZE);
+        slab.m_end = slab.m_cur + SLAB_SIZE;
+        slab.m_arena_id = m_id;
+    }
+
+    block = slab.m_cur;
+    slab.m_cur += rounded;
+    return block;
+}
+
+void NodeArena::release(void * ptr, size_t bytes) {
+    assert(ptr != nullptr);
+    size_t sclass = size_class(bytes);
+
+    m_bytes_in_use -= sclass * ALIGNMENT;
+
+    int list = home_list(ptr);
+    LOCK(m_freemutex, lock);
+    m_freelist[list][sclass].push_back(ptr);
+    m_freecount[list][sclass]++;
+}
+
+size_t NodeArena::get_bytes_in_use() const {
+    return m_bytes_in_use;
+}
+
+size_t NodeArena::get_bytes_reserved() const {
+    return m_bytes_reserved;
+}
+
+size_t NodeArena::get_total_bytes() {
+    return s_total_bytes;
+}
+
+size_t NodeArena::get_peak_bytes() {
+    return s_peak_bytes;
+}
@@ -0,0 +1,77 @@
+#ifndef NODEARENA_H_INCLUDED
+#define NODEARENA_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <vector>
+
+#include "SMP.h"
+
+/*
+    Memory arena for search tree nodes. Every thread carves its
+    allocations out of a private slab, so expanding a node doesn't
+    touch malloc or any shared lock. Freed blocks go on a free list
+    and get reused. Destroying the arena releases all slabs at once,
+    no matter how many nodes were handed out.
+
+    Threads bound to a NUMA node get their slabs there, because
+    they are the first to touch them. Freed blocks go back to the
+    free list of the node they came from, and threads reuse blocks
+    from their own node before anything else.
+*/
+class NodeArena {
+public:
+    NodeArena();
+    ~NodeArena();
+
+    void * allocate(size_t bytes);
+    void release(void * ptr, size_t bytes);
+
+    size_t get_bytes_in_use() const;
+    size_t get_bytes_reserved() const;
+
+    /*
+        bytes reserved in slabs, totalled over all arenas
+        alive in the process
+    */
+    static size_t get_total_bytes();
+    static size_t get_peak_bytes();
+
+    static constexpr size_t ALIGNMENT = 64;
+    static constexpr size_t SLAB_SIZE = 1 << 20;
+    static constexpr size_t MAX_BLOCK = 65536;
+
+private:
+    NodeArena(const NodeArena &) = delete;
+    NodeArena & operator=(const NodeArena &) = delete;
+
+    static size_t size_class(size_t bytes);
+    char * new_slab(size_t bytes);
+    int home_list(void * ptr);
+    void * pop_free(int list, size_t sclass);
+
+    // unique per arena, so per-thread slabs are never used
+    // with a later arena that happens to get the same address
+    const uint64 m_id;
+
+    SMP::Mutex m_slabmutex;
+    std::vector<char*> m_slabs;
+    // aligned slab start -> free list it belongs to, only
+    // filled in once a thread bound to a node made a slab
+    std::map<char*, int> m_slab_lists;
+
+    // one free list per NUMA node, and one for unbound threads
+    static constexpr int NUM_LISTS = SMP::MAX_NUMA_NODES + 1;
+    static constexpr size_t NUM_CLASSES = MAX_BLOCK / ALIGNMENT + 1;
+    SMP::Mutex m_freemutex;
+    std::vector<void*> m_freelist[NUM_LISTS][NUM_CLASSES];
+    std::atomic<int> m_freecount[NUM_LISTS][NUM_CLASSES];
+
+    std::atomic<size_t> m_bytes_in_use{0};
+    std::atomic<size_t> m_bytes_reserved{0};
+};
+
+#endif
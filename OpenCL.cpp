@@ -379,29 +379,16 @@ static std::string sourceCode_utility = R"(
     __kernel void batchnorm(
                         __global const float * in,
                         __global float * out,
-                        __constant const float * means,
-                        __constant const float * variances,
-                        __constant const float * scale) {
+                        __constant const float * scales,
+                        __constant const float * shifts) {
 
-        // cl::NDRange global(outputs, 19*19);
-        const int gx = get_global_id(0);
-        const int gy = get_global_id(1);
-
-        const int output = gx;
-        const int outputs      = get_global_size(0);
+        // cl::NDRange global(outputs, channel_size);
+        const int o = get_global_id(0);
+        const int b = get_global_id(1);
         const int channel_size = get_global_size(1);
 
-        const unsigned int o = output;
-        const unsigned int b = gy;
-
-        const float epsilon = 1e-5;
-
-        const float mean = means[o] / scale[0];
-        const float variance = epsilon + variances[o] / scale[0];
-        const float scale_stddiv = 1.0f / sqrt(variance);
-
-        out[o * channel_size + b] = scale_stddiv
-                                    * (in[o * channel_size + b] - mean);
+        out[o * channel_size + b] = scales[o] * in[o * channel_size + b]
+                                    + shifts[o];
     }
 
     __kernel void innerproduct(
@@ -487,6 +474,44 @@ void OpenCL_Network::add_weights(size_t layer,
     m_layers.back().weights.push_back(bufferWeights);
 }
 
+void OpenCL_Network::fold_batchnorm(size_t outputs,
+                                    const float * means,
+                                    const float * variances,
+                                    float scale) {
+    assert(!m_layers.empty());
+    assert(!m_layers.back().is_batchnorm);
+    assert(m_layers.back().outputs == outputs);
+    (void)outputs;
+
+    Network::fold_batchnorm(m_pushed_weights, m_pushed_biases,
+                            means, variances, scale);
+
+    // Replace the layer's buffers with the folded ones
+    size_t layer = get_layer_count() - 1;
+    m_layers.back().weights.clear();
+    add_weights(layer, m_pushed_weights.size(), m_pushed_weights.data());
+    add_weights(layer, m_pushed_biases.size(), m_pushed_biases.data());
+}
+
+void OpenCL_Network::add_batchnorm(size_t outputs,
+                                   unsigned int channel_size,
+                                   const float * means,
+                                   const float * variances,
+                                   float scale) {
+    // The same fold, into a layer that passes its input through
+    std::vector<float> scales(outputs, 1.0f);
+    std::vector<float> shifts(outputs, 0.0f);
+    Network::fold_batchnorm(scales, shifts, means, variances, scale);
+
+    size_t layer = get_layer_count();
+    add_weights(layer, outputs, scales.data());
+    add_weights(layer, outputs, shifts.data());
+    m_layers[layer].is_batchnorm = true;
+    m_layers[layer].channels = outputs;
+    m_layers[layer].outputs = outputs;
+    m_layers[layer].filter_size = channel_size;
+}
+
 void OpenCL_Network::forward(std::vector<float>& input,
                              std::vector<float>& output,
                              event_callback cb, void * data) {
@@ -705,7 +730,6 @@ void OpenCL_Network::batchnorm(int outputs,
         batchnorm_kernel.setArg(1, bufferOutput);
         batchnorm_kernel.setArg(2, weights[0]);
         batchnorm_kernel.setArg(3, weights[1]);
-        batchnorm_kernel.setArg(4, weights[2]);
 
         queue.enqueueNDRangeKernel(batchnorm_kernel, cl::NullRange,
                                    cl::NDRange(outputs, channel_size),
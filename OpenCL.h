@@ -48,19 +48,29 @@ class OpenCL_Network {
 public:
     using event_callback =  void (CL_CALLBACK *) (cl_event, cl_int, void *);
 
+    // where a batchnorm sits, next to the ELU of the layer before it
+    enum class BatchnormOrder { BEFORE_ELU, AFTER_ELU };
+
+    /*
+        Normalize the outputs of the layer pushed last. Ahead of
+        its ELU, as Caffe orders them, it is folded into that
+        layer's weights and biases and nothing runs for it. After
+        the ELU, as the batchnorm layer here always ran, it stays
+        a pass of its own, a scale and shift per channel.
+    */
     template <size_t M, size_t V>
-    void push_batchnorm(unsigned int channel_size,
+    void push_batchnorm(BatchnormOrder order,
+                        unsigned int channel_size,
                         const std::array<float, M> & means,
                         const std::array<float, V> & variances,
                         const std::array<float, 1> & scale) {
-        size_t layer = get_layer_count();
-        push_weights(layer, means);
-        push_weights(layer, variances);
-        push_weights(layer, scale);
-        m_layers[layer].is_batchnorm = true;
-        m_layers[layer].channels = M;
-        m_layers[layer].outputs = M;
-        m_layers[layer].filter_size = channel_size;
+        static_assert(M == V, "batchnorm means and variances don't match");
+        if (order == BatchnormOrder::BEFORE_ELU) {
+            fold_batchnorm(M, means.data(), variances.data(), scale[0]);
+        } else {
+            add_batchnorm(M, channel_size,
+                          means.data(), variances.data(), scale[0]);
+        }
     }
 
     template <size_t W, size_t B>
@@ -70,6 +80,7 @@ public:
         size_t layer = get_layer_count();
         push_weights(layer, weights);
         push_weights(layer, biases);
+        keep_pushed(weights, biases);
         m_layers[layer].outputs = B;
         m_layers[layer].filter_size = filter_size;
         m_layers[layer].channels = W / (B * filter_size * filter_size);
@@ -81,6 +92,7 @@ public:
         size_t layer = get_layer_count();
         push_weights(layer, weights);
         push_weights(layer, biases);
+        keep_pushed(weights, biases);
         m_layers[layer].is_innerproduct = true;
         m_layers[layer].channels = W / B;
         m_layers[layer].outputs = B;
@@ -99,6 +111,17 @@ private:
         add_weights(layer, W, weights.data());
     }
     void add_weights(size_t layer, size_t size, const float * weights);
+    template <size_t W, size_t B>
+    void keep_pushed(const std::array<float, W> & weights,
+                     const std::array<float, B> & biases) {
+        m_pushed_weights.assign(weights.begin(), weights.end());
+        m_pushed_biases.assign(biases.begin(), biases.end());
+    }
+    void fold_batchnorm(size_t outputs, const float * means,
+                        const float * variances, float scale);
+    void add_batchnorm(size_t outputs, unsigned int channel_size,
+                       const float * means, const float * variances,
+                       float scale);
     void convolve(int filter_size, int channels, int outputs,
                   cl::Buffer& input, cl::Buffer& output, cl::Buffer& merge,
                   std::vector<cl::Buffer>& weights);
@@ -108,6 +131,9 @@ private:
                       cl::Buffer& input, cl::Buffer& output,
                       std::vector<cl::Buffer>& weights);
     std::vector<Layer> m_layers;
+    // weights of the layer pushed last, for a batchnorm to fold into
+    std::vector<float> m_pushed_weights;
+    std::vector<float> m_pushed_biases;
 };
 
 class OpenCL {
@@ -18,8 +18,8 @@ using namespace Utils;
 
 Playout::Playout() :
     m_run(false), m_eval_valid(false) {
-    m_sq[0].reset();
-    m_sq[1].reset();
+    m_sq[0].fill(0);
+    m_sq[1].fill(0);
 }
 
 float Playout::get_score() const {
@@ -71,8 +71,10 @@ void Playout::run(FastState & state, bool postpassout, bool resigning,
         if (counter < 30 && vtx != FastBoard::PASS) {
             int color = !state.get_to_move();
 
-            if (!m_sq[!color][vtx]) {
-                m_sq[color][vtx] = true;
+            const int word = vtx / 64;
+            const uint64 bit = 1ULL << (vtx % 64);
+            if (!(m_sq[!color][word] & bit)) {
+                m_sq[color][word] |= bit;
             }
         }
 
@@ -112,14 +114,9 @@ void Playout::run(FastState & state, bool postpassout, bool resigning,
     m_score = board_score / (boardsize * boardsize);
 }
 
-bool Playout::passthrough(int color, int vertex) {
+const Playout::movemask_t & Playout::get_first_plays(int color) const {
     assert(m_run);
-    
-    if (vertex == FastBoard::PASS) {
-        return false;
-    }
-    
-    return m_sq[color][vertex];
+    return m_sq[color];
 }
 
 void Playout::do_playout_benchmark(GameState & game) {
@@ -172,37 +169,45 @@ void Playout::do_playout_benchmark(GameState & game) {
 }
 
 float Playout::mc_owner(FastState & state, const int iterations, float* points) {
-    int cpus = cfg_num_threads;
-    int iters_per_thread = (iterations + (cpus - 1)) / cpus;
-
-    std::atomic<float> bwins{0.0f};
-    std::atomic<float> board_score{0.0f};
-
-    ThreadGroup tg(thread_pool);
-    for (int i = 0; i < cpus; i++) {
-        tg.add_task([iters_per_thread, &state,
-                     &bwins, &board_score]() {
-            float thread_bwins = 0.0f;
-            float thread_board_score = 0.0f;
-            for (int i = 0; i < iters_per_thread; i++) {
-                FastState tmp = state;
-
-                Playout p;
-                p.run(tmp, true, false);
-
-                float score = p.get_score();
-                if (score == 0.0f) {
-                    thread_bwins += 0.5f;
-                } else if (score > 0.0f) {
-                    thread_bwins += 1.0f;
-                }
-                thread_board_score += p.get_territory();
+    // A fixed range of playouts for every thread that can help,
+    // each summed on its own and added up in order afterwards.
+    const int chunks = std::max(1, std::min(iterations,
+                                            (int)thread_pool.size() + 1));
+    std::vector<float> chunk_bwins(chunks);
+    std::vector<float> chunk_board_score(chunks);
+
+    parallel_for(thread_pool, 0, chunks,
+                 [&state, iterations, chunks,
+                  &chunk_bwins, &chunk_board_score](int chunk) {
+        const int first = iterations * chunk / chunks;
+        const int last = iterations * (chunk + 1) / chunks;
+        float thread_bwins = 0.0f;
+        float thread_board_score = 0.0f;
+        FastState tmp;
+        for (int i = first; i < last; i++) {
+            tmp = state;
+
+            Playout p;
+            p.run(tmp, true, false);
+
+            float score = p.get_score();
+            if (score == 0.0f) {
+                thread_bwins += 0.5f;
+            } else if (score > 0.0f) {
+                thread_bwins += 1.0f;
             }
-            atomic_add(bwins, thread_bwins);
-            atomic_add(board_score, thread_board_score);
-        });
+            thread_board_score += p.get_territory();
+        }
+        chunk_bwins[chunk] = thread_bwins;
+        chunk_board_score[chunk] = thread_board_score;
+    });
+
+    float bwins = 0.0f;
+    float board_score = 0.0f;
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        bwins += chunk_bwins[chunk];
+        board_score += chunk_board_score[chunk];
     }
-    tg.wait_all();
 
     float score = bwins / (float)iterations;
     if (state.get_to_move() != FastBoard::BLACK) {
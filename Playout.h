@@ -11,7 +11,12 @@
 class Playout {
 public:
     using bitboard_t = std::bitset<FastBoard::MAXSQ>;
-    using color_bitboard_t = std::array<bitboard_t, 2>;
+    /*
+        Vertices one side played first during the playout,
+        as plain words so they can be and-ed with other masks.
+    */
+    static constexpr int MASK_WORDS = (FastBoard::MAXSQ + 63) / 64;
+    using movemask_t = std::array<uint64, MASK_WORDS>;
 
     static const int AUTOGAMES = 200000;
     static void do_playout_benchmark(GameState & game);
@@ -27,14 +32,14 @@ public:
     void set_eval(float eval);
     float get_eval() const;
     bool has_eval() const;
-    bool passthrough(int color, int vertex);
+    const movemask_t & get_first_plays(int color) const;
 private:
     bool m_run;
     float m_score;
     float m_territory;
     bool m_eval_valid;
     float m_blackeval;
-    color_bitboard_t m_sq;
+    std::array<movemask_t, 2> m_sq;
 };
 
 #endif
@@ -1,7 +1,114 @@
 #include "config.h"
 #include "SMP.h"
 
+#include <cassert>
+#include <chrono>
 #include <thread>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#ifdef WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+    // CPUs of every node, read once
+    struct Topology {
+        Topology();
+        std::vector<std::vector<int>> m_node_cpus;
+    };
+
+    thread_local int t_bound_node = -1;
+
+    const Topology & get_topology() {
+        static const Topology topology;
+        return topology;
+    }
+
+    std::atomic<SMP::LockSite*> s_lock_sites{nullptr};
+
+    // pauses before giving up the CPU
+    constexpr int MAX_BACKOFF = 64;
+
+    /*
+        Tell the CPU we are spinning. It leaves the core to a
+        hyperthread sibling meanwhile, and doesn't mispredict
+        the exit from the loop.
+    */
+    inline void cpu_pause() {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+}
+
+Topology::Topology() {
+#if defined(__linux__)
+    // cpulist looks like "0-15,32-47"
+    for (int node = 0; node < SMP::MAX_NUMA_NODES; node++) {
+        std::ifstream cpulist("/sys/devices/system/node/node"
+                              + std::to_string(node) + "/cpulist");
+        std::string line;
+        if (!cpulist || !std::getline(cpulist, line)) {
+            break;
+        }
+        std::vector<int> cpus;
+        std::istringstream ranges(line);
+        std::string range;
+        while (std::getline(ranges, range, ',')) {
+            int first, last;
+            char dash;
+            std::istringstream rangestream(range);
+            rangestream >> first;
+            if (!(rangestream >> dash >> last)) {
+                last = first;
+            }
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (cpus.empty()) {
+            break;
+        }
+        m_node_cpus.push_back(cpus);
+    }
+#elif defined(WIN32)
+    ULONG highest;
+    if (GetNumaHighestNodeNumber(&highest)) {
+        for (ULONG node = 0; node <= highest
+             && node < (ULONG)SMP::MAX_NUMA_NODES; node++) {
+            ULONGLONG mask;
+            std::vector<int> cpus;
+            if (GetNumaNodeProcessorMask((UCHAR)node, &mask)) {
+                for (int cpu = 0; cpu < 64; cpu++) {
+                    if (mask & (1ULL << cpu)) {
+                        cpus.push_back(cpu);
+                    }
+                }
+            }
+            if (cpus.empty()) {
+                break;
+            }
+            m_node_cpus.push_back(cpus);
+        }
+    }
+#endif
+    if (m_node_cpus.empty()) {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < SMP::get_num_cpus(); cpu++) {
+            cpus.push_back(cpu);
+        }
+        m_node_cpus.push_back(cpus);
+    }
+}
 
 SMP::Mutex::Mutex() {
     m_lock = false;
@@ -11,23 +118,170 @@ bool SMP::Mutex::is_held() {
     return m_lock.load(std::memory_order_acquire);
 }
 
-SMP::Lock::Lock(Mutex & m) {
+SMP::LockSite::LockSite(const char * file, int line)
+    : m_file(file), m_line(line) {
+    m_next = s_lock_sites.load();
+    while (!s_lock_sites.compare_exchange_weak(m_next, this));
+}
+
+std::vector<const SMP::LockSite*> SMP::get_lock_sites() {
+    std::vector<const LockSite*> sites;
+    for (LockSite * site = s_lock_sites; site != nullptr;
+         site = site->m_next) {
+        sites.push_back(site);
+    }
+    return sites;
+}
+
+SMP::Lock::Lock(Mutex & m, LockSite * site) {
     m_mutex = &m;
+    m_site = site;
     lock();
 }
 
 void SMP::Lock::lock() {
-    while (m_mutex->m_lock.exchange(true, std::memory_order_acquire) == true);
+    assert(!m_owns);
+    if (m_mutex->m_lock.exchange(true, std::memory_order_acquire)) {
+        lock_contended();
+    }
+    m_owns = true;
+#ifdef USE_LOCK_STATS
+    if (m_site != nullptr) {
+        m_site->m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+    }
+#endif
+}
+
+void SMP::Lock::lock_contended() {
+#ifdef USE_LOCK_STATS
+    auto start = std::chrono::steady_clock::now();
+#endif
+    int64 spins = 0;
+    int backoff = 1;
+    do {
+        // Reading keeps our copy of the cache line shared, where
+        // every exchange would pull it over from the holder.
+        while (m_mutex->m_lock.load(std::memory_order_relaxed)) {
+            if (backoff <= MAX_BACKOFF) {
+                for (int i = 0; i < backoff; i++) {
+                    cpu_pause();
+                }
+                backoff *= 2;
+            } else {
+                std::this_thread::yield();
+            }
+            spins++;
+        }
+    } while (m_mutex->m_lock.exchange(true, std::memory_order_acquire));
+#ifdef USE_LOCK_STATS
+    if (m_site != nullptr) {
+        auto wait = std::chrono::steady_clock::now() - start;
+        m_site->m_contended.fetch_add(1, std::memory_order_relaxed);
+        m_site->m_spins.fetch_add(spins, std::memory_order_relaxed);
+        m_site->m_wait_ns.fetch_add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count(),
+            std::memory_order_relaxed);
+    }
+#else
+    (void)spins;
+#endif
 }
 
 void SMP::Lock::unlock() {
+    assert(m_owns);
+    m_owns = false;
     m_mutex->m_lock.store(false, std::memory_order_release);
 }
 
 SMP::Lock::~Lock() {
-    unlock();
+    if (m_owns) {
+        unlock();
+    }
 }
 
 int SMP::get_num_cpus() {
     return std::thread::hardware_concurrency();
 }
+
+int SMP::get_num_numa_nodes() {
+    return (int)get_topology().m_node_cpus.size();
+}
+
+int SMP::get_numa_node_cpus(int node) {
+    return (int)get_topology().m_node_cpus[node].size();
+}
+
+bool SMP::bind_thread(int node) {
+    const std::vector<int> & cpus = get_topology().m_node_cpus[node];
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    // 0 is the calling thread, not the process
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        return false;
+    }
+#elif defined(WIN32)
+    DWORD_PTR mask = 0;
+    for (int cpu : cpus) {
+        if (cpu < (int)(8 * sizeof(mask))) {
+            mask |= (DWORD_PTR)1 << cpu;
+        }
+    }
+    if (!SetThreadAffinityMask(GetCurrentThread(), mask)) {
+        return false;
+    }
+#else
+    (void)cpus;
+    return false;
+#endif
+    t_bound_node = node;
+    return true;
+}
+
+void SMP::unbind_thread() {
+    if (t_bound_node < 0) {
+        return;
+    }
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto & cpus : get_topology().m_node_cpus) {
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+#elif defined(WIN32)
+    DWORD_PTR process_mask, system_mask;
+    if (GetProcessAffinityMask(GetCurrentProcess(),
+                               &process_mask, &system_mask)) {
+        SetThreadAffinityMask(GetCurrentThread(), process_mask);
+    }
+#endif
+    t_bound_node = -1;
+}
+
+int SMP::get_thread_node() {
+    return t_bound_node;
+}
+
+SMP::NodeBinding::NodeBinding(int node)
+    : m_node(node), m_previous(t_bound_node) {
+    if (m_node >= 0) {
+        bind_thread(m_node);
+    }
+}
+
+SMP::NodeBinding::~NodeBinding() {
+    if (m_node < 0) {
+        return;
+    }
+    if (m_previous >= 0) {
+        bind_thread(m_previous);
+    } else {
+        unbind_thread();
+    }
+}
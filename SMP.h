@@ -3,10 +3,65 @@
 
 #include "config.h"
 #include <atomic>
+#include <vector>
 
 namespace SMP {
     int get_num_cpus();
 
+    /*
+        NUMA topology. Systems without NUMA, or where we can't find
+        out, look like a single node with all CPUs on it.
+    */
+    static constexpr int MAX_NUMA_NODES = 8;
+    int get_num_numa_nodes();
+    int get_numa_node_cpus(int node);
+    /*
+        Restrict the calling thread to the CPUs of a node, so the
+        memory it touches first gets allocated there. Returns false
+        if the system doesn't let us.
+    */
+    bool bind_thread(int node);
+    void unbind_thread();
+    // node the calling thread is bound to, or -1
+    int get_thread_node();
+
+    // binds the calling thread for its lifetime, -1 leaves it alone
+    class NodeBinding {
+    public:
+        explicit NodeBinding(int node);
+        ~NodeBinding();
+    private:
+        int m_node;
+        int m_previous;
+    };
+
+    /*
+        Statistics of one place in the code that takes a lock. They
+        are only kept when built with USE_LOCK_STATS, the LOCK macro
+        then makes one for every call site.
+    */
+    class LockSite {
+    public:
+        LockSite(const char * file, int line);
+        const char * m_file;
+        int m_line;
+        std::atomic<int64> m_acquisitions{0};
+        // acquisitions that found the lock taken
+        std::atomic<int64> m_contended{0};
+        // times we waited for it to look free
+        std::atomic<int64> m_spins{0};
+        std::atomic<int64> m_wait_ns{0};
+        LockSite * m_next;
+    };
+    // every site that locked so far
+    std::vector<const LockSite*> get_lock_sites();
+
+    /*
+        Spinlock. Waiters watch the lock with plain reads, pausing
+        between them and backing off exponentially, and only try to
+        take it when it looks free. If that takes long they yield,
+        the holder may be waiting for our CPU.
+    */
     class Mutex {
     public:
         Mutex();
@@ -19,16 +74,26 @@ namespace SMP {
 
     class Lock {
     public:
-        explicit Lock(Mutex & m);
+        explicit Lock(Mutex & m, LockSite * site = nullptr);
         ~Lock();
         void lock();
         void unlock();
     private:
+        void lock_contended();
         Mutex * m_mutex;
+        LockSite * m_site;
+        // so the destructor doesn't release a lock we gave up
+        bool m_owns{false};
     };
 }
 
 // Avoids accidentally creating a temporary
+#ifdef USE_LOCK_STATS
+#define LOCK(mutex, lock) \
+    static SMP::LockSite lock##_site(__FILE__, __LINE__); \
+    SMP::Lock lock((mutex), &lock##_site)
+#else
 #define LOCK(mutex, lock) SMP::Lock lock((mutex))
+#endif
 
 #endif
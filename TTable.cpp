@@ -1,64 +1,576 @@
 #include "config.h"
 
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <new>
 #include <vector>
+#include <thread>
+#include <chrono>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "Utils.h"
 #include "TTable.h"
+#include "Random.h"
+#include "Timing.h"
+#include "GTP.h"
+
+using namespace Utils;
+
+// Processes sharing a table see each other's atomics
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "TTable entries must be lock-free");
 
 TTable* TTable::get_TT(void) {
-    static TTable s_ttable;
+    static TTable s_ttable(cfg_tt_size_mb, cfg_tt_rave, cfg_tt_shared_file);
     return &s_ttable;
 }
 
-TTable::TTable(int size) {
-    LOCK(m_mutex, lock);
-    m_buckets.resize(size);
+TTable::TTable(int megabytes, bool rave_payload,
+               const std::string & shared_file) {
+    // the header doesn't count
+    size_t budget = std::max((size_t)1, (size_t)megabytes << 20)
+                    + sizeof(TTHeader);
+    size_t num_clusters = 1;
+    while (layout_bytes(num_clusters * 2, rave_payload) <= budget) {
+        num_clusters *= 2;
+    }
+
+    if (!shared_file.empty()
+        && map_shared(shared_file, num_clusters, rave_payload)) {
+        return;
+    }
+    m_memory.reset(new char[layout_bytes(num_clusters, rave_payload)
+                            + alignof(TTHeader)]);
+    uintptr_t base = reinterpret_cast<uintptr_t>(m_memory.get());
+    base = (base + alignof(TTHeader) - 1)
+           & ~(uintptr_t)(alignof(TTHeader) - 1);
+    char * memory = reinterpret_cast<char*>(base);
+    new (memory) TTHeader{TTHeader::MAGIC, num_clusters, rave_payload, {0}};
+    attach(memory, num_clusters, rave_payload);
+    clear();
 }
 
-void TTable::update(uint64 hash, const float komi, const UCTNode * node) {
-    LOCK(m_mutex, lock);
+TTable::~TTable() {
+    unmap_shared();
+}
+
+size_t TTable::layout_bytes(size_t num_clusters, bool rave_payload) {
+    size_t bytes = sizeof(TTHeader) + num_clusters * sizeof(TTCluster);
+    if (rave_payload) {
+        bytes += num_clusters * TTCluster::ENTRIES * sizeof(TTPayload);
+    }
+    return bytes;
+}
+
+void TTable::attach(char * memory, size_t num_clusters, bool rave_payload) {
+    m_mask = num_clusters - 1;
+    m_header = reinterpret_cast<TTHeader*>(memory);
+    m_searches = m_header->m_generation.load();
+    memory += sizeof(TTHeader);
+    m_clusters = reinterpret_cast<TTCluster*>(memory);
+    memory += num_clusters * sizeof(TTCluster);
+    m_payload = nullptr;
+    if (rave_payload) {
+        m_payload = reinterpret_cast<TTPayload*>(memory);
+    }
+}
 
-    unsigned int index = (unsigned int)hash;
-    index %= m_buckets.size();
+/*
+    The file lock makes sure only one process sets up a new table,
+    the others wait for it and use what it made. A file that holds
+    something else, like a table from another version, is left
+    alone: other processes may still have it mapped, and cutting it
+    down under them would crash them.
+*/
+bool TTable::map_shared(const std::string & filename, size_t num_clusters,
+                        bool rave_payload) {
+    uint64 existing[3] = {0, 0, 0};
+    size_t bytes = 0;
+    bool created = false;
+    bool foreign = false;
+#ifdef WIN32
+    HANDLE file = CreateFileA(filename.c_str(),
+                              GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        myprintf("Can't open %s, using a private TTable.\n",
+                 filename.c_str());
+        return false;
+    }
+    OVERLAPPED whole_file = {};
+    LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD,
+               &whole_file);
+    LARGE_INTEGER size;
+    DWORD read = 0;
+    GetFileSizeEx(file, &size);
+    ReadFile(file, existing, sizeof(existing), &read, NULL);
+    bytes = layout_bytes(existing[1], existing[2] != 0);
+    if (size.QuadPart == 0) {
+        // new file: set up an empty table
+        bytes = layout_bytes(num_clusters, rave_payload);
+        LARGE_INTEGER end;
+        end.QuadPart = bytes;
+        SetFilePointerEx(file, end, NULL, FILE_BEGIN);
+        SetEndOfFile(file);
+        created = true;
+    } else if (read != sizeof(existing)
+               || existing[0] != TTHeader::MAGIC
+               || (size_t)size.QuadPart != bytes) {
+        foreign = true;
+        bytes = 0;
+    }
+    void * memory = nullptr;
+    if (bytes > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE,
+                                            0, 0, NULL);
+        if (mapping != NULL) {
+            memory = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS,
+                                   0, 0, bytes);
+            // the view keeps the mapping alive
+            CloseHandle(mapping);
+        }
+    }
+#else
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        myprintf("Can't open %s, using a private TTable.\n",
+                 filename.c_str());
+        return false;
+    }
+    flock(fd, LOCK_EX);
+    struct stat st;
+    fstat(fd, &st);
+    ssize_t read = pread(fd, existing, sizeof(existing), 0);
+    bytes = layout_bytes(existing[1], existing[2] != 0);
+    if (st.st_size == 0) {
+        // new file: set up an empty table
+        bytes = layout_bytes(num_clusters, rave_payload);
+        if (ftruncate(fd, bytes) != 0) {
+            bytes = 0;
+        }
+        created = true;
+    } else if (read != (ssize_t)sizeof(existing)
+               || existing[0] != TTHeader::MAGIC
+               || (size_t)st.st_size != bytes) {
+        foreign = true;
+        bytes = 0;
+    }
+    void * memory = nullptr;
+    if (bytes > 0) {
+        memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+        if (memory == MAP_FAILED) {
+            memory = nullptr;
+        }
+    }
+#endif
+    if (memory != nullptr) {
+        m_mapping = memory;
+        m_mapping_bytes = bytes;
+        if (created) {
+            // the file comes zeroed, which is an empty table
+            TTHeader * header = static_cast<TTHeader*>(memory);
+            header->m_num_clusters = num_clusters;
+            header->m_rave_payload = rave_payload;
+            header->m_magic = TTHeader::MAGIC;
+        }
+        TTHeader * header = static_cast<TTHeader*>(memory);
+        attach(static_cast<char*>(memory), header->m_num_clusters,
+               header->m_rave_payload != 0);
+    } else if (foreign) {
+        myprintf("%s holds no TTable of this version, using a private "
+                 "TTable. Remove it once no process uses it.\n",
+                 filename.c_str());
+    } else {
+        myprintf("Can't map %s, using a private TTable.\n",
+                 filename.c_str());
+    }
+#ifdef WIN32
+    UnlockFileEx(file, 0, MAXDWORD, MAXDWORD, &whole_file);
+    CloseHandle(file);
+#else
+    flock(fd, LOCK_UN);
+    close(fd);
+#endif
+    return memory != nullptr;
+}
+
+void TTable::unmap_shared() {
+    if (m_mapping == nullptr) {
+        return;
+    }
+#ifdef WIN32
+    UnmapViewOfFile(m_mapping);
+#else
+    munmap(m_mapping, m_mapping_bytes);
+#endif
+    m_mapping = nullptr;
+}
+
+void TTable::clear() {
+    for (size_t i = 0; i <= m_mask; i++) {
+        for (auto & entry : m_clusters[i].m_entries) {
+            entry.m_key_visits.store(0, std::memory_order_relaxed);
+            entry.m_data.store(0, std::memory_order_relaxed);
+        }
+    }
+    if (m_payload) {
+        for (size_t i = 0; i < get_num_entries(); i++) {
+            m_payload[i].m_rave.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+size_t TTable::get_num_entries() const {
+    return (m_mask + 1) * TTCluster::ENTRIES;
+}
+
+size_t TTable::get_bytes() const {
+    return layout_bytes(m_mask + 1, m_payload != nullptr);
+}
+
+bool TTable::has_rave_payload() const {
+    return m_payload != nullptr;
+}
+
+bool TTable::is_shared() const {
+    return m_mapping != nullptr;
+}
+
+size_t TTable::get_index(uint64 hash) const {
+    // the upper half is the key
+    return (size_t)(uint32)hash & m_mask;
+}
+
+void TTable::new_search() {
+    const uint32 searches = ++m_searches;
+    uint32 generation = m_header->m_generation.load();
+    while (generation < searches) {
+        if (m_header->m_generation.compare_exchange_weak(generation,
+                                                         searches)) {
+            // one sweep per generation, whoever moves it on
+            sweep(searches);
+            break;
+        }
+    }
+    for (auto & shard : m_stats) {
+        shard.m_hits = 0;
+        shard.m_misses = 0;
+        shard.m_stores = 0;
+        shard.m_overwrites = 0;
+    }
+}
+
+TTable::StatShard & TTable::get_shard() {
+    static std::atomic<int> s_next_shard{0};
+    static thread_local int t_shard = s_next_shard++ % NUM_SHARDS;
+    return m_stats[t_shard];
+}
+
+void TTable::count(std::atomic<int64> & counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+}
+
+TTable::Stats TTable::get_stats() const {
+    Stats stats{0, 0, 0, 0};
+    for (const auto & shard : m_stats) {
+        stats.m_hits += shard.m_hits;
+        stats.m_misses += shard.m_misses;
+        stats.m_stores += shard.m_stores;
+        stats.m_overwrites += shard.m_overwrites;
+    }
+    return stats;
+}
+
+namespace {
+    constexpr float FRACTION_ONE = 65535.0f;
+    constexpr uint32 MAX_EVALCOUNT = 0xFFFF;
+    constexpr uint32 GENERATION_MASK = 0xFFFF;
+    constexpr uint32 MAX_RAVEVISITS = (1 << 24) - 1;
+    constexpr uint64 RAVE_CHECK_MASK = 0xFFF;
 
     /*
-        update TT
+        Statistics only hold for the komi they were searched with.
+        Mixing it into the hash keeps entries for different komi
+        apart, so changing it needs no clearing. The old ones age
+        out, or come back into use when the komi does.
     */
-    m_buckets[index].m_hash       = hash;
-    m_buckets[index].m_visits     = node->get_visits();
-    m_buckets[index].m_blackwins  = node->get_blackwins();
-    m_buckets[index].m_eval_sum   = node->get_blackevals();
-    m_buckets[index].m_eval_count = node->get_evalcount();
+    uint64 with_komi(uint64 hash, float komi) {
+        uint32 bits;
+        std::memcpy(&bits, &komi, sizeof(bits));
+        uint64 mix = (bits + 1) * 0x9E3779B97F4A7C15ULL;
+        return hash ^ mix ^ (mix >> 29);
+    }
 
-    if (m_komi != komi) {
-        std::fill(begin(m_buckets), end(m_buckets), TTEntry());
-        m_komi = komi;
+    uint32 key_of(uint64 hash) {
+        return (uint32)(hash >> 32);
     }
-}
 
-void TTable::sync(uint64 hash, const float komi, UCTNode * node) {
-    LOCK(m_mutex, lock);
+    // 32 bits that change with any bit of the data word
+    uint32 check_of(uint64 data) {
+        return (uint32)((data * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
 
-    unsigned int index = (unsigned int)hash;
-    index %= m_buckets.size();
+    // the key of an entry, if its two words belong together
+    uint32 entry_key(uint64 key_visits, uint64 data) {
+        return (uint32)(key_visits >> 32) ^ check_of(data);
+    }
 
     /*
-        check for hash fail
+        Winrates include the bonus for winning by more, which
+        takes them a little past 0 and 1. Fractions cover
+        RATE_LOW to RATE_LOW + RATE_SPAN.
     */
-    if (m_buckets[index].m_hash != hash || m_komi != komi) {
-        return;
+    constexpr float RATE_LOW = -0.125f;
+    constexpr float RATE_SPAN = 1.25f;
+
+    uint16 to_fraction(double num, int denom) {
+        if (denom <= 0) {
+            return 0;
+        }
+        float frac = ((float)(num / denom) - RATE_LOW) / RATE_SPAN;
+        frac = std::min(1.0f, std::max(0.0f, frac));
+        return (uint16)(frac * FRACTION_ONE + 0.5f);
+    }
+
+    float from_fraction(uint64 bits) {
+        return (bits & 0xFFFF) / FRACTION_ONE * RATE_SPAN + RATE_LOW;
+    }
+
+    uint32 generation_of(uint64 data) {
+        return (uint32)(data >> 48);
     }
 
+    int age_of(uint32 generation, uint64 data) {
+        return (int)((generation - generation_of(data)) & GENERATION_MASK);
+    }
+
+    /*
+        What an entry is worth keeping: its visits, halved for
+        every two searches it has been sitting around unused.
+        A big subtree from the previous move outlives a handful
+        of fresh leaves, one from ten moves ago doesn't.
+    */
+    uint32 keep_priority(uint32 visits, int age) {
+        return visits >> std::min(31, age / 2);
+    }
+}
+
+void TTable::update(uint64 hash, const float komi, const UCTNode * node,
+                    const UCTChildren * parent) {
+    hash = with_komi(hash, komi);
+    const uint32 key = key_of(hash);
+    const int visits = node->get_visits();
+    const int evalcount = node->get_evalcount();
+    const uint32 generation =
+        m_header->m_generation.load(std::memory_order_relaxed);
+
+    uint64 data = (uint64)(generation & GENERATION_MASK) << 48;
+    data |= (uint64)std::min((uint32)evalcount, MAX_EVALCOUNT) << 32;
+    data |= (uint64)to_fraction(node->get_blackwins(), visits) << 16;
+    data |= (uint64)to_fraction(node->get_blackevals(), evalcount);
+    uint64 key_visits = ((uint64)(key ^ check_of(data)) << 32)
+                        | (uint32)visits;
+
     /*
-        valid entry in TT should have more info than tree
+        Our own entry if there is one, then an empty one, otherwise
+        the one that is least worth keeping
     */
-    if (m_buckets[index].m_visits > node->get_visits()) {
+    const size_t index = get_index(hash);
+    TTCluster & cluster = m_clusters[index];
+    int victim = 0;
+    // empty entries go first
+    int64 victim_priority = INT64_MAX;
+    bool match = false;
+    for (int i = 0; i < TTCluster::ENTRIES; i++) {
+        TTEntry & entry = cluster.m_entries[i];
+        uint64 data_word = entry.m_data.load(std::memory_order_relaxed);
+        uint64 kv = entry.m_key_visits.load(std::memory_order_relaxed);
+        if (entry_key(kv, data_word) == key) {
+            victim = i;
+            match = true;
+            break;
+        }
+        int64 priority = -1;
+        if ((uint32)kv != 0) {
+            priority = keep_priority((uint32)kv,
+                                     age_of(generation, data_word));
+        }
+        if (priority < victim_priority) {
+            victim = i;
+            victim_priority = priority;
+        }
+    }
+
+    StatShard & stats = get_shard();
+    count(stats.m_stores);
+    if (!match && victim_priority >= 0) {
+        count(stats.m_overwrites);
+    }
+
+    TTEntry & entry = cluster.m_entries[victim];
+    entry.m_data.store(data, std::memory_order_relaxed);
+    entry.m_key_visits.store(key_visits, std::memory_order_relaxed);
+
+    if (m_payload && parent != nullptr) {
+        const int idx = parent->index_of(node);
+        const int ravevisits = parent->get_ravevisits(idx);
+        uint64 rave = (uint64)std::min((uint32)ravevisits,
+                                       MAX_RAVEVISITS) << 40;
+        rave |= (uint64)to_fraction(parent->get_raverate(idx), 1) << 24;
+        rave |= (uint64)(node->get_move() + 1) << 12;
+        rave |= key & RAVE_CHECK_MASK;
+        m_payload[index * TTCluster::ENTRIES + victim].m_rave.store(
+            rave, std::memory_order_relaxed);
+    }
+}
+
+void TTable::sync(uint64 hash, const float komi, UCTNode * node,
+                  UCTChildren * parent) {
+    hash = with_komi(hash, komi);
+    const uint32 key = key_of(hash);
+    const size_t index = get_index(hash);
+    const uint32 generation =
+        m_header->m_generation.load(std::memory_order_relaxed);
+    TTCluster & cluster = m_clusters[index];
+    for (int i = 0; i < TTCluster::ENTRIES; i++) {
+        TTEntry & entry = cluster.m_entries[i];
+        uint64 data = entry.m_data.load(std::memory_order_relaxed);
+        uint64 kv = entry.m_key_visits.load(std::memory_order_relaxed);
+        /*
+            check for hash fail, or words from two different stores
+        */
+        if (entry_key(kv, data) != key) {
+            continue;
+        }
+        /*
+            Other processes sharing the table may have left it
+            there long ago, for a game that went elsewhere
+        */
+        if (age_of(generation, data) > MAX_AGE) {
+            break;
+        }
+        count(get_shard().m_hits);
+
+        /*
+            valid entry in TT should have more info than tree
+        */
+        int visits = (int)(uint32)kv;
+        if (visits > node->get_visits()) {
+            /*
+                entry in TT has more info (new node)
+            */
+            int evalcount = (int)((data >> 32) & MAX_EVALCOUNT);
+            float winrate = from_fraction(data >> 16);
+            float evalrate = from_fraction(data);
+            node->set_visits(visits);
+            node->set_blackwins((double)winrate * visits);
+            node->set_blackevals((double)evalrate * evalcount);
+            node->set_evalcount(evalcount);
+        }
+
         /*
-            entry in TT has more info (new node)
+            Same for the RAVE statistics, if they were gathered
+            for the same move into this position
         */
-        node->set_visits(m_buckets[index].m_visits);
-        node->set_blackwins(m_buckets[index].m_blackwins);
-        node->set_blackevals(m_buckets[index].m_eval_sum);
-        node->set_evalcount(m_buckets[index].m_eval_count);
+        if (m_payload && parent != nullptr) {
+            uint64 rave = m_payload[index * TTCluster::ENTRIES + i]
+                              .m_rave.load(std::memory_order_relaxed);
+            if ((rave & RAVE_CHECK_MASK) == (key & RAVE_CHECK_MASK)
+                && (int)((rave >> 12) & 0xFFF) == node->get_move() + 1) {
+                const int idx = parent->index_of(node);
+                int ravevisits = (int)(rave >> 40);
+                if (ravevisits > parent->get_ravevisits(idx)) {
+                    float raverate = from_fraction(rave >> 24);
+                    parent->set_rave(idx, ravevisits, raverate * ravevisits);
+                }
+            }
+        }
+        return;
+    }
+    count(get_shard().m_misses);
+}
+
+void TTable::sweep(uint32 generation) {
+    const size_t num_clusters = m_mask + 1;
+    const size_t per_search = (num_clusters + SWEEP_PERIOD - 1)
+                              / SWEEP_PERIOD;
+    const size_t first = (generation % SWEEP_PERIOD) * per_search;
+    const size_t last = std::min(num_clusters, first + per_search);
+    for (size_t i = first; i < last; i++) {
+        for (int j = 0; j < TTCluster::ENTRIES; j++) {
+            TTEntry & entry = m_clusters[i].m_entries[j];
+            uint64 data = entry.m_data.load(std::memory_order_relaxed);
+            uint64 kv = entry.m_key_visits.load(std::memory_order_relaxed);
+            if ((uint32)kv == 0 || age_of(generation, data) <= MAX_AGE) {
+                continue;
+            }
+            // a store racing with us just loses its entry
+            entry.m_key_visits.store(0, std::memory_order_relaxed);
+            entry.m_data.store(0, std::memory_order_relaxed);
+            if (m_payload) {
+                m_payload[i * TTCluster::ENTRIES + j].m_rave.store(
+                    0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+void TTable::benchmark(int centiseconds) {
+    // Few enough positions for the threads to keep hitting
+    // the same entries, like the top of a search tree.
+    constexpr int NUM_POSITIONS = 4096;
+    std::vector<uint64> hashes(NUM_POSITIONS);
+    for (auto & hash : hashes) {
+        hash = ((uint64)Random::get_Rng()->randuint32() << 32)
+               | Random::get_Rng()->randuint32();
+    }
+
+    // a table of our own, the global one may be shared
+    TTable table(cfg_tt_size_mb, cfg_tt_rave, std::string());
+    TTable * tt = &table;
+    myprintf("threads     sync+update/s   per thread\n");
+    for (int threads = 1; threads <= 32; threads *= 2) {
+        thread_pool.initialize(threads);
+        tt->clear();
+
+        std::atomic<bool> running{true};
+        std::atomic<int64> total{0};
+        ThreadGroup tg(thread_pool);
+        for (int i = 0; i < threads; i++) {
+            tg.add_task([tt, &hashes, &running, &total]() {
+                UCTNode node(FastBoard::PASS, 0.0f, 0, 0, 0);
+                int64 ops = 0;
+                Random & rng = *Random::get_Rng();
+                while (running.load(std::memory_order_relaxed)) {
+                    uint64 hash = hashes[rng.randfix<NUM_POSITIONS>()];
+                    tt->sync(hash, 7.5f, &node);
+                    node.set_visits(node.get_visits() + 1);
+                    tt->update(hash, 7.5f, &node);
+                    ops++;
+                }
+                total += ops;
+            });
+        }
+        Time start;
+        std::this_thread::sleep_for(std::chrono::milliseconds(centiseconds * 10));
+        running = false;
+        tg.wait_all();
+        Time end;
+
+        float seconds = std::max(1, Time::timediff(start, end)) / 100.0f;
+        float rate = total / seconds;
+        myprintf("%7d %17.0f %12.0f\n", threads, rate, rate / threads);
     }
 }
@@ -1,24 +1,60 @@
 #ifndef TTABLE_H_INCLUDED
 #define TTABLE_H_INCLUDED
 
-#include <vector>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
 
 #include "UCTNode.h"
-#include "SMP.h"
 
+/*
+    One entry is two words. The second holds the statistics, the
+    first the visits and the upper half of the hash, the hash XORed
+    with a check of all of the second word. A reader that catches
+    two writers halfway gets words from different stores, sees a key
+    that doesn't match and treats it as a miss, so nothing has to be
+    locked.
+*/
 class TTEntry {
 public:
-    TTEntry()
-        : m_hash(0) {
-    };
+    // key ^ check of m_data, and visits
+    std::atomic<uint64> m_key_visits;
+    // generation, evalcount, winrate and eval as 16 bit fractions
+    std::atomic<uint64> m_data;
+};
 
-    uint64 m_hash;
+/*
+    Optional extra word per entry with the RAVE statistics of the
+    move that led to the position, as kept in the slot of the parent.
+    It carries some key bits of its own because it is written apart
+    from the entry.
+*/
+class TTPayload {
+public:
+    // rave visits, rave winrate, move and key check
+    std::atomic<uint64> m_rave;
+};
 
-    // XXX: need RAVE data here?
-    double m_blackwins;
-    int m_visits;
-    double m_eval_sum;
-    int m_eval_count;
+/*
+    Entries sharing an index, filling a cache line together
+*/
+struct alignas(64) TTCluster {
+    static constexpr int ENTRIES = 4;
+    TTEntry m_entries[ENTRIES];
+};
+
+/*
+    Start of the table memory. A table shared between processes
+    gets its layout from here, and they all age their entries by
+    the same generation.
+*/
+struct alignas(64) TTHeader {
+    static constexpr uint64 MAGIC = 0x4C65656C61545433ULL;
+    uint64 m_magic;
+    uint64 m_num_clusters;
+    uint64 m_rave_payload;
+    std::atomic<uint32> m_generation;
 };
 
 class TTable {
@@ -29,21 +65,120 @@ public:
     static TTable* get_TT(void);
 
     /*
-        update corresponding entry
+        update corresponding entry, parent are the children node
+        belongs to, for the RAVE payload
     */
-    void update(uint64 hash, const float komi, const UCTNode * node);
+    void update(uint64 hash, const float komi, const UCTNode * node,
+                const UCTChildren * parent = nullptr);
 
     /*
         sync given node with TT
     */
-    void sync(uint64 hash, const float komi, UCTNode * node);
+    void sync(uint64 hash, const float komi, UCTNode * node,
+              UCTChildren * parent = nullptr);
+
+    /*
+        forget all entries, for every process sharing the table
+    */
+    void clear();
+
+    /*
+        Entries from earlier searches are the first to go when a
+        new one needs their place, and after MAX_AGE searches they
+        aren't used at all. Also resets the statistics.
+    */
+    static constexpr int MAX_AGE = 64;
+    void new_search();
+
+    struct Stats {
+        int64 m_hits;
+        int64 m_misses;
+        int64 m_stores;
+        // stores that threw out another position
+        int64 m_overwrites;
+    };
+    // since the last new_search()
+    Stats get_stats() const;
+
+    size_t get_num_entries() const;
+    size_t get_bytes() const;
+    bool has_rave_payload() const;
+    bool is_shared() const;
+
+    /*
+        sync/update throughput on a shared set of positions
+        for 1, 2, 4... threads, in a private table of the
+        configured size
+    */
+    static void benchmark(int centiseconds);
 
 private:
-    TTable(int size = 500000);
+    /*
+        Room for as many clusters as fit in megabytes, rounded
+        down to a power of two so the index is a mask. With a
+        shared_file the table lives in that file, mapped into
+        every process that names it.
+    */
+    TTable(int megabytes, bool rave_payload,
+           const std::string & shared_file);
+    ~TTable();
+
+    static size_t layout_bytes(size_t num_clusters, bool rave_payload);
+    void attach(char * memory, size_t num_clusters, bool rave_payload);
+    /*
+        Map the table in the file, taking over the size of the
+        table already in it if there is one. False if the file
+        can't be used, we get a table of our own then.
+    */
+    bool map_shared(const std::string & filename, size_t num_clusters,
+                    bool rave_payload);
+    void unmap_shared();
+
+    size_t get_index(uint64 hash) const;
+
+    /*
+        Entries only keep 16 bits of their generation. Every new
+        generation empties the stale entries in one of SWEEP_PERIOD
+        slices of the table, so none lives long enough for its age
+        to wrap.
+    */
+    static constexpr int SWEEP_PERIOD = 1024;
+    void sweep(uint32 generation);
+
+    /*
+        Counters per thread (well, per shard) so the hot path
+        never shares a cache line with other threads. Increments
+        aren't atomic, a shard with two threads can lose a few.
+    */
+    struct alignas(64) StatShard {
+        std::atomic<int64> m_hits{0};
+        std::atomic<int64> m_misses{0};
+        std::atomic<int64> m_stores{0};
+        std::atomic<int64> m_overwrites{0};
+    };
+    static constexpr int NUM_SHARDS = 64;
+    StatShard & get_shard();
+    static void count(std::atomic<int64> & counter);
 
-    SMP::Mutex m_mutex;
-    std::vector<TTEntry> m_buckets;
-    float m_komi;
+    size_t m_mask;
+    // memory of a private table
+    std::unique_ptr<char[]> m_memory;
+    // mapping of a shared one, nullptr if private
+    void * m_mapping{nullptr};
+    size_t m_mapping_bytes{0};
+    // aligned to a cache line
+    TTHeader * m_header;
+    TTCluster * m_clusters;
+    // one per entry if enabled, else nullptr
+    TTPayload * m_payload;
+    /*
+        Searches of this process, counted on from the generation
+        found at attach. The shared generation follows the process
+        with the most, so N processes searching side by side age
+        the entries by one generation per search, not N.
+    */
+    uint32 m_searches;
+    std::array<StatShard, NUM_SHARDS> m_stats;
 };
 
 #endif
@@ -25,70 +25,247 @@
 */
 
 #include <cstddef>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <vector>
+#include <deque>
 #include <thread>
-#include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <memory>
-#include <future>
+#include <exception>
 #include <functional>
+#include <type_traits>
+
+#include "config.h"
+#include "SMP.h"
 
 namespace Utils {
 
+/*
+    Every worker has a deque of its own. It runs its newest task
+    first and steals the oldest one of another worker when it runs
+    out. A task is a function pointer and an argument, kept alive
+    by whoever queued it, so queueing one allocates nothing. While
+    waiting for its tasks, a thread runs the ones nobody started.
+*/
 class ThreadPool {
 public:
-    ThreadPool() = default;
+    struct Task {
+        void (*m_run)(void * arg);
+        void * m_arg;
+        // who waits for it, see run_pending()
+        const void * m_owner;
+    };
+
+    ThreadPool();
     ~ThreadPool();
-    void initialize(std::size_t);
-    template<class F, class... Args>
-    auto add_task(F&& f, Args&&... args)
-        -> std::future<typename std::result_of<F(Args...)>::type>;
+    void initialize(std::size_t threads, bool numa_bind = false);
+    std::size_t size() const;
+    /*
+        Queue on the deque of the calling worker, other threads
+        deal their tasks out over the workers. If all deques are
+        full the task runs right here.
+    */
+    void submit(const Task & task);
+    /*
+        Take a queued task of owner that nobody started and run it
+        on the calling thread. False if there is none left.
+    */
+    bool run_pending(const void * owner);
+
 private:
+    static constexpr std::size_t QUEUE_SIZE = 64;
+    static constexpr std::size_t MAX_THREADS = MAX_CPUS;
+
+    // the rarely used slots at the end keep the busy fields of
+    // neighbouring queues apart
+    struct WorkQueue {
+        SMP::Mutex m_mutex;
+        // oldest task
+        std::size_t m_head{0};
+        std::size_t m_size{0};
+        std::array<Task, QUEUE_SIZE> m_tasks;
+
+        bool push(const Task & task);
+        bool pop_newest(Task & task);
+        bool pop_oldest(Task & task);
+        bool take(const void * owner, Task & task);
+    };
+
+    struct WorkerId {
+        const ThreadPool * m_pool;
+        std::size_t m_index;
+    };
+    // worker the calling thread is, m_pool is nullptr if none
+    static WorkerId & current_worker();
+
+    void worker(std::size_t index);
+    bool find_task(std::size_t index, Task & task);
+
+    std::unique_ptr<WorkQueue[]> m_queues;
     std::vector<std::thread> m_threads;
-    std::queue<std::function<void()>> m_tasks;
+    std::atomic<std::size_t> m_num_threads{0};
+    // where other threads put their next task
+    std::atomic<std::size_t> m_next_queue{0};
+    // tasks in the deques, and workers waiting for one
+    std::atomic<int> m_queued{0};
+    std::atomic<int> m_sleeping{0};
 
     std::mutex m_mutex;
     std::condition_variable m_condvar;
     bool m_exit{false};
 };
 
-inline void ThreadPool::initialize(size_t threads) {
-    for (size_t i = 0; i < threads; i++) {
-        m_threads.emplace_back([this] {
-            for (;;) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(m_mutex);
-                    m_condvar.wait(lock, [this]{ return m_exit || !m_tasks.empty(); });
-                    if (m_exit && m_tasks.empty()) {
-                        return;
-                    }
-                    task = std::move(m_tasks.front());
-                    m_tasks.pop();
-                }
-                task();
+inline bool ThreadPool::WorkQueue::push(const Task & task) {
+    LOCK(m_mutex, lock);
+    if (m_size == QUEUE_SIZE) {
+        return false;
+    }
+    m_tasks[(m_head + m_size) % QUEUE_SIZE] = task;
+    m_size++;
+    return true;
+}
+
+inline bool ThreadPool::WorkQueue::pop_newest(Task & task) {
+    LOCK(m_mutex, lock);
+    if (m_size == 0) {
+        return false;
+    }
+    m_size--;
+    task = m_tasks[(m_head + m_size) % QUEUE_SIZE];
+    return true;
+}
+
+inline bool ThreadPool::WorkQueue::pop_oldest(Task & task) {
+    LOCK(m_mutex, lock);
+    if (m_size == 0) {
+        return false;
+    }
+    task = m_tasks[m_head];
+    m_head = (m_head + 1) % QUEUE_SIZE;
+    m_size--;
+    return true;
+}
+
+inline bool ThreadPool::WorkQueue::take(const void * owner, Task & task) {
+    LOCK(m_mutex, lock);
+    for (std::size_t i = 0; i < m_size; i++) {
+        if (m_tasks[(m_head + i) % QUEUE_SIZE].m_owner != owner) {
+            continue;
+        }
+        task = m_tasks[(m_head + i) % QUEUE_SIZE];
+        for (std::size_t j = i + 1; j < m_size; j++) {
+            m_tasks[(m_head + j - 1) % QUEUE_SIZE] =
+                m_tasks[(m_head + j) % QUEUE_SIZE];
+        }
+        m_size--;
+        return true;
+    }
+    return false;
+}
+
+inline ThreadPool::ThreadPool()
+    : m_queues(new WorkQueue[MAX_THREADS]) {
+}
+
+inline ThreadPool::WorkerId & ThreadPool::current_worker() {
+    static thread_local WorkerId t_worker{nullptr, 0};
+    return t_worker;
+}
+
+inline std::size_t ThreadPool::size() const {
+    return m_num_threads;
+}
+
+// Grows the pool to at least the given number of threads. With
+// numa_bind, new threads are spread round robin over the NUMA nodes
+// and stay on the one they got.
+inline void ThreadPool::initialize(size_t threads, bool numa_bind) {
+    const int nodes = SMP::get_num_numa_nodes();
+    threads = std::min(threads, MAX_THREADS);
+    for (size_t i = m_threads.size(); i < threads; i++) {
+        const int node = (numa_bind && nodes > 1) ? (int)(i % nodes) : -1;
+        m_threads.emplace_back([this, node, i] {
+            if (node >= 0) {
+                SMP::bind_thread(node);
             }
+            worker(i);
         });
+        m_num_threads = i + 1;
     }
 }
 
-template<class F, class... Args>
-auto ThreadPool::add_task(F&& f, Args&&... args)
-    -> std::future<typename std::result_of<F(Args...)>::type> {
-    using return_type = typename std::result_of<F(Args...)>::type;
-
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
-        std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-    );
+inline bool ThreadPool::find_task(std::size_t index, Task & task) {
+    bool found = m_queues[index].pop_newest(task);
+    const std::size_t threads = m_num_threads;
+    for (std::size_t i = 1; !found && i < threads; i++) {
+        found = m_queues[(index + i) % threads].pop_oldest(task);
+    }
+    if (found) {
+        m_queued--;
+    }
+    return found;
+}
 
-    std::future<return_type> res = task->get_future();
-    {
+inline void ThreadPool::worker(std::size_t index) {
+    current_worker() = WorkerId{this, index};
+    for (;;) {
+        Task task;
+        if (find_task(index, task)) {
+            task.m_run(task.m_arg);
+            continue;
+        }
         std::unique_lock<std::mutex> lock(m_mutex);
-        m_tasks.emplace([task](){(*task)();});
+        // submit() checks m_sleeping after counting its task
+        m_sleeping++;
+        m_condvar.wait(lock, [this] { return m_exit || m_queued > 0; });
+        m_sleeping--;
+        if (m_exit && m_queued == 0) {
+            return;
+        }
     }
-    m_condvar.notify_one();
-    return res;
+}
+
+inline void ThreadPool::submit(const Task & task) {
+    const std::size_t threads = m_num_threads;
+    const WorkerId & self = current_worker();
+    std::size_t first;
+    if (self.m_pool == this) {
+        first = self.m_index;
+    } else {
+        first = m_next_queue++;
+    }
+
+    // Count it first, so nobody sleeps through it
+    m_queued++;
+    bool queued = false;
+    for (std::size_t i = 0; !queued && i < threads; i++) {
+        queued = m_queues[(first + i) % threads].push(task);
+    }
+    if (!queued) {
+        m_queued--;
+        task.m_run(task.m_arg);
+        return;
+    }
+    if (m_sleeping > 0) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_condvar.notify_one();
+    }
+}
+
+inline bool ThreadPool::run_pending(const void * owner) {
+    const std::size_t threads = m_num_threads;
+    Task task;
+    for (std::size_t i = 0; i < threads; i++) {
+        if (m_queues[i].take(owner, task)) {
+            m_queued--;
+            task.m_run(task.m_arg);
+            return true;
+        }
+    }
+    return false;
 }
 
 inline ThreadPool::~ThreadPool() {
@@ -105,22 +282,137 @@ inline ThreadPool::~ThreadPool() {
 class ThreadGroup {
 public:
     ThreadGroup(ThreadPool & pool) : m_pool(pool) {};
+    ~ThreadGroup();
     template<class F, class... Args>
     void add_task(F&& f, Args&&... args) {
-        m_taskresults.emplace_back(
-            m_pool.add_task(std::forward<F>(f), std::forward<Args>(args)...)
-        );
-    };
-    void wait_all() {
-        for (auto && result: m_taskresults) {
-            result.get();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending++;
         }
+        // a deque doesn't move what it holds when it grows
+        m_tasks.emplace_back(Entry{this,
+            std::bind(std::forward<F>(f), std::forward<Args>(args)...)});
+        m_pool.submit(ThreadPool::Task{&Entry::run, &m_tasks.back(), this});
     };
+    /*
+        Wait for all tasks, rethrowing the first exception one of
+        them threw.
+    */
+    void wait_all();
 private:
+    struct Entry {
+        ThreadGroup * m_group;
+        std::function<void()> m_function;
+        static void run(void * arg);
+    };
+    void wait_pending();
+
     ThreadPool & m_pool;
-    std::vector<std::future<void>> m_taskresults;
+    std::deque<Entry> m_tasks;
+    // m_pending and m_exception are guarded by m_mutex
+    std::mutex m_mutex;
+    std::condition_variable m_done;
+    int m_pending{0};
+    std::exception_ptr m_exception;
 };
 
+inline void ThreadGroup::Entry::run(void * arg) {
+    Entry * entry = static_cast<Entry*>(arg);
+    ThreadGroup * group = entry->m_group;
+    std::exception_ptr exception;
+    try {
+        entry->m_function();
+    } catch (...) {
+        exception = std::current_exception();
+    }
+    // The group can be gone as soon as we let go of the lock
+    std::lock_guard<std::mutex> lock(group->m_mutex);
+    if (exception && !group->m_exception) {
+        group->m_exception = exception;
+    }
+    if (--group->m_pending == 0) {
+        group->m_done.notify_all();
+    }
+}
+
+inline void ThreadGroup::wait_pending() {
+    while (m_pool.run_pending(this));
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_pending == 0; });
+}
+
+inline void ThreadGroup::wait_all() {
+    wait_pending();
+    m_tasks.clear();
+    if (m_exception) {
+        std::exception_ptr exception = m_exception;
+        m_exception = nullptr;
+        std::rethrow_exception(exception);
+    }
+}
+
+inline ThreadGroup::~ThreadGroup() {
+    // the tasks point into us
+    wait_pending();
+}
+
+/*
+    Run body(i) for every i in [begin, end), grain indices at a
+    time, spread over the pool. The calling thread works along and
+    takes back what no worker started, so it finishes even when
+    the pool is busy with something else, and can be used from
+    inside a task. body must not throw.
+*/
+template<class F>
+void parallel_for(ThreadPool & pool, int begin, int end, F && body,
+                  int grain = 1) {
+    struct State {
+        std::atomic<int> m_next;
+        int m_end;
+        int m_grain;
+        typename std::remove_reference<F>::type * m_body;
+        // helpers that haven't finished
+        std::atomic<int> m_active;
+
+        void work() {
+            for (;;) {
+                int first = m_next.fetch_add(m_grain);
+                if (first >= m_end) {
+                    return;
+                }
+                int last = std::min(m_end, first + m_grain);
+                for (int i = first; i < last; i++) {
+                    (*m_body)(i);
+                }
+            }
+        }
+        static void run(void * arg) {
+            State * state = static_cast<State*>(arg);
+            state->work();
+            state->m_active.fetch_sub(1, std::memory_order_release);
+        }
+    };
+
+    grain = std::max(1, grain);
+    const int chunks = (end - begin + grain - 1) / grain;
+    const int helpers = std::min((int)pool.size(), chunks - 1);
+    State state;
+    state.m_next = begin;
+    state.m_end = end;
+    state.m_grain = grain;
+    state.m_body = &body;
+    state.m_active = std::max(0, helpers);
+    for (int i = 0; i < helpers; i++) {
+        pool.submit(ThreadPool::Task{&State::run, &state, &state});
+    }
+
+    state.work();
+    while (pool.run_pending(&state));
+    while (state.m_active.load(std::memory_order_acquire) > 0) {
+        std::this_thread::yield();
+    }
+}
+
 }
 
-#endif
\ No newline at end of file
+#endif
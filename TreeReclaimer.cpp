@@ -0,0 +1,82 @@
+#include "config.h"
+
+#include <algorithm>
+#include <thread>
+#ifdef WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+#include "TreeReclaimer.h"
+#include "UCTNode.h"
+
+TreeReclaimer* TreeReclaimer::get_reclaimer(void) {
+    // Never destroyed: searches held in statics may still
+    // hand us work while the program exits.
+    static TreeReclaimer * s_reclaimer = new TreeReclaimer;
+    return s_reclaimer;
+}
+
+TreeReclaimer::TreeReclaimer() {
+    std::thread(&TreeReclaimer::worker, this).detach();
+}
+
+void TreeReclaimer::discard(NodeArena & arena, std::atomic<int> & nodecount,
+                            UCTChildren * children) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(Item{&arena, &nodecount, children});
+    }
+    m_condvar.notify_one();
+}
+
+void TreeReclaimer::forget(NodeArena & arena) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_queue.erase(std::remove_if(m_queue.begin(), m_queue.end(),
+                                 [&arena](const Item & item) {
+                                     return item.m_arena == &arena;
+                                 }),
+                  m_queue.end());
+    m_idle.wait(lock, [this, &arena] { return m_busy_arena != &arena; });
+}
+
+size_t TreeReclaimer::get_backlog() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.size() + (m_busy_arena != nullptr ? 1 : 0);
+}
+
+int TreeReclaimer::release_tree(NodeArena & arena, UCTChildren * children) {
+    const int count = children->size();
+    int freed = count;
+    for (int i = 0; i < count; i++) {
+        UCTChildren * grandchildren = children->slot(i)->get_children();
+        if (grandchildren != nullptr) {
+            freed += release_tree(arena, grandchildren);
+        }
+    }
+    UCTChildren::release(arena, children);
+    return freed;
+}
+
+void TreeReclaimer::worker() {
+#ifdef WIN32
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+    // On Linux this only affects the calling thread
+    setpriority(PRIO_PROCESS, 0, 19);
+#endif
+    for (;;) {
+        Item item;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_busy_arena = nullptr;
+            m_idle.notify_all();
+            m_condvar.wait(lock, [this] { return !m_queue.empty(); });
+            item = m_queue.front();
+            m_queue.pop_front();
+            m_busy_arena = item.m_arena;
+        }
+        *item.m_nodecount -= release_tree(*item.m_arena, item.m_children);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef TREERECLAIMER_H_INCLUDED
+#define TREERECLAIMER_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "NodeArena.h"
+
+class UCTChildren;
+
+/*
+    Returns discarded parts of search trees to their arena on a
+    low priority background thread, so the search that threw them
+    away doesn't have to walk them first.
+*/
+class TreeReclaimer {
+public:
+    /*
+        return the global reclaimer
+    */
+    static TreeReclaimer* get_reclaimer(void);
+
+    /*
+        Queue children, and everything below them, for release
+        into arena. nodecount is decreased by the number of nodes
+        freed. The subtree must no longer be reachable by searches.
+    */
+    void discard(NodeArena & arena, std::atomic<int> & nodecount,
+                 UCTChildren * children);
+
+    /*
+        Drop all pending work for arena and wait until the
+        reclaimer is done with it. Call before destroying it.
+    */
+    void forget(NodeArena & arena);
+
+    /*
+        subtrees waiting to be freed
+    */
+    size_t get_backlog();
+
+private:
+    TreeReclaimer();
+    void worker();
+    static int release_tree(NodeArena & arena, UCTChildren * children);
+
+    struct Item {
+        NodeArena * m_arena;
+        std::atomic<int> * m_nodecount;
+        UCTChildren * m_children;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_condvar;
+    std::condition_variable m_idle;
+    std::deque<Item> m_queue;
+    // arena the worker is releasing into right now
+    NodeArena * m_busy_arena{nullptr};
+};
+
+#endif
@@ -4,12 +4,16 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <cstdint>
 #include <cmath>
 
 #include <iostream>
 #include <vector>
 #include <functional>
 #include <algorithm>
+#include <array>
+#include <new>
+#include <thread>
 
 #include "FastState.h"
 #include "Playout.h"
@@ -23,31 +27,210 @@
 #ifdef USE_OPENCL
 #include "OpenCL.h"
 #endif
+#ifdef USE_NNQUEUE
+#include "NNQueue.h"
+#endif
 
 using namespace Utils;
 
+UCTChildren::UCTChildren(int capacity)
+    : m_count(0), m_capacity(capacity), m_order_seq(0) {
+    for (auto & word : m_movemask) {
+        word = 0;
+    }
+    std::atomic<uint8> * slots = slot_of();
+    for (int vertex = 0; vertex < FastBoard::MAXSQ; vertex++) {
+        new (&slots[vertex]) std::atomic<uint8>(NO_SLOT);
+    }
+}
+
+size_t UCTChildren::header_size(int capacity) {
+    size_t bytes = sizeof(UCTChildren)
+        + capacity * (sizeof(std::atomic<int>) + sizeof(std::atomic<float>)
+                      + sizeof(std::atomic<uint8>))
+        + FastBoard::MAXSQ * sizeof(std::atomic<uint8>);
+    return (bytes + NodeArena::ALIGNMENT - 1) & ~(NodeArena::ALIGNMENT - 1);
+}
+
+size_t UCTChildren::block_size(int capacity) {
+    return header_size(capacity) + capacity * SLOT_SIZE;
+}
+
+UCTChildren * UCTChildren::create(NodeArena & arena, int capacity) {
+    assert(capacity > 0 && capacity <= MAX_CHILDREN);
+    void * block = arena.allocate(block_size(capacity));
+    return new (block) UCTChildren(capacity);
+}
+
+void UCTChildren::release(NodeArena & arena, UCTChildren * children) {
+    arena.release(children, block_size(children->capacity()));
+}
+
+int UCTChildren::size() const {
+    return m_count.load(std::memory_order_acquire);
+}
+
+int UCTChildren::capacity() const {
+    return m_capacity;
+}
+
+std::atomic<int> * UCTChildren::ravevisits() const {
+    return reinterpret_cast<std::atomic<int>*>(const_cast<UCTChildren*>(this) + 1);
+}
+
+std::atomic<float> * UCTChildren::ravewins() const {
+    return reinterpret_cast<std::atomic<float>*>(ravevisits() + m_capacity);
+}
+
+std::atomic<uint8> * UCTChildren::order() const {
+    return reinterpret_cast<std::atomic<uint8>*>(ravewins() + m_capacity);
+}
+
+std::atomic<uint8> * UCTChildren::slot_of() const {
+    return order() + m_capacity;
+}
+
+UCTNode * UCTChildren::slot(int idx) const {
+    assert(idx >= 0 && idx < m_capacity);
+    char * base = reinterpret_cast<char*>(const_cast<UCTChildren*>(this));
+    base += header_size(m_capacity) + idx * SLOT_SIZE;
+    return reinterpret_cast<UCTNode*>(base);
+}
+
+int UCTChildren::index_of(const UCTNode * node) const {
+    const char * first = reinterpret_cast<const char*>(slot(0));
+    return (reinterpret_cast<const char*>(node) - first) / SLOT_SIZE;
+}
+
+UCTNode * UCTChildren::get(int pos) const {
+    return slot(order()[pos].load(std::memory_order_relaxed));
+}
+
+int UCTChildren::copy_order(uint8 * order) const {
+    const std::atomic<uint8> * current = this->order();
+    for (;;) {
+        const uint32 seq = m_order_seq.load(std::memory_order_acquire);
+        const int count = size();
+        if ((seq & 1) == 0) {
+            for (int pos = 0; pos < count; pos++) {
+                order[pos] = current[pos].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_order_seq.load(std::memory_order_relaxed) == seq) {
+                return count;
+            }
+        }
+        // A sort is under way, it is over in a moment
+        std::this_thread::yield();
+    }
+}
+
+void UCTChildren::set_order(const uint8 * order, int count) {
+    assert(count <= size());
+    std::atomic<uint8> * current = this->order();
+    const uint32 seq = m_order_seq.load(std::memory_order_relaxed);
+    m_order_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int pos = 0; pos < count; pos++) {
+        current[pos].store(order[pos], std::memory_order_relaxed);
+    }
+    m_order_seq.store(seq + 2, std::memory_order_release);
+}
+
+void UCTChildren::publish(int count) {
+    assert(count <= m_capacity);
+    m_count.store(count, std::memory_order_release);
+}
+
+void UCTChildren::link_move(int idx, int move) {
+    assert(idx >= 0 && idx < m_capacity);
+    new (&ravevisits()[idx]) std::atomic<int>(20);
+    new (&ravewins()[idx]) std::atomic<float>(10.0f);
+    new (&order()[idx]) std::atomic<uint8>(idx);
+    if (move != FastBoard::PASS) {
+        slot_of()[move].store(idx, std::memory_order_relaxed);
+        m_movemask[move / 64].fetch_or(1ULL << (move % 64),
+                                       std::memory_order_relaxed);
+    }
+}
+
+int UCTChildren::get_ravevisits(int idx) const {
+    return ravevisits()[idx];
+}
+
+float UCTChildren::get_raverate(int idx) const {
+    return ravewins()[idx] / ravevisits()[idx];
+}
+
+void UCTChildren::add_rave(int idx, float wins) {
+    ravevisits()[idx]++;
+    if (wins > 0.0f) {
+        atomic_add(ravewins()[idx], wins);
+    }
+}
+
+void UCTChildren::set_rave(int idx, int visits, float wins) {
+    ravevisits()[idx] = visits;
+    ravewins()[idx] = wins;
+}
+
+void UCTChildren::update_rave(const Playout::movemask_t & moves, float wins) {
+    // A move can be in the mask before its slot is published,
+    // only published slots get the update.
+    const int count = size();
+    const std::atomic<uint8> * slots = slot_of();
+    for (int word = 0; word < Playout::MASK_WORDS; word++) {
+        uint64 hits = moves[word]
+            & m_movemask[word].load(std::memory_order_relaxed);
+        while (hits) {
+            int move = word * 64 + lowest_bit(hits);
+            hits &= hits - 1;
+            int idx = slots[move].load(std::memory_order_relaxed);
+            if (idx < count) {
+                add_rave(idx, wins);
+            }
+        }
+    }
+}
+
 UCTNode::UCTNode(int vertex, float score, int expand_threshold,
                  int netscore_threshold, int movenum)
-    : m_has_children(false), m_firstchild(nullptr), m_nextsibling(nullptr),
-      m_move(vertex), m_blackwins(0.0), m_visits(0), m_score(score),
-      m_eval_propagated(false), m_blackevals(0.0f),
-      m_evalcount(0), m_movenum(movenum), m_is_evaluating(false),
-      m_valid(true), m_expand_cnt(expand_threshold), m_is_expanding(false),
-      m_has_netscore(false), m_netscore_thresh(netscore_threshold),
-      m_symmetries_done(0), m_is_netscoring(false) {
-    m_ravevisits = 20;
-    m_ravestmwins = 10.0;
-}
-
-UCTNode::~UCTNode() {
-    LOCK(get_mutex(), lock);
-    UCTNode * next = m_firstchild;
+    : m_children(nullptr), m_blackwins(0.0), m_blackevals(0.0),
+      m_visits(0), m_evalcount(0), m_score(score),
+      m_expand_cnt(expand_threshold), m_netscore_thresh(netscore_threshold),
+      m_flags(VALID), m_move(vertex), m_movenum(movenum),
+      m_virtual_loss(0), m_symmetries_done(0),
+      m_expand_state(ExpandState::UNEXPANDED), m_child_visits(0) {
+}
 
-    while (next != NULL) {
-        UCTNode * tmp = next->m_nextsibling;
-        delete next;
-        next = tmp;
-    }
+static_assert(sizeof(UCTNode) <= UCTChildren::SLOT_SIZE,
+              "UCTNode should fit in a cache line");
+
+bool UCTNode::test_flag(uint32 flag) const {
+    return (m_flags.load(std::memory_order_acquire) & flag) != 0;
+}
+
+void UCTNode::set_flag(uint32 flag) {
+    m_flags.fetch_or(flag, std::memory_order_acq_rel);
+}
+
+void UCTNode::clear_flag(uint32 flag) {
+    m_flags.fetch_and(~flag, std::memory_order_acq_rel);
+}
+
+std::array<std::atomic<int>, UCTNode::NUM_RACE_COUNTERS> UCTNode::s_race_counts;
+
+int UCTNode::get_race_count(RaceCounter counter) {
+    return s_race_counts[counter];
+}
+
+UCTNode::ExpandState UCTNode::get_expand_state() const {
+    return m_expand_state.load(std::memory_order_acquire);
+}
+
+bool UCTNode::transition(ExpandState from, ExpandState to) {
+    return m_expand_state.compare_exchange_strong(from, to,
+                                                  std::memory_order_acq_rel);
 }
 
 bool UCTNode::first_visit() const {
@@ -62,28 +245,36 @@ bool UCTNode::should_netscore() const {
     return m_visits > m_netscore_thresh;
 }
 
-void UCTNode::link_child(UCTNode * newchild) {
-    newchild->m_nextsibling = m_firstchild;
-    m_firstchild = newchild;
+/*
+    Nodes don't carry a mutex of their own. They share a pool of
+    cache line sized ones, picked by address. We never hold two node
+    locks at once, so sharing can't deadlock.
+*/
+namespace {
+    struct PaddedMutex {
+        SMP::Mutex m_mutex;
+        char m_padding[UCTChildren::SLOT_SIZE - sizeof(SMP::Mutex)];
+    };
+    constexpr size_t NUM_NODE_MUTEXES = 4096;
+    std::array<PaddedMutex, NUM_NODE_MUTEXES> s_node_mutexes;
 }
 
 SMP::Mutex & UCTNode::get_mutex() {
-    return m_nodemutex;
+    uintptr_t idx = reinterpret_cast<uintptr_t>(this) / UCTChildren::SLOT_SIZE;
+    return s_node_mutexes[idx % NUM_NODE_MUTEXES].m_mutex;
 }
 
 void UCTNode::netscore_children(std::atomic<int> & nodecount,
+                                NodeArena & arena,
                                 FastState & state, bool at_root) {
-    // acquire the lock
-    LOCK(get_mutex(), lock);
-    // check whether somebody beat us to it
-    if (at_root && m_has_netscore) {
-        return;
-    }
+    ExpandState current = get_expand_state();
+    // check whether somebody beat us to it. A root that was scored
+    // as a child in an earlier search has fewer symmetries than
+    // that, it gets them all now.
     if (m_symmetries_done >= 8) {
-        assert(!at_root);
         return;
     }
-    if (m_visits < m_symmetries_done * cfg_extra_symmetry) {
+    if (!at_root && m_visits < m_symmetries_done * cfg_extra_symmetry) {
         return;
     }
 #ifdef USE_OPENCL
@@ -93,52 +284,95 @@ void UCTNode::netscore_children(std::atomic<int> & nodecount,
         // assert(!at_root);
         return;
     }
+#elif defined(USE_NNQUEUE)
+    // Queue is full, try again on a later visit
+    if (!at_root && !NNQueue::get_queue()->can_queue()) {
+        return;
+    }
 #endif
-    // Someone else is running the expansion
-    if (m_is_netscoring) {
+    ExpandState next;
+    if (current == ExpandState::EXPANDED) {
+        next = ExpandState::NETSCORING;
+    } else if (current == ExpandState::NETSCORED) {
+        next = ExpandState::RESCORING;
+    } else {
+        // Not expanded yet, or someone else is running the net
+        if (current != ExpandState::UNEXPANDED
+            && current != ExpandState::EXPANDING) {
+            s_race_counts[NETSCORE_RACE]++;
+        }
+        return;
+    }
+    // We'll be the one queueing this node for the net, stop others
+    if (!transition(current, next)) {
+        s_race_counts[NETSCORE_RACE]++;
+        return;
+    }
+    // The checks above raced with the previous scorer finishing
+    if (m_symmetries_done >= 8) {
+        m_expand_state.store(current, std::memory_order_release);
         return;
     }
-    // We'll be the one queueing this node for expansion, stop others
-    m_is_netscoring = true;
-    // Let simulations proceed
-    lock.unlock();
 
 #ifdef USE_OPENCL
     if (at_root) {
         auto raw_netlist = Network::get_Network()->get_scored_moves(
             &state, Network::Ensemble::AVERAGE_ALL);
-        scoring_cb(&nodecount, state, raw_netlist, at_root);
+        scoring_cb(&nodecount, &arena, state, raw_netlist, at_root);
     } else {
         Network::get_Network()->async_scored_moves(
-            &nodecount, &state, this, Network::Ensemble::DIRECT, m_symmetries_done);
+            &nodecount, &arena, &state, this,
+            Network::Ensemble::DIRECT, m_symmetries_done);
+    }
+#elif defined(USE_NNQUEUE)
+    if (at_root) {
+        auto raw_netlist = Network::get_Network()->get_scored_moves(
+            &state, Network::Ensemble::AVERAGE_ALL);
+        scoring_cb(&nodecount, &arena, state, raw_netlist, at_root);
+    } else {
+        NNQueue::get_queue()->queue_policy(&state, m_symmetries_done,
+            [this, &nodecount, &arena](FastState & state,
+                                       Network::Netresult & raw_netlist) {
+                scoring_cb(&nodecount, &arena, state, raw_netlist, false);
+            },
+            [this, current]() {
+                // Dropped at the end of the search, let the
+                // next one try again
+                m_expand_state.store(current, std::memory_order_release);
+            });
     }
 #else
     auto raw_netlist = Network::get_Network()->get_scored_moves(
         &state, (at_root ? Network::Ensemble::AVERAGE_ALL :
                            Network::Ensemble::DIRECT), m_symmetries_done);
-    scoring_cb(&nodecount, state, raw_netlist, at_root);
+    scoring_cb(&nodecount, &arena, state, raw_netlist, at_root);
 #endif
 }
 
 void UCTNode::create_children(std::atomic<int> & nodecount,
+                              NodeArena & arena,
                               FastState & state, bool at_root, bool use_nets) {
     // check whether somebody beat us to it (atomic)
     if (has_children()) {
         return;
     }
-    // acquire the lock
-    LOCK(get_mutex(), lock);
     // no successors in final state
     if (state.get_passes() >= 2) {
         return;
     }
-    // Someone else is running the expansion
-    if (m_is_expanding) {
+    // We'll be the one expanding this node, stop others
+    if (!transition(ExpandState::UNEXPANDED, ExpandState::EXPANDING)) {
+        s_race_counts[EXPAND_RACE]++;
+        // Scoring the moves takes a fraction of a playout, so
+        // it's worth giving the winner a moment to finish.
+        for (int i = 0; i < EXPAND_WAIT_SPINS && !has_children(); i++) {
+            std::this_thread::yield();
+        }
+        if (has_children()) {
+            s_race_counts[EXPAND_WAIT]++;
+        }
         return;
     }
-    // We'll be the one queueing this node for expansion, stop others
-    m_is_expanding = true;
-    lock.unlock();
 
     FastBoard & board = state.board;
     std::vector<Network::scored_node> nodelist;
@@ -164,10 +398,12 @@ void UCTNode::create_children(std::atomic<int> & nodecount,
         passscore = 0;
     }
     nodelist.push_back(std::make_pair(passscore, +FastBoard::PASS));
-    link_nodelist(nodecount, board, nodelist, use_nets);
+    link_nodelist(nodecount, arena, board, nodelist, use_nets);
+    m_expand_state.store(ExpandState::EXPANDED, std::memory_order_release);
 }
 
 void UCTNode::scoring_cb(std::atomic<int> * nodecount,
+                         NodeArena * arena,
                          FastState & state,
                          Network::Netresult & raw_netlist,
                          bool all_symmetries) {
@@ -183,43 +419,50 @@ void UCTNode::scoring_cb(std::atomic<int> * nodecount,
         }
     }
     nodelist.push_back(std::make_pair(0.0f, +FastBoard::PASS));
-    rescore_nodelist(*nodecount, board, nodelist, all_symmetries);
+    rescore_nodelist(*nodecount, *arena, board, nodelist, all_symmetries);
 }
 
 void UCTNode::rescore_nodelist(std::atomic<int> & nodecount,
+                               NodeArena & arena,
                                FastBoard & board,
                                Network::Netresult & nodelist,
                                bool all_symmetries) {
 
     assert(!nodelist.empty());
-    // sort (this will reverse scores, but linking is backwards too)
+    // sort, best moves end up last
     std::sort(nodelist.begin(), nodelist.end());
 
     int childrenadded = 0;
-    const int max_net_childs = 35;
     int netscore_threshold = cfg_mature_threshold;
     int expand_threshold = cfg_expand_threshold;
     int movenum = board.get_stone_count();
 
     LOCK(get_mutex(), lock);
 
+    UCTChildren * children = m_children.load(std::memory_order_acquire);
+    if (children == nullptr) {
+        children = UCTChildren::create(arena, MAX_NET_CHILDS);
+    }
+    int count = children->size();
+
+    // Map vertices to existing children to find duplicate moves
+    std::array<short, FastBoard::MAXSQ + 1> child_idx;
+    child_idx.fill(-1);
+    for (int i = 0; i < count; i++) {
+        // offset by one because PASS is -1
+        child_idx[children->slot(i)->get_move() + 1] = i;
+    }
+
     for (auto it = nodelist.cbegin(); it != nodelist.cend(); ++it) {
-        // Check for duplicate moves, O(N^2)
-        bool found = false;
-        UCTNode * child = m_firstchild;
-        while (child != NULL) {
-            if (child->get_move() == it->second) {
-                found = true;
-                break;
-            }
-            child = child->m_nextsibling;
-        }
-        if (!found) {
+        int idx = child_idx[it->second + 1];
+        if (idx < 0) {
             // Not added yet, is it highly scored?
-            if (std::distance(it, nodelist.cend()) <= max_net_childs) {
-                UCTNode * vtx = new UCTNode(it->second, it->first,
-                                            expand_threshold, netscore_threshold,
-                                            movenum);
+            if (std::distance(it, nodelist.cend()) <= MAX_NET_CHILDS
+                && count < children->capacity()) {
+                UCTNode * vtx = new (children->slot(count))
+                    UCTNode(it->second, it->first,
+                            expand_threshold, netscore_threshold, movenum);
+                children->link_move(count, it->second);
                 if (it->second != FastBoard::PASS) {
                     // atari giving
                     // was == 2, == 1
@@ -230,13 +473,14 @@ void UCTNode::rescore_nodelist(std::atomic<int> & nodecount,
                         vtx->set_expand_cnt(expand_threshold / 3, netscore_threshold / 3);
                     }
                 }
-                link_child(vtx);
+                count++;
                 childrenadded++;
             }
         } else {
             // Found
             // First net run, or average_all run at the root
             // Overwrite MC score with netscore
+            UCTNode * child = children->slot(idx);
             if (m_symmetries_done == 0 || all_symmetries) {
                 child->set_score(it->first);
             } else {
@@ -249,68 +493,73 @@ void UCTNode::rescore_nodelist(std::atomic<int> & nodecount,
         }
     }
 
+    children->publish(count);
+    m_children.store(children, std::memory_order_release);
     nodecount += childrenadded;
     sort_children();
-    m_has_children = true;
-    m_has_netscore = true;
-    m_is_netscoring = false;
     if (all_symmetries) {
         m_symmetries_done = 8;
     } else {
         m_symmetries_done++;
     }
+    m_expand_state.store(ExpandState::NETSCORED, std::memory_order_release);
 }
 
 void UCTNode::link_nodelist(std::atomic<int> & nodecount,
+                            NodeArena & arena,
                             FastBoard & board,
                             Network::Netresult & nodelist,
                             bool use_nets) {
     size_t totalchildren = nodelist.size();
     if (!totalchildren) return;
 
-    // sort (this will reverse scores, but linking is backwards too)
+    // sort, best moves end up last
     std::sort(nodelist.begin(), nodelist.end());
 
-    // link the nodes together, we only really link the last few
+    // we only really link the best few
     size_t maxchilds = 35;     // about 35 -> 4M visits
     if (use_nets) {
         maxchilds = cfg_rave_moves;
     }
-    int childrenadded = 0;
-    size_t childrenseen = 0;
+    int childrenadded = (int)std::min(totalchildren, maxchilds);
+    childrenadded = std::min(childrenadded, UCTChildren::MAX_CHILDREN);
+    // leave room for the moves the network will add later
+    int capacity = childrenadded;
+    if (use_nets) {
+        capacity = std::min(capacity + MAX_NET_CHILDS,
+                            UCTChildren::MAX_CHILDREN);
+    }
+    UCTChildren * children = UCTChildren::create(arena, capacity);
 
     int netscore_threshold = cfg_mature_threshold;
     int expand_threshold = cfg_expand_threshold;
     int movenum = board.get_stone_count();
 
-    LOCK(get_mutex(), lock);
-
-    for (auto it = nodelist.cbegin(); it != nodelist.cend(); ++it) {
-        if (totalchildren - childrenseen <= maxchilds) {
-            UCTNode * vtx = new UCTNode(it->second, it->first,
-                                        expand_threshold, netscore_threshold,
-                                        movenum);
-            if (it->second != FastBoard::PASS) {
-                // atari giving
-                // was == 2, == 1
-                if (board.minimum_elib_count(board.get_to_move(), it->second) <= 2) {
-                    vtx->set_expand_cnt(expand_threshold / 3, netscore_threshold / 3);
-                }
-                if (board.minimum_elib_count(!board.get_to_move(), it->second) == 2) {
-                    vtx->set_expand_cnt(expand_threshold / 2, netscore_threshold / 2);
-                }
-                if (board.minimum_elib_count(!board.get_to_move(), it->second) == 1) {
-                    vtx->set_expand_cnt(expand_threshold / 3, netscore_threshold / 3);
-                }
+    auto it = nodelist.crbegin();
+    for (int idx = 0; idx < childrenadded; ++idx, ++it) {
+        UCTNode * vtx = new (children->slot(idx))
+            UCTNode(it->second, it->first,
+                    expand_threshold, netscore_threshold, movenum);
+        children->link_move(idx, it->second);
+        if (it->second != FastBoard::PASS) {
+            // atari giving
+            // was == 2, == 1
+            if (board.minimum_elib_count(board.get_to_move(), it->second) <= 2) {
+                vtx->set_expand_cnt(expand_threshold / 3, netscore_threshold / 3);
+            }
+            if (board.minimum_elib_count(!board.get_to_move(), it->second) == 2) {
+                vtx->set_expand_cnt(expand_threshold / 2, netscore_threshold / 2);
+            }
+            if (board.minimum_elib_count(!board.get_to_move(), it->second) == 1) {
+                vtx->set_expand_cnt(expand_threshold / 3, netscore_threshold / 3);
             }
-            link_child(vtx);
-            childrenadded++;
         }
-        childrenseen++;
     }
+    children->publish(childrenadded);
 
+    // Make the fully built block visible to other threads in one go
+    m_children.store(children, std::memory_order_release);
     nodecount += childrenadded;
-    m_has_children = true;
 }
 
 void UCTNode::run_value_net(FastState & state) {
@@ -318,50 +567,73 @@ void UCTNode::run_value_net(FastState & state) {
     if (get_evalcount()) {
         return;
     }
-    // acquire the lock
-    LOCK(get_mutex(), lock);
-    if (m_is_evaluating) {
+#ifdef USE_NNQUEUE
+    // Already queued, or the queue is full and we try again later
+    if (test_flag(IS_EVALUATING) || !NNQueue::get_queue()->can_queue()) {
         return;
     }
-    assert(!has_eval_propagated());
-
+#endif
     // We'll be the one evaluating this node, stop others
-    m_is_evaluating = true;
-    // Let simulations proceed
-    lock.unlock();
+    uint32 old_flags = m_flags.fetch_or(IS_EVALUATING, std::memory_order_acq_rel);
+    if (old_flags & IS_EVALUATING) {
+        s_race_counts[EVAL_RACE]++;
+        return;
+    }
+    assert(!has_eval_propagated());
 
+    int tomove = state.board.get_to_move();
+#ifdef USE_NNQUEUE
+    NNQueue::get_queue()->queue_value(&state,
+        [this, tomove](float eval) {
+            value_net_cb(tomove, eval);
+        },
+        [this]() {
+            // Dropped at the end of the search, let the
+            // next one try again
+            clear_flag(IS_EVALUATING);
+        });
+#else
     float eval =
         Network::get_Network()->get_value(&state,
                                           Network::Ensemble::RANDOM_ROTATION);
+    value_net_cb(tomove, eval);
+#endif
+}
 
+void UCTNode::value_net_cb(int tomove, float eval) {
     // DCNN returns winrate as side to move
-    int tomove = state.board.get_to_move();
     if (tomove == FastBoard::WHITE) {
         eval = 1.0f - eval;
     }
-    lock.lock();
+    LOCK(get_mutex(), lock);
     accumulate_eval(eval);
+    set_flag(HAS_NET_EVAL);
 }
 
-void UCTNode::kill_superkos(KoState & state) {        
-    UCTNode * child = m_firstchild;
-    
-    while (child != NULL) {
-        int move = child->get_move();                
-        
+void UCTNode::kill_superkos(KoState & state) {
+    bool killed = false;
+
+    for (int pos = 0; pos < get_num_children(); pos++) {
+        UCTNode * child = get_child(pos);
+        int move = child->get_move();
+
         if (move != FastBoard::PASS) {
             KoState mystate = state;
             mystate.play_move(move);
-            
-            if (mystate.superko()) {                                    
-                UCTNode * tmp = child->m_nextsibling;
-                delete_child(child);                
-                child = tmp;
-                continue;                               
-            }    
-        }                   
-        child = child->m_nextsibling;
-    }                 
+
+            if (mystate.superko() && child->valid()) {
+                m_child_visits -= child->get_visits();
+                child->invalidate();
+                killed = true;
+            }
+        }
+    }
+
+    if (killed) {
+        // move the dead ones out of the way
+        LOCK(get_mutex(), lock);
+        sort_children();
+    }
 }
 
 int UCTNode::get_move() const {
@@ -377,31 +649,23 @@ void UCTNode::set_expand_cnt(int runs, int netscore_cnt) {
     m_netscore_thresh = netscore_cnt;
 }
 
-void UCTNode::update(Playout & gameresult, int color, bool update_eval) {
+void UCTNode::update(Playout & gameresult, bool update_eval) {
     m_visits++;
-    m_ravevisits++;
+
+    // The root is never selected, so it never carries a virtual loss.
+    if (m_virtual_loss.load(std::memory_order_relaxed) > 0) {
+        virtual_loss_undo();
+    }
 
     // prefer winning with more territory
     float score = gameresult.get_score();
-    double blackwins_inc = 0.05 * score;
+    float blackwins_inc = 0.05f * score;
     if (score > 0.0f) {
-        blackwins_inc += 1.0;
+        blackwins_inc += 1.0f;
     } else if (score == 0.0f) {
-        blackwins_inc += 0.5;
-    }
-    atomic_add(m_blackwins, blackwins_inc);
-
-    // We're inspected from one level above and scores
-    // are side to move, so invert here
-    if (color == FastBoard::BLACK) {
-        if (score < 0.0f) {
-            atomic_add(m_ravestmwins, 1.0 + 0.05 * -score);
-        }
-    } else if (color == FastBoard::WHITE) {
-        if (score > 0.0f) {
-            atomic_add(m_ravestmwins, 1.0 + 0.05 * score);
-        }
+        blackwins_inc += 0.5f;
     }
+    atomic_add(m_blackwins, (double)blackwins_inc);
 
     // evals
     if (gameresult.has_eval() && update_eval) {
@@ -409,12 +673,28 @@ void UCTNode::update(Playout & gameresult, int color, bool update_eval) {
     }
 }
 
+void UCTNode::merge_child_stats(UCTNode * child, int visits,
+                                double blackwins, int evalcount,
+                                double blackevals) {
+    child->m_visits += visits;
+    atomic_add(child->m_blackwins, blackwins);
+    child->m_evalcount += evalcount;
+    atomic_add(child->m_blackevals, blackevals);
+
+    m_visits += visits;
+    atomic_add(m_blackwins, blackwins);
+    m_evalcount += evalcount;
+    atomic_add(m_blackevals, blackevals);
+    m_child_visits += visits;
+}
+
 bool UCTNode::has_children() const {
-    return m_has_children;
+    return m_children.load(std::memory_order_acquire) != nullptr;
 }
 
 bool UCTNode::has_netscore() const {
-    return m_has_netscore;
+    ExpandState state = get_expand_state();
+    return state == ExpandState::NETSCORED || state == ExpandState::RESCORING;
 }
 
 double UCTNode::get_blackwins() const {
@@ -440,7 +720,7 @@ void UCTNode::set_score(float score) {
 float UCTNode::get_winrate(int tomove) const {    
     assert(!first_visit());
 
-    float rate = get_blackwins() / get_visits();
+    float rate = (float)(get_blackwins() / get_visits());
 
     if (tomove == FastBoard::WHITE) {
         rate = 1.0f - rate;
@@ -449,22 +729,12 @@ float UCTNode::get_winrate(int tomove) const {
     return rate;
 }
 
-float UCTNode::get_raverate() const {
-    float rate = m_ravestmwins / m_ravevisits;
-
-    return rate;
-}
-
 int UCTNode::get_visits() const {
     return m_visits;
 }
 
-int UCTNode::get_ravevisits() const {
-    return m_ravevisits;
-}
-
 float UCTNode::get_eval(int tomove) const {
-    float score = m_blackevals / (double)m_evalcount;
+    float score = (float)(m_blackevals / m_evalcount);
     if (tomove == FastBoard::WHITE) {
         score = 1.0f - score;
     }
@@ -493,11 +763,16 @@ int UCTNode::get_evalcount() const {
 }
 
 bool UCTNode::has_eval_propagated() const {
-    return m_eval_propagated;
+    return test_flag(EVAL_PROPAGATED);
+}
+
+bool UCTNode::has_unpropagated_eval() const {
+    uint32 flags = m_flags.load(std::memory_order_acquire);
+    return (flags & (HAS_NET_EVAL | EVAL_PROPAGATED)) == HAS_NET_EVAL;
 }
 
 void UCTNode::set_eval_propagated() {
-    m_eval_propagated = true;
+    set_flag(EVAL_PROPAGATED);
 }
 
 void UCTNode::accumulate_eval(float eval) {
@@ -528,7 +803,23 @@ float UCTNode::get_mixed_score(int tomove) {
     return UCTNode::score_mix_function(m_movenum, eval, winrate);
 }
 
+void UCTNode::virtual_loss() {
+    m_virtual_loss += VIRTUAL_LOSS_COUNT;
+}
+
+void UCTNode::virtual_loss_undo() {
+    m_virtual_loss -= VIRTUAL_LOSS_COUNT;
+}
+
+int UCTNode::get_virtual_loss() const {
+    return m_virtual_loss.load(std::memory_order_relaxed);
+}
+
 float UCTNode::smp_noise(void) {
+    // Virtual losses already spread the threads out
+    if (cfg_virtual_loss) {
+        return 0.0f;
+    }
     if (cfg_num_threads >= 6) {
         float winnoise = 0.0025f;
         if (cfg_num_threads >= 12) {
@@ -541,15 +832,45 @@ float UCTNode::smp_noise(void) {
 }
 
 UCTNode* UCTNode::uct_select_child(int color, bool use_nets) {
+    UCTNode * best;
+    if (!cfg_virtual_loss) {
+        LOCK(get_mutex(), lock);
+        best = select_child(color, use_nets);
+    } else {
+        // Children are only ever appended and published with a release
+        // store, and the statistics are atomics, so we can read them
+        // without the lock.
+        best = select_child(color, use_nets);
+        if (best != nullptr) {
+            best->virtual_loss();
+        }
+    }
+    // Counted on the way down, so threads still in flight
+    // below us are part of the total as well.
+    if (best != nullptr) {
+        m_child_visits++;
+    }
+    return best;
+}
+
+void UCTNode::invalidate_child(UCTNode * child) {
+    if (cfg_virtual_loss) {
+        child->virtual_loss_undo();
+    }
+    // this visit never made it down, and none of the others count now
+    m_child_visits -= child->get_visits() + 1;
+    child->invalidate();
+}
+
+UCTNode* UCTNode::select_child(int color, bool use_nets) {
     UCTNode * best = NULL;
     float best_value = -1000.0f;
     int childbound;
-    int parentvisits = 1; // XXX: this can be 0 now that we sqrt
     float best_probability = 0.0f;
+    const bool netscored = has_netscore();
 
-    LOCK(get_mutex(), lock);
-    if (has_netscore()) {
-        childbound = 35;
+    if (netscored) {
+        childbound = MAX_NET_CHILDS;
     } else {
         if (use_nets) {
             childbound = cfg_rave_moves;
@@ -558,93 +879,96 @@ UCTNode* UCTNode::uct_select_child(int color, bool use_nets) {
         }
     }
 
-    int childcount = 0;
-    UCTNode * child = m_firstchild;
+    UCTChildren * children = m_children.load(std::memory_order_acquire);
+    std::array<uint8, UCTChildren::MAX_CHILDREN> order;
+    const int count = children->copy_order(&order[0]);
 
-    // count parentvisits
-    // XXX: wtf do we count this??? don't we know?
-    // make sure we are at a valid successor
-    while (child != NULL && !child->valid()) {
-        child = child->m_nextsibling;
-    }
-    while (child != NULL && childcount < childbound) {
-        parentvisits      += child->get_visits();
-        child = child->m_nextsibling;
+    // Children beyond the widening bound are never selected, so
+    // the running total over all of them is the same as over the
+    // bounded ones. Visits a child got from the TTable aren't in
+    // it, we only count what went down through this node.
+    const int parentvisits = 1 + m_child_visits.load(std::memory_order_relaxed);
+    const float numerator = std::log((float)parentvisits);
+    const float sqrt_parentvisits = std::sqrt((float)parentvisits);
+    const float mti_scale = std::sqrt(numerator / parentvisits);
+    const float cutoff_ratio = cfg_cutoff_offset + cfg_cutoff_ratio * numerator;
+
+    int childcount = 0;
+    for (int pos = 0; pos < count && childcount < childbound; pos++) {
+        UCTNode * child = children->slot(order[pos]);
         // make sure we are at a valid successor
-        while (child != NULL && !child->valid()) {
-            child = child->m_nextsibling;
+        if (!child->valid()) {
+            continue;
         }
         childcount++;
-    }
-    float numerator = std::log((float)parentvisits);
 
-    float cutoff_ratio;
-    childcount = 0;
-    child = m_firstchild;
-    // make sure we are at a valid successor
-    while (child != NULL && !child->valid()) {
-        child = child->m_nextsibling;
-    }
-    if (has_netscore()) {
-        // first move
-        if (child != NULL) {
-            best_probability = child->get_score();
+        // Count threads still searching below the child as losses
+        int visits = child->get_visits();
+        int vloss = child->get_virtual_loss();
+        float winrate = 0.0f;
+        if (visits > 0) {
+            winrate = child->get_mixed_score(color);
         }
-        assert(best_probability > 0.001f);
-        cutoff_ratio = cfg_cutoff_offset + cfg_cutoff_ratio * numerator;
-    }
-    while (child != NULL && childcount < childbound) {
+        if (vloss > 0) {
+            winrate = winrate * visits / (visits + vloss);
+            visits += vloss;
+        }
+
         float value;
 
-        if (has_netscore()) {
+        if (netscored) {
+            // first move
+            if (childcount == 1) {
+                best_probability = child->get_score();
+                assert(best_probability > 0.001f);
+            }
             if (child->get_score() * cutoff_ratio < best_probability) {
                 break;
             }
 
-            if (!child->first_visit()) {
+            if (visits > 0) {
                 // "UCT" part
-                float winrate = child->get_mixed_score(color);
                 winrate += smp_noise();
                 float psa = child->get_score();
-                float denom = 1.0f + child->get_visits();
+                float denom = 1.0f + visits;
 
-                float mti = (cfg_psa / psa) * std::sqrt(numerator / parentvisits);
-                float puct = cfg_puct * psa * ((float)std::sqrt(parentvisits) / denom);
+                float mti = (cfg_psa / psa) * mti_scale;
+                float puct = cfg_puct * psa * (sqrt_parentvisits / denom);
                 // float cts = cfg_puct * std::sqrt(numerator / denom);
                 // Alternate is to remove psa in puct but without log(parentvis)
 
                 value = winrate - mti + puct;
             } else {
-                float winrate = cfg_fpu;
+                winrate = cfg_fpu;
                 winrate += smp_noise();
                 float psa = child->get_score();
                 float mti;
                 if (parentvisits > 1) {
-                    mti = (cfg_psa / psa) * std::sqrt(numerator / parentvisits);
+                    mti = (cfg_psa / psa) * mti_scale;
                 } else {
                     mti = (cfg_psa / psa);
                 }
 
-                value = winrate - mti + cfg_puct * psa * (float)std::sqrt(parentvisits);
+                value = winrate - mti + cfg_puct * psa * sqrt_parentvisits;
                 assert(value > -1000.0f);
             }
         } else {
             float uctvalue;
             float patternbonus;
-            assert(child->get_ravevisits() > 0);
-            if (!child->first_visit()) {
+            const int idx = order[pos];
+            assert(children->get_ravevisits(idx) > 0);
+            if (visits > 0) {
                 // "UCT" part
-                float winrate = child->get_mixed_score(color);
                 winrate += smp_noise();
-                uctvalue = winrate + cfg_uct * std::sqrt(numerator / child->get_visits());
-                patternbonus = sqrtf((child->get_score() * cfg_patternbonus) / child->get_visits());
+                uctvalue = winrate + cfg_uct * std::sqrt(numerator / visits);
+                patternbonus = sqrtf((child->get_score() * cfg_patternbonus) / visits);
             } else {
                 uctvalue = 1.1f;
                 patternbonus = sqrtf(child->get_score() * cfg_patternbonus);
             }
 
             // RAVE part
-            float ravewinrate = child->get_raverate();
+            float ravewinrate = children->get_raverate(idx);
             float ravevalue = ravewinrate + patternbonus;
             float beta = std::max(0.0, 1.0 - log(1.0 + child->get_visits()) / cfg_beta);
 
@@ -657,13 +981,6 @@ UCTNode* UCTNode::uct_select_child(int color, bool use_nets) {
             best_value = value;
             best = child;
         }
-
-        child = child->m_nextsibling;
-        // make sure we are at a valid successor
-        while (child != NULL && !child->valid()) {
-            child = child->m_nextsibling;
-        }
-        childcount++;
     }
 
     assert(best != NULL);
@@ -725,38 +1042,51 @@ public:
 };
 
 /*
-    sort children by converting linked list to vector,
-    sorting the vector, and reconstructing to linked list again
+    sort children by move probability, dead (invalid) ones last.
+    Only the order array is permuted, the nodes stay where they are.
     Requires node mutex to be held.
 */
 void UCTNode::sort_children() {
     assert(get_mutex().is_held());
-    std::vector<std::tuple<float, UCTNode*>> tmp;
-
-    UCTNode * child = m_firstchild;
-
-    while (child != nullptr) {
-        tmp.push_back(std::make_tuple(child->get_score(), child));
-        child = child->m_nextsibling;
+    UCTChildren * children = m_children.load(std::memory_order_acquire);
+    if (children == nullptr) {
+        return;
     }
 
-    std::sort(tmp.begin(), tmp.end());
+    std::array<uint8, UCTChildren::MAX_CHILDREN> tmp;
+    const int count = children->copy_order(&tmp[0]);
 
-    m_firstchild = nullptr;
+    std::stable_sort(tmp.begin(), tmp.begin() + count,
+        [children](const uint8 a, const uint8 b) {
+            const UCTNode * na = children->slot(a);
+            const UCTNode * nb = children->slot(b);
+            if (na->valid() != nb->valid()) {
+                return na->valid();
+            }
+            return na->get_score() > nb->get_score();
+        });
 
-    for (auto it = tmp.begin(); it != tmp.end(); ++it) {
-        link_child(std::get<1>(*it));
-    }
+    children->set_order(&tmp[0], count);
 }
 
 void UCTNode::sort_root_children(int color) {
     LOCK(get_mutex(), lock);
-    std::vector<sortnode_t> tmp;
+    UCTChildren * children = m_children.load(std::memory_order_acquire);
+    if (children == nullptr) {
+        return;
+    }
 
-    UCTNode * child = m_firstchild;
+    const int count = children->size();
+    std::vector<sortnode_t> tmp;
+    std::vector<UCTNode*> invalid;
     int maxvisits = 0;
 
-    while (child != nullptr) {
+    for (int idx = 0; idx < count; idx++) {
+        UCTNode * child = children->slot(idx);
+        if (!child->valid()) {
+            invalid.push_back(child);
+            continue;
+        }
         int visits = child->get_visits();
         if (visits) {
             float winrate = child->get_mixed_score(color);
@@ -765,127 +1095,167 @@ void UCTNode::sort_root_children(int color) {
             tmp.push_back(std::make_tuple(0.0f, 0, child));
         }
         maxvisits = std::max(maxvisits, visits);
-        child = child->m_nextsibling;
     }
 
-    // reverse sort, because list reconstruction is backwards
-    std::stable_sort(tmp.rbegin(), tmp.rend(), NodeComp(maxvisits));
-
-    m_firstchild = nullptr;
+    // best first
+    std::stable_sort(tmp.begin(), tmp.end(), NodeComp(maxvisits));
 
+    std::array<uint8, UCTChildren::MAX_CHILDREN> order;
+    int pos = 0;
     for (auto it = tmp.begin(); it != tmp.end(); ++it) {
-        link_child(std::get<2>(*it));
+        order[pos++] = children->index_of(std::get<2>(*it));
     }
+    for (auto it = invalid.begin(); it != invalid.end(); ++it) {
+        order[pos++] = children->index_of(*it);
+    }
+    children->set_order(&order[0], pos);
 }
 
-UCTNode* UCTNode::get_first_child() const {
-    return m_firstchild;
+int UCTNode::get_num_children() const {
+    UCTChildren * children = m_children.load(std::memory_order_acquire);
+    if (children == nullptr) {
+        return 0;
+    }
+    return children->size();
 }
 
-UCTNode* UCTNode::get_sibling() const {
-    return m_nextsibling;
+UCTNode* UCTNode::get_child(int pos) const {
+    UCTChildren * children = m_children.load(std::memory_order_acquire);
+    assert(children != nullptr && pos < children->size());
+    return children->get(pos);
 }
 
-UCTNode* UCTNode::get_pass_child() const {
-    UCTNode * child = m_firstchild;
+UCTNode* UCTNode::get_first_child() const {
+    if (get_num_children() == 0) {
+        return nullptr;
+    }
+    return get_child(0);
+}
 
-    while (child != nullptr) {
+UCTNode* UCTNode::get_pass_child() const {
+    for (int pos = 0; pos < get_num_children(); pos++) {
+        UCTNode * child = get_child(pos);
         if (child->m_move == FastBoard::PASS) {
             return child;
         }
-        child = child->m_nextsibling;
     }
 
     return nullptr;
 }
 
 UCTNode* UCTNode::get_nopass_child() const {
-    UCTNode * child = m_firstchild;
+    for (int pos = 0; pos < get_num_children(); pos++) {
+        UCTNode * child = get_child(pos);
+        if (child->m_move != FastBoard::PASS && child->valid()) {
+            return child;
+        }
+    }
 
-    while (child != NULL) {
-        if (child->m_move != FastBoard::PASS) {
+    return nullptr;
+}
+
+UCTNode* UCTNode::find_child(int move) const {
+    for (int pos = 0; pos < get_num_children(); pos++) {
+        UCTNode * child = get_child(pos);
+        if (child->m_move == move) {
             return child;
         }
-        child = child->m_nextsibling;
     }
 
     return nullptr;
 }
 
-void UCTNode::invalidate() {
-    m_valid = false;
+UCTChildren* UCTNode::get_children() const {
+    return m_children.load(std::memory_order_acquire);
 }
 
-bool UCTNode::valid() const {
-    return m_valid;
+UCTChildren* UCTNode::detach_children() {
+    m_expand_state.store(ExpandState::UNEXPANDED, std::memory_order_release);
+    m_child_visits = 0;
+    return m_children.exchange(nullptr, std::memory_order_acq_rel);
 }
 
-// unsafe in SMP, we don't know if people hold pointers to the 
-// child which they might dereference
-void UCTNode::delete_child(UCTNode * del_child) {
-    LOCK(get_mutex(), lock);
-    assert(del_child != NULL);
+int UCTNode::release_subtrees(NodeArena & arena) {
+    UCTChildren * children = m_children.load(std::memory_order_acquire);
+    if (children == nullptr) {
+        return 0;
+    }
 
-    if (del_child == m_firstchild) {           
-        m_firstchild = m_firstchild->m_nextsibling; 
-        delete del_child;       
-        return;
-    } else {
-        UCTNode * child = m_firstchild;    
-        UCTNode * prev  = NULL;
-    
-        do {
-            prev  = child;            
-            child = child->m_nextsibling;
-            
-            if (child == del_child) {                
-                prev->m_nextsibling = child->m_nextsibling;
-                delete del_child;
-                return;
-            }                                    
-        } while (child != NULL);     
-    }         
-
-    assert(0 && "Child to delete not found");           
+    int freed = 0;
+    const int count = children->size();
+    for (int i = 0; i < count; i++) {
+        freed += children->slot(i)->release_subtrees(arena);
+    }
+
+    m_children.store(nullptr, std::memory_order_release);
+    m_child_visits = 0;
+    UCTChildren::release(arena, children);
+    freed += count;
+
+    return freed;
 }
 
-// update siblings with matching RAVE info
-void UCTNode::updateRAVE(Playout & playout, int color) {
-    float score = playout.get_score();
+int UCTNode::prune_subtrees(NodeArena & arena, int min_visits) {
+    UCTChildren * children = m_children.load(std::memory_order_acquire);
+    if (children == nullptr) {
+        return 0;
+    }
 
-    LOCK(get_mutex(), lock);
-    // siblings
-    UCTNode * child = m_firstchild;
+    int freed = 0;
+    const int count = children->size();
+    for (int i = 0; i < count; i++) {
+        UCTNode * child = children->slot(i);
+        if (!child->has_children()) {
+            continue;
+        }
+        if (!child->valid() || child->get_visits() < min_visits) {
+            freed += child->release_subtrees(arena);
+            child->make_leaf();
+        } else {
+            freed += child->prune_subtrees(arena, min_visits);
+        }
+    }
 
-    while (child != NULL) {
-        int move = child->get_move();
+    return freed;
+}
 
-        if (color == FastBoard::BLACK) {
-            bool bpass = playout.passthrough(FastBoard::BLACK, move);
+void UCTNode::make_leaf() {
+    m_expand_state.store(ExpandState::UNEXPANDED, std::memory_order_release);
+    m_symmetries_done = 0;
+    // Don't expand again on the very next visit, wait
+    // until the node has proven itself once more.
+    m_expand_cnt = m_visits + cfg_expand_threshold;
+    m_netscore_thresh = m_visits + cfg_mature_threshold;
+}
 
-            if (bpass) {
-                child->m_ravevisits++;
+void UCTNode::invalidate() {
+    clear_flag(VALID);
+}
 
-                if (score > 0.0f) {
-                    atomic_add(child->m_ravestmwins, 1.0 + 0.05 * score);
-                } else if (score == 0.0f) {
-                    atomic_add(child->m_ravestmwins, 0.5);
-                }
-            }
-        } else {
-            bool wpass = playout.passthrough(FastBoard::WHITE, move);
+bool UCTNode::valid() const {
+    return test_flag(VALID);
+}
 
-            if (wpass) {
-                child->m_ravevisits++;
+// update siblings with matching RAVE info
+void UCTNode::updateRAVE(Playout & playout, int color, UCTNode * played) {
+    UCTChildren * children = m_children.load(std::memory_order_acquire);
+    float score = playout.get_score();
+    if (color == FastBoard::WHITE) {
+        score = -score;
+    }
 
-                if (score < 0.0f) {
-                    atomic_add(child->m_ravestmwins, 1.0 + 0.05 * -score);
-                } else if (score == 0.0f) {
-                    atomic_add(child->m_ravestmwins, 0.5);
-                }
-            }
-        }
+    // siblings the side to move played first in the playout
+    float wins = 0.0f;
+    if (score > 0.0f) {
+        wins = 1.0f + 0.05f * score;
+    } else if (score == 0.0f) {
+        wins = 0.5f;
+    }
+    children->update_rave(playout.get_first_plays(color), wins);
 
-        child = child->m_nextsibling;
+    // the move we actually played, jigo doesn't count here
+    if (played != nullptr) {
+        children->add_rave(children->index_of(played),
+                           score > 0.0f ? wins : 0.0f);
     }
 }
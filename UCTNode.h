@@ -4,45 +4,141 @@
 #include "config.h"
 
 #include <tuple>
+#include <array>
 #include <atomic>
 
 #include "SMP.h"
+#include "NodeArena.h"
 #include "GameState.h"
 #include "Playout.h"
 #include "Network.h"
 
+class UCTNode;
+
+/*
+    The children of a node, stored as one contiguous block right after
+    a small header. Slots are constructed once and never move, because
+    other threads may hold pointers to them. Sorting only permutes the
+    order array. The header also has per-slot arrays for the RAVE
+    statistics and the sort order, and the slot of each vertex.
+
+    Selection reads the order without the node lock while a sort
+    may be rewriting it. A sequence number, odd while a new order
+    is written, tells readers to try again.
+*/
+class UCTChildren {
+public:
+    static constexpr int MAX_CHILDREN = 255;
+
+    // nodes are padded to a full cache line each
+    static constexpr size_t SLOT_SIZE = 64;
+
+    static UCTChildren * create(NodeArena & arena, int capacity);
+    static void release(NodeArena & arena, UCTChildren * children);
+    static size_t block_size(int capacity);
+
+    int size() const;
+    int capacity() const;
+    // pos-th child in sorted order
+    UCTNode * get(int pos) const;
+    // storage slot, unaffected by sorting
+    UCTNode * slot(int idx) const;
+    int index_of(const UCTNode * node) const;
+    /*
+        Copy of the sorted order, never half sorted. Returns the
+        number of children it covers.
+    */
+    int copy_order(uint8 * order) const;
+    // new order of the first count children, node mutex held
+    void set_order(const uint8 * order, int count);
+    void publish(int count);
+
+    /*
+        RAVE statistics of the children live here, indexed by slot,
+        next to a mask of the moves they play. Backing up a playout
+        is then an and of that mask with the moves the playout made,
+        touching only the children that got a hit.
+        A new child goes last in the order until the next sort.
+    */
+    void link_move(int idx, int move);
+    int get_ravevisits(int idx) const;
+    float get_raverate(int idx) const;
+    void update_rave(const Playout::movemask_t & moves, float wins);
+    void add_rave(int idx, float wins);
+    // statistics found elsewhere, like in the TTable
+    void set_rave(int idx, int visits, float wins);
+
+private:
+    UCTChildren(int capacity);
+    static size_t header_size(int capacity);
+    std::atomic<int> * ravevisits() const;
+    std::atomic<float> * ravewins() const;
+    std::atomic<uint8> * order() const;
+    // per vertex, NO_SLOT if no child plays it
+    std::atomic<uint8> * slot_of() const;
+    static constexpr uint8 NO_SLOT = 0xFF;
+
+    std::atomic<int> m_count;
+    int m_capacity;
+    std::atomic<uint32> m_order_seq;
+    std::array<std::atomic<uint64>, Playout::MASK_WORDS> m_movemask;
+};
+
 class UCTNode {
 public:
     typedef std::tuple<float, int, UCTNode*> sortnode_t;
 
+    /*
+        Expansion moves a node through these states. Every step is
+        a single compare-and-swap, so exactly one thread does the
+        work. A netscored node that runs another symmetry goes to
+        RESCORING and keeps counting as netscored meanwhile.
+    */
+    enum class ExpandState : uint8 {
+        UNEXPANDED, EXPANDING, EXPANDED, NETSCORING, NETSCORED, RESCORING
+    };
+
+    /*
+        Number of times a thread lost the race for a state
+        transition, and how often waiting for the winner paid off.
+    */
+    enum RaceCounter {
+        EXPAND_RACE, EXPAND_WAIT, NETSCORE_RACE, EVAL_RACE,
+        NUM_RACE_COUNTERS
+    };
+    static int get_race_count(RaceCounter counter);
+
     UCTNode(int vertex, float score,
             int expand_threshold, int netscore_threshold,
             int movenum);
-    ~UCTNode();
     bool first_visit() const;
     bool has_children() const;
     float get_winrate(int tomove) const;
-    float get_raverate() const;
     double get_blackwins() const;
-    void create_children(std::atomic<int> & nodecount,
+    void create_children(std::atomic<int> & nodecount, NodeArena & arena,
                          FastState & state, bool at_root, bool use_nets);
-    void netscore_children(std::atomic<int> & nodecount,
+    void netscore_children(std::atomic<int> & nodecount, NodeArena & arena,
                            FastState & state, bool at_root);
     void scoring_cb(std::atomic<int> * nodecount,
+                    NodeArena * arena,
                     FastState & state,
                     Network::Netresult & raw_netlist,
                     bool all_symmetries);
+    /*
+        Evaluate the position with the value net. With the CPU
+        network queue the eval is added later, check
+        has_unpropagated_eval on the next visits.
+    */
     void run_value_net(FastState & state);
     void kill_superkos(KoState & state);
-    void delete_child(UCTNode * child);
     void invalidate();
     bool valid() const;
     bool should_expand() const;
     bool should_netscore() const;
     int get_move() const;
     int get_visits() const;
-    int get_ravevisits() const;
     bool has_netscore() const;
+    ExpandState get_expand_state() const;
     float get_score() const;
     void set_score(float score);
     float get_eval(int tomove) const;
@@ -51,25 +147,65 @@ public:
     double get_blackevals() const;
     int get_evalcount() const;
     bool has_eval_propagated() const;
+    // the value net eval for this node came in but isn't backed up
+    bool has_unpropagated_eval() const;
     void set_eval_propagated();
     void set_move(int move);
     void set_visits(int visits);
     void set_blackwins(double wins);
 
     void set_expand_cnt(int runs, int netscore_runs);
-    void set_blackevals(double blacevals);
+    void set_blackevals(double blackevals);
     void set_evalcount(int evalcount);
     void set_expand_cnt(int runs);
     void set_eval(float eval);
     void accumulate_eval(float eval);
-    void update(Playout & gameresult, int color, bool update_eval);
-    void updateRAVE(Playout & playout, int color);
+    void update(Playout & gameresult, bool update_eval);
+    /*
+        Add statistics another search tree gathered for the move of
+        child, to child and to us. Root parallel search merges its
+        trees this way.
+    */
+    void merge_child_stats(UCTNode * child, int visits, double blackwins,
+                           int evalcount, double blackevals);
+    // played is the child the playout went through, if any
+    void updateRAVE(Playout & playout, int color, UCTNode * played);
 
     UCTNode* uct_select_child(int color, bool use_nets);
+    /*
+        Invalidate a child that uct_select_child just returned, and
+        take its visits out of the total the parent keeps for them.
+    */
+    void invalidate_child(UCTNode * child);
+    /*
+        Threads on their way down through a node count as losses
+        for it until their playout comes back, which keeps other
+        threads from piling into the same line.
+    */
+    void virtual_loss();
+    void virtual_loss_undo();
+    int get_virtual_loss() const;
+    int get_num_children() const;
+    UCTNode* get_child(int pos) const;
     UCTNode* get_first_child() const;
     UCTNode* get_pass_child() const;
     UCTNode* get_nopass_child() const;
-    UCTNode* get_sibling() const;
+    UCTNode* find_child(int move) const;
+    UCTChildren* get_children() const;
+    // unlink the children, the caller becomes responsible for them
+    UCTChildren* detach_children();
+    /*
+        Return the subtrees below this node to the arena.
+        Returns the number of nodes freed.
+    */
+    int release_subtrees(NodeArena & arena);
+    /*
+        Free the children of nodes in this subtree with fewer than
+        min_visits visits, turning them back into leaves. Only safe
+        while no other thread is searching. Returns the number of
+        nodes freed.
+    */
+    int prune_subtrees(NodeArena & arena, int min_visits);
 
     void sort_root_children(int color);
     void sort_children();
@@ -77,47 +213,71 @@ public:
 
 private:
     UCTNode();
-    void link_child(UCTNode * newchild);
+    void make_leaf();
     void link_nodelist(std::atomic<int> & nodecount,
+                       NodeArena & arena,
                        FastBoard & state,
                        Network::Netresult & nodes,
                        bool use_nets);
     void rescore_nodelist(std::atomic<int> & nodecount,
+                         NodeArena & arena,
                          FastBoard & state,
                          Network::Netresult & nodes,
                          bool all_symmetries);
+    UCTNode* select_child(int color, bool use_nets);
+    void value_net_cb(int tomove, float eval);
     float smp_noise();
+
+    bool transition(ExpandState from, ExpandState to);
+
+    // yields spent waiting for another thread's expansion
+    static constexpr int EXPAND_WAIT_SPINS = 16;
+    static std::array<std::atomic<int>, NUM_RACE_COUNTERS> s_race_counts;
+
+    // losses counted per thread in flight
+    static constexpr int VIRTUAL_LOSS_COUNT = 3;
+
+    // most children the network can add to a node
+    static constexpr int MAX_NET_CHILDS = 35;
+
+    // State flags, all packed in m_flags
+    enum : uint32 {
+        VALID           = 1 << 0,   // alive (superko)
+        EVAL_PROPAGATED = 1 << 1,
+        IS_EVALUATING   = 1 << 2,
+        HAS_NET_EVAL    = 1 << 3
+    };
+    bool test_flag(uint32 flag) const;
+    void set_flag(uint32 flag);
+    void clear_flag(uint32 flag);
+
     // Tree data
-    std::atomic<bool> m_has_children;
-    UCTNode* m_firstchild;
-    UCTNode* m_nextsibling;
-    // Move
-    int m_move;
-    // UCT
+    std::atomic<UCTChildren*> m_children;
+    /*
+        Sums of results, in doubles: past 2^24 visits a float
+        no longer changes when a win is added.
+    */
     std::atomic<double> m_blackwins;
+    std::atomic<double> m_blackevals;
+    // UCT
     std::atomic<int> m_visits;
-    // RAVE
-    std::atomic<double> m_ravestmwins;
-    std::atomic<int> m_ravevisits;
-    // move order
-    float m_score;
     // board eval
-    bool m_eval_propagated;
-    std::atomic<double> m_blackevals;
     std::atomic<int> m_evalcount;
-    int m_movenum;
-    bool m_is_evaluating;    // mutex
-    // alive (superko)
-    std::atomic<bool> m_valid;
+    // move order
+    float m_score;
     // extend node
     int m_expand_cnt;
-    bool m_is_expanding;
     // dcnn node
-    bool m_has_netscore;
     int m_netscore_thresh;
-    int m_symmetries_done;
-    bool m_is_netscoring;
-    SMP::Mutex m_nodemutex;
+    std::atomic<uint32> m_flags;
+    // Move
+    int16 m_move;
+    int16 m_movenum;
+    std::atomic<int16> m_virtual_loss;
+    std::atomic<uint8> m_symmetries_done;
+    std::atomic<ExpandState> m_expand_state;
+    // visits handed down to the children, including those in flight
+    std::atomic<int> m_child_visits;
 };
 
 #endif
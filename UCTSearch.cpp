@@ -7,6 +7,7 @@
 #include <utility>
 #include <thread>
 #include <algorithm>
+#include <new>
 
 #include "FastBoard.h"
 #include "UCTSearch.h"
@@ -18,23 +19,37 @@
 #include "Network.h"
 #include "GTP.h"
 #include "Book.h"
+#include "TreeReclaimer.h"
 #ifdef USE_OPENCL
 #include "OpenCL.h"
 #endif
+#ifdef USE_NNQUEUE
+#include "NNQueue.h"
+#endif
 
 using namespace Utils;
 
 UCTSearch::UCTSearch(GameState & g)
     : m_rootstate(g),
-      m_root(FastBoard::PASS, 0.0f, 1, 1, g.board.get_stone_count()),
+      m_rootblock(nullptr),
+      m_has_tree(false),
+      m_use_ttable(true),
       m_nodes(0),
       m_playouts(0),
+      m_bind_node(-1),
       m_hasrunflag(false),
       m_runflag(NULL),
       m_analyzing(false),
       m_quiet(false) {
-    set_use_nets(cfg_enable_nets);
+    new_root();
     set_playout_limit(cfg_max_playouts);
+    setup_parameters();
+}
+
+void UCTSearch::setup_parameters() {
+    set_use_nets(cfg_enable_nets);
+    // root parallel trees share the budget
+    m_max_memory = cfg_max_tree_memory / std::max(1, cfg_root_trees);
     if (m_use_nets) {
         cfg_uct = 0.085f;
         cfg_beta = 42.5;
@@ -45,12 +60,12 @@ UCTSearch::UCTSearch(GameState & g)
         cfg_expand_threshold = 60;
 #endif
     } else {
-        if (g.board.get_boardsize() <= 9) {
+        if (m_rootstate.board.get_boardsize() <= 9) {
             cfg_uct = 0.01f;
             cfg_beta = 16.5f;
             cfg_patternbonus = 0.0025f;
             cfg_expand_threshold = 16;
-        } else if (g.board.get_boardsize() <= 13) {
+        } else if (m_rootstate.board.get_boardsize() <= 13) {
             cfg_uct = 0.01f;
             cfg_beta = 22.0f;
             cfg_patternbonus = 0.0035f;
@@ -64,6 +79,307 @@ UCTSearch::UCTSearch(GameState & g)
     }
 }
 
+void UCTSearch::new_root() {
+    void * mem = m_arena.allocate(sizeof(UCTNode));
+    m_root = new (mem) UCTNode(FastBoard::PASS, 0.0f, 1, 1,
+                               m_rootstate.board.get_stone_count());
+    m_rootblock = nullptr;
+}
+
+UCTSearch::~UCTSearch() {
+    TreeReclaimer::get_reclaimer()->forget(m_arena);
+}
+
+void UCTSearch::discard_subtree(UCTNode * node) {
+    UCTChildren * children = node->detach_children();
+    if (children != nullptr) {
+        TreeReclaimer::get_reclaimer()->discard(m_arena, m_nodes, children);
+    }
+}
+
+void UCTSearch::promote_child(UCTNode * child) {
+    UCTChildren * children = m_root->get_children();
+    // Everything below the siblings of child goes to the reclaimer.
+    // The siblings themselves share child's block and die with it.
+    for (int i = 0; i < children->size(); i++) {
+        UCTNode * sibling = children->slot(i);
+        if (sibling != child) {
+            discard_subtree(sibling);
+        }
+    }
+    int freed = children->size() - 1;
+
+    if (m_rootblock != nullptr) {
+        UCTChildren::release(m_arena, m_rootblock);
+        // the old root itself was counted when created
+        freed += 1;
+    } else {
+        m_arena.release(m_root, sizeof(UCTNode));
+    }
+
+    m_root = child;
+    m_rootblock = children;
+    m_nodes -= freed;
+}
+
+void UCTSearch::reuse_tree() {
+    unmerge_root_trees();
+    int prev_visits = m_root->get_visits();
+    bool reused = false;
+
+    /*
+        A different komi doesn't stop the reuse, --komiadjust changes
+        it between moves. The value net evals don't depend on it, and
+        the playout results it shifts by a point are soon outweighed
+        by the new search.
+    */
+    int depth = m_rootstate.get_movenum() - m_treestate.get_movenum();
+    if (m_has_tree && depth >= 0 && depth <= 2
+        && m_treestate.board.get_boardsize() == m_rootstate.board.get_boardsize()) {
+        // Replay the moves since the last search and check
+        // that we end up in the current position.
+        std::vector<int> moves;
+        if (depth == 2) {
+            moves.push_back(m_rootstate.get_prevlast_move());
+        }
+        if (depth >= 1) {
+            moves.push_back(m_rootstate.get_last_move());
+        }
+        KoState replay = m_treestate;
+        for (auto move : moves) {
+            replay.play_move(move);
+        }
+        if (replay.board.hash == m_rootstate.board.hash
+            && replay.get_to_move() == m_rootstate.get_to_move()) {
+            reused = true;
+            for (auto move : moves) {
+                UCTNode * child = m_root->find_child(move);
+                if (child == nullptr) {
+                    reused = false;
+                    break;
+                }
+                promote_child(child);
+            }
+        }
+    }
+
+    if (!reused) {
+        discard_subtree(m_root);
+        if (m_rootblock != nullptr) {
+            UCTChildren::release(m_arena, m_rootblock);
+            m_nodes--;
+        } else {
+            m_arena.release(m_root, sizeof(UCTNode));
+        }
+        new_root();
+    } else if (prev_visits > 0) {
+        myprintf("Reusing tree: %d of %d visits (%.1f%%) inherited.\n",
+                 m_root->get_visits(), prev_visits,
+                 100.0f * m_root->get_visits() / prev_visits);
+        if (m_treestate.get_komi() != m_rootstate.get_komi()) {
+            myprintf("Komi changed from %.1f to %.1f since.\n",
+                     m_treestate.get_komi(), m_rootstate.get_komi());
+        }
+    }
+
+    m_treestate = m_rootstate;
+    m_has_tree = true;
+}
+
+void UCTSearch::start_workers(ThreadGroup & tg) {
+    m_run = true;
+    int cpus = cfg_num_threads;
+    // Deal the threads out over the trees, we are tree 0 and
+    // the calling thread works on it too. With NUMA binding
+    // each tree gets a node of its own if there are enough.
+    const int trees = 1 + (int)m_trees.size();
+    const int nodes = SMP::get_num_numa_nodes();
+    for (int i = 1; i < cpus; i++) {
+        const int tree = i % trees;
+        int node = m_bind_node;
+        if (trees > 1 && cfg_numa_bind && nodes > 1) {
+            node = tree % nodes;
+        }
+        if (tree == 0) {
+            tg.add_task(UCTWorker(m_rootstate, this, this, m_root, node));
+        } else {
+            UCTSearch * other = m_trees[tree - 1].get();
+            tg.add_task(UCTWorker(m_rootstate, this, other,
+                                  other->m_root, node));
+        }
+    }
+}
+
+void UCTSearch::stop_workers(ThreadGroup & tg) {
+    m_run = false;
+#ifdef USE_OPENCL
+    opencl.join_outstanding_cb();
+#endif
+    tg.wait_all();
+#ifdef USE_NNQUEUE
+    // Nothing may point into the tree once we return
+    if (m_use_nets) {
+        NNQueue::get_queue()->flush();
+    }
+#endif
+}
+
+bool UCTSearch::tree_needs_pruning() const {
+    // Discarded trees still count as in use until the reclaimer
+    // has been through them, don't prune live ones meanwhile.
+    if (TreeReclaimer::get_reclaimer()->get_backlog() != 0) {
+        return false;
+    }
+    if (m_arena.get_bytes_in_use() > m_max_memory / 10 * 9) {
+        return true;
+    }
+    for (const auto & tree : m_trees) {
+        if (tree->tree_needs_pruning()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Free the subtrees of the least visited nodes until the tree uses
+    less than 70% of its budget. Must be called with the workers
+    stopped. Pruned nodes keep their statistics and can be expanded
+    again if the search comes back to them. Root parallel trees
+    are pruned the same way, each against its own share.
+*/
+void UCTSearch::prune_tree() {
+    for (auto & tree : m_trees) {
+        if (tree->tree_needs_pruning()) {
+            tree->prune_tree();
+        }
+    }
+    if (m_arena.get_bytes_in_use() <= m_max_memory / 10 * 9) {
+        return;
+    }
+
+    Time start;
+    const size_t target = m_max_memory / 10 * 7;
+    const size_t before = m_arena.get_bytes_in_use();
+    int min_visits = cfg_expand_threshold;
+    int freed = 0;
+
+    do {
+        min_visits *= 2;
+        freed += m_root->prune_subtrees(m_arena, min_visits);
+    } while (m_arena.get_bytes_in_use() > target
+             && min_visits < m_root->get_visits());
+    m_nodes -= freed;
+
+    Time elapsed;
+    myprintf("Pruned %d nodes with < %d visits, %d kB -> %d kB (%d cs)\n",
+             freed, min_visits,
+             (int)(before / 1024), (int)(m_arena.get_bytes_in_use() / 1024),
+             Time::timediff(start, elapsed));
+}
+
+/*
+    Set up the extra trees for root parallel search. Each starts
+    from scratch and stays out of the TTable, otherwise the trees
+    would pick up each other's statistics and merging them would
+    count those twice.
+*/
+void UCTSearch::start_root_trees() {
+    m_trees.clear();
+    m_merged.clear();
+    // reuse_tree took the last search's out again
+    assert(m_merged_total.empty());
+    m_merged_total.assign(FastBoard::MAXSQ + 1,
+                          MergedStats{0, 0.0f, 0, 0.0f});
+
+    const int trees = std::min(cfg_root_trees, cfg_num_threads);
+    for (int i = 1; i < trees; i++) {
+        std::unique_ptr<UCTSearch> tree(new UCTSearch(m_rootstate));
+        tree->m_use_ttable = false;
+        UCTNode * root = tree->m_root;
+        root->create_children(tree->m_nodes, tree->m_arena,
+                              m_rootstate, true, m_use_nets);
+        if (m_use_nets) {
+            root->netscore_children(tree->m_nodes, tree->m_arena,
+                                    m_rootstate, true);
+        }
+        root->kill_superkos(m_rootstate);
+        m_trees.push_back(std::move(tree));
+        m_merged.emplace_back(FastBoard::MAXSQ + 1, MergedStats{0, 0.0f, 0, 0.0f});
+    }
+}
+
+/*
+    Add what the other trees found for each root move since the
+    last merge to our own root children. Safe while searching.
+*/
+void UCTSearch::merge_root_trees() {
+    for (size_t i = 0; i < m_trees.size(); i++) {
+        UCTChildren * children = m_trees[i]->m_root->get_children();
+        if (children == nullptr) {
+            continue;
+        }
+        for (int idx = 0; idx < children->size(); idx++) {
+            UCTNode * child = children->slot(idx);
+            UCTNode * ours = m_root->find_child(child->get_move());
+            if (!child->valid() || ours == nullptr || !ours->valid()) {
+                continue;
+            }
+            MergedStats & merged = m_merged[i][child->get_move() + 1];
+            MergedStats now{child->get_visits(), child->get_blackwins(),
+                            child->get_evalcount(), child->get_blackevals()};
+            MergedStats added{now.m_visits - merged.m_visits,
+                              now.m_blackwins - merged.m_blackwins,
+                              now.m_evalcount - merged.m_evalcount,
+                              now.m_blackevals - merged.m_blackevals};
+            m_root->merge_child_stats(ours, added.m_visits,
+                                      added.m_blackwins, added.m_evalcount,
+                                      added.m_blackevals);
+            merged = now;
+            MergedStats & total = m_merged_total[child->get_move() + 1];
+            total.m_visits += added.m_visits;
+            total.m_blackwins += added.m_blackwins;
+            total.m_evalcount += added.m_evalcount;
+            total.m_blackevals += added.m_blackevals;
+        }
+    }
+}
+
+void UCTSearch::stop_root_trees() {
+    if (m_trees.empty()) {
+        return;
+    }
+    merge_root_trees();
+    int visits = 0;
+    int nodes = 0;
+    for (const auto & tree : m_trees) {
+        visits += tree->m_root->get_visits();
+        nodes += tree->m_nodes;
+    }
+    myprintf("Merged %d trees: %d visits, %d nodes outside the main tree\n",
+             (int)m_trees.size() + 1, visits, nodes);
+    m_trees.clear();
+    m_merged.clear();
+}
+
+/*
+    Take what the other trees added out of our root and its
+    children again, leaving what this tree searched itself.
+*/
+void UCTSearch::unmerge_root_trees() {
+    for (size_t vertex = 0; vertex < m_merged_total.size(); vertex++) {
+        const MergedStats & total = m_merged_total[vertex];
+        if (total.m_visits == 0 && total.m_evalcount == 0) {
+            continue;
+        }
+        UCTNode * child = m_root->find_child((int)vertex - 1);
+        assert(child != nullptr);
+        m_root->merge_child_stats(child, -total.m_visits, -total.m_blackwins,
+                                  -total.m_evalcount, -total.m_blackevals);
+    }
+    m_merged_total.clear();
+}
+
 void UCTSearch::set_runflag(std::atomic<bool> * flag) {
     m_runflag = flag;
     m_hasrunflag = true;
@@ -76,25 +392,34 @@ void UCTSearch::set_use_nets(bool flag) {
     }
 }
 
-Playout UCTSearch::play_simulation(KoState & currstate, UCTNode* const node) {
+Playout UCTSearch::play_simulation(KoState & currstate, UCTNode* const node,
+                                   UCTChildren* const parent) {
     const int color = currstate.get_to_move();
     const uint64 hash = currstate.board.get_hash();
     const float komi = currstate.get_komi();
     Playout noderesult;
     bool update_eval = true;
+    // Statistics merged from other root trees stay out of the TTable,
+    // and it mustn't overwrite them either
+    const bool use_ttable = m_use_ttable
+        && (m_trees.empty()
+            || (node != m_root && parent != m_root->get_children()));
+
+    if (use_ttable) {
+        TTable::get_TT()->sync(hash, komi, node, parent);
+    }
 
-    TTable::get_TT()->sync(hash, komi, node);
-
-    if (m_use_nets
-        && !node->get_evalcount()
-        && node->get_visits() > cfg_eval_thresh) {
-        node->run_value_net(currstate);
-
-        LOCK(node->get_mutex(), lock);
-        // Check whether we have new evals to back up
-        if (!node->has_eval_propagated() && node->get_evalcount()) {
+    if (m_use_nets && node->get_visits() > cfg_eval_thresh) {
+        if (!node->get_evalcount()) {
+            node->run_value_net(currstate);
+        }
+        // Check whether we have new evals to back up. Queued evals
+        // come in while other playouts go through here.
+        if (node->has_unpropagated_eval()) {
+            LOCK(node->get_mutex(), lock);
             if (!node->has_eval_propagated()) {
-                noderesult.set_eval(node->get_blackevals());
+                noderesult.set_eval(node->get_blackevals()
+                                    / node->get_evalcount());
                 node->set_eval_propagated();
                 // Don't accumulate our own eval twice
                 update_eval = false;
@@ -104,19 +429,20 @@ Playout UCTSearch::play_simulation(KoState & currstate, UCTNode* const node) {
 
     if (!node->has_children()
         && node->should_expand()
-        && m_nodes < MAX_TREE_SIZE) {
-        node->create_children(m_nodes, currstate, false, m_use_nets);
+        && m_arena.get_bytes_in_use() < m_max_memory) {
+        node->create_children(m_nodes, m_arena, currstate, false, m_use_nets);
     }
     // This can happen at the same time as the previous one if this
     // position comes from the TTable.
     if (m_use_nets
         && node->has_children()
         && node->should_netscore()) {
-        node->netscore_children(m_nodes, currstate, false);
+        node->netscore_children(m_nodes, m_arena, currstate, false);
     }
 
     if (node->has_children()) {
         UCTNode * next = node->uct_select_child(color, m_use_nets);
+        UCTNode * played = nullptr;
 
         if (next != NULL) {
             int move = next->get_move();
@@ -125,29 +451,48 @@ Playout UCTSearch::play_simulation(KoState & currstate, UCTNode* const node) {
                 currstate.play_move(move);
 
                 if (!currstate.superko()) {
-                    noderesult = play_simulation(currstate, next);
+                    noderesult = play_simulation(currstate, next,
+                                                 node->get_children());
+                    played = next;
                 } else {
-                    next->invalidate();
+                    node->invalidate_child(next);
                     noderesult.run(currstate, false, true);
                 }
             } else {
                 currstate.play_pass();
-                noderesult = play_simulation(currstate, next);
+                noderesult = play_simulation(currstate, next,
+                                             node->get_children());
+                played = next;
             }
         } else {
             noderesult.run(currstate, false, true);
         }
-        node->updateRAVE(noderesult, color);
+        node->updateRAVE(noderesult, color, played);
     } else {
         noderesult.run(currstate, false, true);
     }
 
-    node->update(noderesult, color, update_eval);
-    TTable::get_TT()->update(hash, komi, node);
+    node->update(noderesult, update_eval);
+    if (use_ttable) {
+        TTable::get_TT()->update(hash, komi, node, parent);
+    }
 
     return noderesult;
 }
 
+void UCTSearch::dump_ttable_stats() {
+    TTable::Stats stats = TTable::get_TT()->get_stats();
+    int64 lookups = stats.m_hits + stats.m_misses;
+    if (!m_use_ttable || lookups == 0) {
+        return;
+    }
+    myprintf("TTable: %.1f%% hits, %.1f%% misses, "
+             "%.1f%% of stores overwrote another position\n",
+             100.0 * stats.m_hits / lookups,
+             100.0 * stats.m_misses / lookups,
+             100.0 * stats.m_overwrites / std::max<int64>(1, stats.m_stores));
+}
+
 void UCTSearch::dump_GUI_stats(GameState & state, UCTNode & parent) {
 #ifndef _CONSOLE
     const int color = state.get_to_move();
@@ -157,7 +502,7 @@ void UCTSearch::dump_GUI_stats(GameState & state, UCTNode & parent) {
     }
 
     // sort children, put best move on top
-    m_root.sort_root_children(color);
+    m_root->sort_root_children(color);
 
     UCTNode * bestnode = parent.get_first_child();
     if (bestnode->first_visit()) {
@@ -165,10 +510,8 @@ void UCTSearch::dump_GUI_stats(GameState & state, UCTNode & parent) {
     }
 
     int total_visits = 0;
-    UCTNode * node = bestnode;
-    while (node != nullptr) {
-        total_visits += node->get_visits();
-        node = node->get_sibling();
+    for (int pos = 0; pos < parent.get_num_children(); pos++) {
+        total_visits += parent.get_child(pos)->get_visits();
     }
 
     using TRowVector = std::vector<std::pair<std::string, std::string>>;
@@ -187,9 +530,11 @@ void UCTSearch::dump_GUI_stats(GameState & state, UCTNode & parent) {
 
     auto & analysis_data = std::get<2>(*analysis_packet);
 
-    node = bestnode;
-    int movecount = 0;
-    while (node != nullptr) {
+    for (int pos = 0; pos < parent.get_num_children(); pos++) {
+        UCTNode * node = parent.get_child(pos);
+        if (!node->valid()) {
+            continue;
+        }
         if (node->get_score() > 0.005f || node->get_visits() > 0) {
             std::string movestr = state.move_to_text(node->get_move());
             std::string pvstring(movestr);
@@ -228,8 +573,6 @@ void UCTSearch::dump_GUI_stats(GameState & state, UCTNode & parent) {
             move_data->emplace_back(movestr,
                                     (float)(node->get_visits() / (double)total_visits));
         }
-
-        node = node->get_sibling();
     }
 
     GUIAnalysis((void*)analysis_packet.release());
@@ -246,7 +589,7 @@ void UCTSearch::dump_stats(KoState & state, UCTNode & parent) {
     }
 
     // sort children, put best move on top
-    m_root.sort_root_children(color);
+    m_root->sort_root_children(color);
 
     UCTNode * bestnode = parent.get_first_child();
 
@@ -255,10 +598,15 @@ void UCTSearch::dump_stats(KoState & state, UCTNode & parent) {
     }
 
     int movecount = 0;
-    UCTNode * node = bestnode;
+    UCTChildren * children = parent.get_children();
 
-    while (node != nullptr) {
+    for (int pos = 0; pos < parent.get_num_children(); pos++) {
+        UCTNode * node = parent.get_child(pos);
+        if (!node->valid()) {
+            continue;
+        }
         if (++movecount > 2 && node->get_visits() < cfg_expand_threshold) break;
+        const int idx = children->index_of(node);
 
         std::string tmp = state.move_to_text(node->get_move());
         std::string pvstring(tmp);
@@ -268,8 +616,8 @@ void UCTSearch::dump_stats(KoState & state, UCTNode & parent) {
                         tmp.c_str(),
                         node->get_visits(),
                         node->get_visits() > 0 ? node->get_winrate(color)*100.0f : 0.0f,
-                        node->get_visits() > 0 ? node->get_raverate()*100.0f : 0.0f,
-                        node->get_ravevisits(),
+                        node->get_visits() > 0 ? children->get_raverate(idx)*100.0f : 0.0f,
+                        children->get_ravevisits(idx),
                         node->get_score() * 100.0f);
         } else {
             myprintf("%4s -> %7d (W: %5.2f%%) (U: %5.2f%%) (V: %5.2f%%: %6d) (N: %4.1f%%) PV: ",
@@ -288,8 +636,6 @@ void UCTSearch::dump_stats(KoState & state, UCTNode & parent) {
         pvstring += " " + get_pv(tmpstate, *node);
 
         myprintf("%s\n", pvstring.c_str());
-
-        node = node->get_sibling();
     }
 
     std::string tmp = state.move_to_text(bestnode->get_move());
@@ -311,14 +657,14 @@ bool UCTSearch::easy_move_precondition() {
    if (!m_use_nets) {
         return false;
     }
-    if (!m_root.has_children()) {
+    if (!m_root->has_children()) {
         return false;
     }
 
     float best_probability = 0.0f;
 
     // do we have statistics on the moves?
-    UCTNode * first = m_root.get_first_child();
+    UCTNode * first = m_root->get_first_child();
     if (first != NULL) {
         best_probability = first->get_score();
         if (best_probability < 0.60f) {
@@ -328,8 +674,8 @@ bool UCTSearch::easy_move_precondition() {
         return false;
     }
 
-    UCTNode * second = first->get_sibling();
-    if (second != NULL) {
+    if (m_root->get_num_children() > 1) {
+        UCTNode * second = m_root->get_child(1);
         float second_probability = second->get_score();
         if (second_probability * 10.0f < best_probability) {
             return true;
@@ -346,16 +692,16 @@ bool UCTSearch::allow_easy_move() {
     assert(m_use_nets);
 
     int color = m_rootstate.board.get_to_move();
-    m_root.sort_root_children(color);
+    m_root->sort_root_children(color);
 
-    UCTNode * first = m_root.get_first_child();
+    UCTNode * first = m_root->get_first_child();
     float best_probability = first->get_score();
     // Some other move got to first place.
     if (best_probability < 0.60f) {
         return false;
     }
 
-    UCTNode * second = first->get_sibling();
+    UCTNode * second = m_root->get_child(1);
     float second_probability = second->get_score();
     if (second_probability * 10.0f < best_probability) {
         myprintf("Allowing very early exit: score: %5.2f%% >> %5.2f%%\n",
@@ -367,15 +713,15 @@ bool UCTSearch::allow_easy_move() {
 }
 
 bool UCTSearch::allow_early_exit() {
-    if (!m_root.has_children()) {
+    if (!m_root->has_children()) {
         return false;
     }
 
     int color = m_rootstate.board.get_to_move();
-    m_root.sort_root_children(color);
+    m_root->sort_root_children(color);
 
     // do we have statistics on the moves?
-    UCTNode * first = m_root.get_first_child();
+    UCTNode * first = m_root->get_first_child();
     if (first != NULL) {
         if (first->first_visit()) {
             return false;
@@ -384,8 +730,9 @@ bool UCTSearch::allow_early_exit() {
         return false;
     }
 
-    UCTNode * second = first->get_sibling();
-    if (second != NULL) {
+    UCTNode * second = nullptr;
+    if (m_root->get_num_children() > 1) {
+        second = m_root->get_child(1);
         if (second->first_visit()) {
             // Stil not visited? Seems unlikely to happen then.
             return true;
@@ -533,24 +880,24 @@ int UCTSearch::get_best_move(passflag_t passflag) {
     int color = m_rootstate.board.get_to_move();    
 
     // make sure best is first
-    m_root.sort_root_children(color);
+    m_root->sort_root_children(color);
 
-    int bestmove = m_root.get_first_child()->get_move();
+    int bestmove = m_root->get_first_child()->get_move();
 
     // do we have statistics on the moves?
-    if (m_root.get_first_child() != NULL) {
-        if (m_root.get_first_child()->first_visit()) {
+    if (m_root->get_first_child() != NULL) {
+        if (m_root->get_first_child()->first_visit()) {
             return bestmove;
         }
     }
 
-    float bestscore = m_root.get_first_child()->get_winrate(color);
+    float bestscore = m_root->get_first_child()->get_winrate(color);
 
     // do we want to fiddle with the best move because of the rule set?
      if (passflag & UCTSearch::NOPASS) {
         // were we going to pass?
         if (bestmove == FastBoard::PASS) {
-            UCTNode * nopass = m_root.get_nopass_child();
+            UCTNode * nopass = m_root->get_nopass_child();
 
             if (nopass != NULL) {
                 myprintf("Preferring not to pass.\n");
@@ -597,7 +944,7 @@ int UCTSearch::get_best_move(passflag_t passflag) {
                 (score < 0.0f && color == FastBoard::BLACK)) {
                 myprintf("Passing loses :-(\n");
                 // find a valid non-pass move
-                UCTNode * nopass = m_root.get_nopass_child();
+                UCTNode * nopass = m_root->get_nopass_child();
                 if (nopass != NULL) {
                     myprintf("Avoiding pass because it loses.\n");
                     bestmove = nopass->get_move();
@@ -615,8 +962,8 @@ int UCTSearch::get_best_move(passflag_t passflag) {
         }
     }
 
-    float besteval = m_root.get_first_child()->get_eval(color);
-    int visits = m_root.get_first_child()->get_visits();
+    float besteval = m_root->get_first_child()->get_eval(color);
+    int visits = m_root->get_first_child()->get_visits();
 
     // if we aren't passing, should we consider resigning?
     if (bestmove != FastBoard::PASS) {
@@ -697,25 +1044,25 @@ void UCTSearch::dump_analysis(void) {
     GameState tempstate = m_rootstate;
     int color = tempstate.board.get_to_move();
 
-    std::string pvstring = get_pv(tempstate, m_root);
-    float winrate = 100.0f * m_root.get_winrate(color);
-    float mixrate = 100.0f * m_root.get_mixed_score(color);
+    std::string pvstring = get_pv(tempstate, *m_root);
+    float winrate = 100.0f * m_root->get_winrate(color);
+    float mixrate = 100.0f * m_root->get_mixed_score(color);
 
-    if (m_use_nets && m_root.get_evalcount()) {
-        float eval = 100.0f * m_root.get_eval(color);
+    if (m_use_nets && m_root->get_evalcount()) {
+        float eval = 100.0f * m_root->get_eval(color);
         myprintf("Nodes: %d, Win: %5.2f%% (MC:%5.2f%%/VN:%5.2f%%), PV: %s\n",
-                 m_root.get_visits(),
+                 m_root->get_visits(),
                  mixrate, winrate, eval, pvstring.c_str());
     } else {
         myprintf("Nodes: %d, Win: %5.2f%%, PV: %s\n",
-                 m_root.get_visits(), winrate, pvstring.c_str());
+                 m_root->get_visits(), winrate, pvstring.c_str());
     }
 
     if (!m_quiet) {
-        GUIprintf("Nodes: %d, Win: %5.2f%%, PV: %s", m_root.get_visits(),
+        GUIprintf("Nodes: %d, Win: %5.2f%%, PV: %s", m_root->get_visits(),
                    mixrate, pvstring.c_str());
     } else {
-        GUIprintf("%d nodes searched", m_root.get_visits());
+        GUIprintf("%d nodes searched", m_root->get_visits());
     }
 }
 
@@ -728,9 +1075,11 @@ bool UCTSearch::playout_limit_reached() {
 }
 
 void UCTWorker::operator()() {
+    SMP::NodeBinding binding(m_node);
+    KoState currstate;
     do {
-        KoState currstate = m_rootstate;
-        m_search->play_simulation(currstate, m_root);
+        currstate.reset_to(m_rootstate);
+        m_tree->play_simulation(currstate, m_root);
         m_search->increment_playouts();
     } while(m_search->is_running() && !m_search->playout_limit_reached());
 #ifdef USE_OPENCL
@@ -742,14 +1091,14 @@ std::tuple<float, float, float> UCTSearch::get_scores() {
     int color = m_rootstate.board.get_to_move();
 
     // make sure best is first
-    m_root.sort_root_children(color);
+    m_root->sort_root_children(color);
 
     // do we have statistics on the moves?
-    if (m_root.get_first_child() == nullptr) {
+    if (m_root->get_first_child() == nullptr) {
         return std::make_tuple(-1.0f, -1.0f, -1.0f);
     }
 
-    UCTNode* bestnode = m_root.get_first_child();
+    UCTNode* bestnode = m_root->get_first_child();
 
     float bestmc =
        (bestnode->first_visit() ? -1.0f : bestnode->get_winrate(FastBoard::BLACK));
@@ -773,6 +1122,9 @@ int UCTSearch::think(int color, passflag_t passflag) {
     // set side to move
     m_rootstate.board.set_to_move(color);
 
+    setup_parameters();
+    reuse_tree();
+
     // set up timing info
     Time start;
     int time_for_move;
@@ -823,42 +1175,54 @@ int UCTSearch::think(int color, passflag_t passflag) {
 #ifdef USE_SEARCH
     // create a sorted list off legal moves (make sure we
     // play something legal and decent even in time trouble)
-    m_root.create_children(m_nodes, m_rootstate, true, m_use_nets);
+    m_root->create_children(m_nodes, m_arena, m_rootstate, true, m_use_nets);
     if (m_use_nets) {
-        m_root.netscore_children(m_nodes, m_rootstate, true);
+        m_root->netscore_children(m_nodes, m_arena, m_rootstate, true);
     }
-    m_root.kill_superkos(m_rootstate);
+    m_root->kill_superkos(m_rootstate);
+    start_root_trees();
 
-    m_run = true;
+    TTable::get_TT()->new_search();
     m_playouts = 0;
 
-    int cpus = cfg_num_threads;
     ThreadGroup tg(thread_pool);
-    for (int i = 1; i < cpus; i++) {
-        tg.add_task(UCTWorker(m_rootstate, this, &m_root));
-    }
+    start_workers(tg);
 
     // If easy move precondition doesn't hold, pretend we
     // checked (and failed).
     bool easy_move_tested = !easy_move_precondition();
     bool keeprunning = true;
     int last_update = 0;
+    int last_merge = 0;
+    KoState currstate;
     do {
-        KoState currstate = m_rootstate;
+        currstate.reset_to(m_rootstate);
 
-        play_simulation(currstate, &m_root);
+        play_simulation(currstate, m_root);
         increment_playouts();
 
+        if (tree_needs_pruning()) {
+            stop_workers(tg);
+            prune_tree();
+            start_workers(tg);
+        }
+
         Time elapsed;
         int centiseconds_elapsed = Time::timediff(start, elapsed);
 
+        if (!m_trees.empty() && cfg_root_merge_cs > 0
+            && centiseconds_elapsed - last_merge >= cfg_root_merge_cs) {
+            last_merge = centiseconds_elapsed;
+            merge_root_trees();
+        }
+
         // output some stats every second
         // check if we should still search
         if (!m_analyzing) {
             if (centiseconds_elapsed - last_update > 250) {
                 last_update = centiseconds_elapsed;
                 dump_analysis();
-                dump_GUI_stats(m_rootstate, m_root);
+                dump_GUI_stats(m_rootstate, *m_root);
             }
             keeprunning = (centiseconds_elapsed < time_for_move
                            && (!m_hasrunflag || (*m_runflag)));
@@ -880,19 +1244,16 @@ int UCTSearch::think(int color, passflag_t passflag) {
             if (centiseconds_elapsed - last_update > 100) {
                 last_update = centiseconds_elapsed;
                 dump_analysis();
-                dump_GUI_stats(m_rootstate, m_root);
+                dump_GUI_stats(m_rootstate, *m_root);
             }
             keeprunning = (!m_hasrunflag || (*m_runflag));
         }
     } while(keeprunning);
 
     // stop the search
-    m_run = false;
-#ifdef USE_OPENCL
-    opencl.join_outstanding_cb();
-#endif
-    tg.wait_all();
-    if (!m_root.has_children()) {
+    stop_workers(tg);
+    stop_root_trees();
+    if (!m_root->has_children()) {
         return FastBoard::PASS;
     }
 #else
@@ -938,19 +1299,25 @@ int UCTSearch::think(int color, passflag_t passflag) {
     // display search info
     myprintf("\n");
 
-    dump_stats(m_rootstate, m_root);
-    dump_GUI_stats(m_rootstate, m_root);
+    dump_stats(m_rootstate, *m_root);
+    dump_GUI_stats(m_rootstate, *m_root);
 
     Time elapsed;
     int centiseconds_elapsed = Time::timediff(start, elapsed);
     if (centiseconds_elapsed > 0) {
-        myprintf("\n%d visits, %d nodes, %d playouts, %d p/s\n\n",
-                 m_root.get_visits(),
+        myprintf("\n%d visits, %d nodes, %d playouts, %d p/s\n",
+                 m_root->get_visits(),
                  (int)m_nodes,
                  (int)m_playouts,
                  (m_playouts * 100) / (centiseconds_elapsed+1));
+        dump_ttable_stats();
+        myprintf("Tree memory: %d kB in use, %d kB reserved, "
+                 "%d subtrees waiting to be freed\n\n",
+                 (int)(m_arena.get_bytes_in_use() / 1024),
+                 (int)(m_arena.get_bytes_reserved() / 1024),
+                 (int)TreeReclaimer::get_reclaimer()->get_backlog());
         GUIprintf("%d visits, %d nodes, %d playouts, %d p/s",
-                 m_root.get_visits(),
+                 m_root->get_visits(),
                   (int)m_nodes,
                   (int)m_playouts,
                  (m_playouts * 100) / (centiseconds_elapsed+1));
@@ -966,38 +1333,130 @@ int UCTSearch::think(int color, passflag_t passflag) {
 }
 
 void UCTSearch::ponder() {
+    setup_parameters();
+    reuse_tree();
+
     MCOwnerTable::get_MCO()->clear();
     Playout::mc_owner(m_rootstate, 64);
 
 #ifdef USE_SEARCH
-    m_run = true;
+    start_root_trees();
+    TTable::get_TT()->new_search();
     m_playouts = 0;
-    int cpus = cfg_num_threads;
     ThreadGroup tg(thread_pool);
-    for (int i = 1; i < cpus; i++) {
-        tg.add_task(UCTWorker(m_rootstate, this, &m_root));
-    }
+    start_workers(tg);
+    KoState currstate;
     do {
-        KoState currstate = m_rootstate;
-        play_simulation(currstate, &m_root);
+        currstate.reset_to(m_rootstate);
+        play_simulation(currstate, m_root);
         increment_playouts();
+
+        if (tree_needs_pruning()) {
+            stop_workers(tg);
+            prune_tree();
+            start_workers(tg);
+        }
     } while(!Utils::input_pending() && (!m_hasrunflag || (*m_runflag)));
 
     // stop the search
-    m_run = false;
-#ifdef USE_OPENCL
-    opencl.join_outstanding_cb();
-#endif
-    tg.wait_all();
+    stop_workers(tg);
+    stop_root_trees();
     // display search info
     myprintf("\n");
-    dump_stats(m_rootstate, m_root);
-    dump_GUI_stats(m_rootstate, m_root);
+    dump_stats(m_rootstate, *m_root);
+    dump_GUI_stats(m_rootstate, *m_root);
 
-    myprintf("\n%d visits, %d nodes\n\n", m_root.get_visits(), (int)m_nodes);
+    myprintf("\n%d visits, %d nodes\n\n", m_root->get_visits(), (int)m_nodes);
+    dump_ttable_stats();
 #endif
 }
 
+float UCTSearch::measure_speed(int centiseconds, int node) {
+    SMP::NodeBinding binding(node);
+    m_bind_node = node;
+    setup_parameters();
+    reuse_tree();
+
+    MCOwnerTable::get_MCO()->clear();
+    Playout::mc_owner(m_rootstate, 64);
+
+    m_playouts = 0;
+    Time start;
+    int centiseconds_elapsed;
+    ThreadGroup tg(thread_pool);
+    start_workers(tg);
+    KoState currstate;
+    do {
+        currstate.reset_to(m_rootstate);
+        play_simulation(currstate, m_root);
+        increment_playouts();
+
+        Time elapsed;
+        centiseconds_elapsed = Time::timediff(start, elapsed);
+    } while (centiseconds_elapsed < centiseconds);
+    stop_workers(tg);
+    m_bind_node = -1;
+
+    return (m_playouts * 100.0f) / (centiseconds_elapsed + 1);
+}
+
+void UCTSearch::scaling_benchmark(GameState & game, int centiseconds) {
+    const int old_threads = cfg_num_threads;
+    const bool old_virtual_loss = cfg_virtual_loss;
+
+    myprintf("threads     lock p/s    vloss p/s\n");
+    for (int threads = 1; threads <= 32; threads *= 2) {
+        cfg_num_threads = threads;
+        thread_pool.initialize(threads);
+
+        float speed[2];
+        for (int vloss = 0; vloss < 2; vloss++) {
+            cfg_virtual_loss = (vloss != 0);
+            // start every run from the same empty tree
+            TTable::get_TT()->clear();
+            std::unique_ptr<UCTSearch> search(new UCTSearch(game));
+            speed[vloss] = search->measure_speed(centiseconds);
+        }
+        myprintf("%7d %12.0f %12.0f\n", threads, speed[0], speed[1]);
+    }
+
+    cfg_num_threads = old_threads;
+    cfg_virtual_loss = old_virtual_loss;
+}
+
+void UCTSearch::numa_benchmark(GameState & game, int centiseconds) {
+    const int old_threads = cfg_num_threads;
+    const int nodes = SMP::get_num_numa_nodes();
+
+    myprintf("node  threads          p/s\n");
+    float total = 0.0f;
+    int total_threads = 0;
+    for (int node = 0; node < nodes; node++) {
+        cfg_num_threads = std::min(SMP::get_numa_node_cpus(node), MAX_CPUS);
+        thread_pool.initialize(cfg_num_threads);
+
+        TTable::get_TT()->clear();
+        std::unique_ptr<UCTSearch> search(new UCTSearch(game));
+        float speed = search->measure_speed(centiseconds, node);
+        myprintf("%4d %8d %12.0f\n", node, cfg_num_threads, speed);
+        total += speed;
+        total_threads += cfg_num_threads;
+    }
+    if (nodes > 1) {
+        // and all of them on one tree, which is what scaling is about
+        cfg_num_threads = std::min(total_threads, MAX_CPUS);
+        thread_pool.initialize(cfg_num_threads);
+
+        TTable::get_TT()->clear();
+        std::unique_ptr<UCTSearch> search(new UCTSearch(game));
+        float speed = search->measure_speed(centiseconds);
+        myprintf(" all %8d %12.0f (%.0f%% of the nodes on their own)\n",
+                 cfg_num_threads, speed, 100.0f * speed / total);
+    }
+
+    cfg_num_threads = old_threads;
+}
+
 void UCTSearch::set_playout_limit(int playouts) {
     if (playouts == 0) {
         m_maxplayouts = INT_MAX;
@@ -4,10 +4,13 @@
 #include <memory>
 #include <atomic>
 #include <tuple>
+#include <vector>
 
 #include "GameState.h"
 #include "UCTNode.h"
 #include "Playout.h"
+#include "NodeArena.h"
+#include "ThreadPool.h"
 
 class UCTSearch {
 public:
@@ -22,11 +25,19 @@ public:
     static const passflag_t NORESIGN = 1 << 1;
 
     /*
-        Maximum size of the tree in memory.
+        Default memory budget of the tree, room for about ten
+        million nodes. The search prunes rarely visited branches
+        when it gets close to the budget, see prune_tree().
     */
-    static constexpr int MAX_TREE_SIZE = 10000000;
+    static constexpr size_t DEFAULT_TREE_MEMORY =
+        (size_t)10000000 * UCTChildren::SLOT_SIZE;
 
+    /*
+        The search tree is kept between calls to think() and ponder(),
+        and reused when the game has moved on to one of its subtrees.
+    */
     UCTSearch(GameState & g);
+    ~UCTSearch();
     int think(int color, passflag_t passflag = NORMAL);
     void set_playout_limit(int playouts);
     void set_use_nets(bool usenets);
@@ -37,14 +48,31 @@ public:
     bool is_running();
     bool playout_limit_reached();
     void increment_playouts();
-    Playout play_simulation(KoState & currstate, UCTNode * const node);
+    /*
+        parent are the children node is one of, nullptr at the root
+    */
+    Playout play_simulation(KoState & currstate, UCTNode * const node,
+                            UCTChildren * const parent = nullptr);
     std::tuple<float, float, float> get_scores();
 
+    /*
+        Playouts per second at 1 to 32 threads, with and
+        without virtual loss. Both benchmarks clear the TTable,
+        GTP refuses them while it is shared.
+    */
+    static void scaling_benchmark(GameState & game, int centiseconds);
+    /*
+        Search speed with the threads of each NUMA node on their
+        own, and with all of them sharing one tree.
+    */
+    static void numa_benchmark(GameState & game, int centiseconds);
+
 private:
     void dump_stats(KoState & state, UCTNode & parent);
     void dump_GUI_stats(GameState & state, UCTNode & parent);
     std::string get_pv(KoState & state, UCTNode & parent);
     void dump_thinking();
+    void dump_ttable_stats();
     void dump_analysis();
     void dump_order2(void);
     int get_best_move(passflag_t passflag);
@@ -53,13 +81,59 @@ private:
     bool allow_early_exit();
     bool allow_easy_move();
     bool easy_move_precondition();
+    void setup_parameters();
+    void reuse_tree();
+    void promote_child(UCTNode * child);
+    void discard_subtree(UCTNode * node);
+    void new_root();
+    void start_workers(Utils::ThreadGroup & tg);
+    void stop_workers(Utils::ThreadGroup & tg);
+    bool tree_needs_pruning() const;
+    void prune_tree();
+    void start_root_trees();
+    void merge_root_trees();
+    void stop_root_trees();
+    void unmerge_root_trees();
+    float measure_speed(int centiseconds, int node = -1);
 
     GameState & m_rootstate;
-    UCTNode m_root;
+    NodeArena m_arena;
+    UCTNode * m_root;
+    // block holding m_root, nullptr if allocated on its own
+    UCTChildren * m_rootblock;
+    // position m_root was searched from
+    KoState m_treestate;
+    bool m_has_tree;
+    size_t m_max_memory;
+    // shares statistics with other searches through the TTable
+    bool m_use_ttable;
+
+    /*
+        Root parallel mode: extra trees searched by their own
+        threads, without any shared nodes, and merged into the
+        root children of this one. They only live for one search.
+    */
+    struct MergedStats {
+        int m_visits;
+        double m_blackwins;
+        int m_evalcount;
+        double m_blackevals;
+    };
+    std::vector<std::unique_ptr<UCTSearch>> m_trees;
+    // what was merged so far, per tree and vertex
+    std::vector<std::vector<MergedStats>> m_merged;
+    /*
+        The same summed over the trees. No subtree stands behind
+        these visits, so they come out of our root again before
+        the tree is reused, and the TTable never sees them.
+    */
+    std::vector<MergedStats> m_merged_total;
     std::atomic<int> m_nodes;
     std::atomic<int> m_playouts;
     std::atomic<bool> m_run;
     int m_maxplayouts;
+    // NUMA node all search threads run on, -1 for no preference
+    int m_bind_node;
 
     // For external control
     bool m_hasrunflag;
@@ -73,13 +147,20 @@ private:
 
 class UCTWorker {
 public:
-    UCTWorker(GameState & state, UCTSearch * search, UCTNode * root)
-      : m_rootstate(state), m_search(search), m_root(root) {};
+    UCTWorker(GameState & state, UCTSearch * search, UCTSearch * tree,
+              UCTNode * root, int node)
+      : m_rootstate(state), m_search(search), m_tree(tree), m_root(root),
+        m_node(node) {};
     void operator()();
 private:
     GameState & m_rootstate;
+    // search that counts the playouts and decides when to stop
     UCTSearch * m_search;
+    // search whose tree we work in, differs in root parallel mode
+    UCTSearch * m_tree;
     UCTNode * m_root;
+    // NUMA node to run on, -1 for wherever the pool put us
+    int m_node;
 };
 
 #endif
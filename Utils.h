@@ -12,6 +12,7 @@
 #include "ThreadPool.h"
 
 #ifdef _MSC_VER
+#include <intrin.h>
 #define ASSUME_ALIGNED(p, n) \
 __assume((reinterpret_cast<std::size_t>(p) & ((n) - 1)) == 0)
 #else
@@ -48,6 +49,17 @@ namespace Utils {
         return (uintptr_t(ptr) & (alignment - 1)) == 0;
     }
 
+    // index of the lowest set bit, x must not be zero
+    inline int lowest_bit(uint64 x) {
+#ifdef _MSC_VER
+        unsigned long idx;
+        _BitScanForward64(&idx, x);
+        return (int)idx;
+#else
+        return __builtin_ctzll(x);
+#endif
+    }
+
     template<typename T>
     T rotl(const T x, const int k) {
 	    return (x << k) | (x >> (std::numeric_limits<T>::digits - k));
@@ -22,10 +22,14 @@
 //#define USE_BLAS
 //#define USE_OPENBLAS
 //#define USE_MKL
+// CPU network with our own SIMD kernels, instead of USE_BLAS
+//#define USE_NATIVE_CPU
 //#define USE_CAFFE
 #define USE_OPENCL
 //#define USE_TUNER
 #define USE_SEARCH
+// per call site lock statistics, see the lockstats GTP command
+//#define USE_LOCK_STATS
 
 #define PROGRAM_NAME "Leela"
 #ifdef KGS
@@ -34,6 +38,19 @@
 #define PROGRAM_VERSION "0.11.0"
 #endif
 
+#if defined(USE_BLAS) && defined(USE_NATIVE_CPU)
+#error "Define only one of USE_BLAS and USE_NATIVE_CPU"
+#endif
+
+#if (defined(USE_BLAS) || defined(USE_NATIVE_CPU)) && !defined(USE_OPENCL)
+#define USE_CPU_NETWORK
+#endif
+
+// Batch CPU network evaluations from all search threads
+#ifdef USE_CPU_NETWORK
+#define USE_NNQUEUE
+#endif
+
 // OpenBLAS limitation
 #if defined(USE_BLAS) && defined(USE_OPENBLAS)
 #define MAX_CPUS 64
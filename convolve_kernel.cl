@@ -350,29 +350,16 @@ __kernel void merge(
 __kernel void batchnorm(
                         __global const float * in,
                         __global float * out,
-                        __constant const float * means,
-                        __constant const float * variances,
-                        __constant const float * scale) {
+                        __constant const float * scales,
+                        __constant const float * shifts) {
 
-    // cl::NDRange global(outputs, 19*19);
-    const int gx = get_global_id(0);
-    const int gy = get_global_id(1);
-
-    const int output = gx;
-    const int outputs      = get_global_size(0);
+    // cl::NDRange global(outputs, channel_size);
+    const int o = get_global_id(0);
+    const int b = get_global_id(1);
     const int channel_size = get_global_size(1);
 
-    const unsigned int o = output;
-    const unsigned int b = gy;
-
-    const float epsilon = 1e-5;
-
-    const float mean = means[o] / scale[0];
-    const float variance = epsilon + variances[o] / scale[0];
-    const float scale_stddiv = 1.0f / sqrt(variance);
-
-    out[o * channel_size + b] = scale_stddiv
-                                * (in[o * channel_size + b] - mean);
+    out[o * channel_size + b] = scales[o] * in[o * channel_size + b]
+                                + shifts[o];
 }
 
 __kernel void innerproduct(